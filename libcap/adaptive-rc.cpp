@@ -0,0 +1,156 @@
+#include "libcap/adaptive-rc.h"
+
+#include "libcap/ffmpeg-wrapper.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+extern "C" {
+#include <libavutil/common.h>
+#include <libavutil/pixdesc.h>
+}
+
+namespace
+{
+    // the content of AVFrame::opaque_ref, binary since the frames are tagged on the hot path
+    struct tag_t
+    {
+        uint32_t magic{ MKTAG('A', 'C', 'T', 'V') };
+        float    activity{};
+    };
+} // namespace
+
+// pixels, the rows 8, 24, 40 & 56 of a block are compared
+static constexpr int BLOCK = 64;
+
+namespace activity
+{
+    bool measurable(const AVFrame *frame)
+    {
+        if (!frame || !frame->data[0] || frame->hw_frames_ctx || frame->width <= 0 || frame->height <= 0)
+            return false;
+
+        const auto desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+        return desc && !(desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)) &&
+               desc->comp[0].plane == 0 && desc->comp[0].step > 0;
+    }
+
+    float measure(const AVFrame *prev, const AVFrame *frame)
+    {
+        if (!measurable(prev) || !measurable(frame) || prev->format != frame->format ||
+            prev->width != frame->width || prev->height != frame->height)
+            return -1.0f;
+
+        // the first plane only: the pixels of the packed RGB formats, the luma of the YUV ones
+        const auto bpp  = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format))->comp[0].step;
+        const auto cols = (frame->width + BLOCK - 1) / BLOCK;
+
+        thread_local std::vector<uint8_t> changed{};
+        changed.assign(cols, 0);
+
+        size_t nb_blocks = 0, nb_changed = 0;
+        for (int y = 0; y < frame->height; y += BLOCK) {
+            const auto rows = std::min(BLOCK, frame->height - y);
+
+            // row by row across the blocks, in the order of the memory
+            for (int r = std::min(BLOCK / 8, rows / 2); r < rows; r += BLOCK / 4) {
+                const auto a = prev->data[0] + static_cast<ptrdiff_t>(y + r) * prev->linesize[0];
+                const auto b = frame->data[0] + static_cast<ptrdiff_t>(y + r) * frame->linesize[0];
+
+                for (int c = 0; c < cols; ++c) {
+                    if (changed[c]) continue;
+
+                    const auto x     = static_cast<size_t>(c) * BLOCK * bpp;
+                    const auto bytes = static_cast<size_t>(std::min(BLOCK, frame->width - c * BLOCK)) * bpp;
+
+                    changed[c] = std::memcmp(a + x, b + x, bytes) != 0;
+                }
+            }
+
+            nb_blocks  += cols;
+            nb_changed += std::count(changed.begin(), changed.end(), 1);
+            std::fill(changed.begin(), changed.end(), 0);
+        }
+
+        return nb_blocks ? static_cast<float>(nb_changed) / static_cast<float>(nb_blocks) : -1.0f;
+    }
+
+    void tag(AVFrame *frame, const float activity)
+    {
+        if (!frame || activity < 0) return;
+
+        // from the pool, only the reference itself is allocated
+        av_buffer_unref(&frame->opaque_ref);
+        if (frame->opaque_ref = av::pool::buffer(sizeof(tag_t)); !frame->opaque_ref) return;
+
+        const tag_t tag{ .activity = activity };
+        std::memcpy(frame->opaque_ref->data, &tag, sizeof(tag_t));
+    }
+
+    float get(const AVFrame *frame)
+    {
+        if (!frame || !frame->opaque_ref || static_cast<size_t>(frame->opaque_ref->size) < sizeof(tag_t))
+            return -1.0f;
+
+        tag_t tag{};
+        const auto magic = tag.magic;
+        std::memcpy(&tag, frame->opaque_ref->data, sizeof(tag_t));
+
+        return tag.magic == magic ? tag.activity : -1.0f;
+    }
+} // namespace activity
+
+adaptive_rc::adaptive_rc(const options_t& options)
+    : options_(options)
+{}
+
+adaptive_rc::decision_t adaptive_rc::update(const float activity)
+{
+    stats_.frames++;
+    since_key_++;
+
+    if (activity < 0) {
+        stats_.unmeasured++;
+
+        state_ = state_t::normal;
+        idle_  = 0;
+    }
+    else {
+        ema_  = (ema_ < 0) ? activity : ema_ * 0.8f + activity * 0.2f;
+        idle_ = (activity <= options_.still_threshold) ? idle_ + 1 : 0;
+
+        // a burst is motion at once, the scene is still only after a while
+        if (activity >= options_.motion_threshold || ema_ >= options_.motion_threshold)
+            state_ = state_t::motion;
+        else if (idle_ >= options_.hold)
+            state_ = state_t::still;
+        else
+            state_ = state_t::normal;
+    }
+
+    decision_t decision{};
+
+    switch (state_) {
+    case state_t::still:
+        stats_.still++;
+        decision.qoffset = options_.still_qoffset;
+        break;
+
+    case state_t::motion:
+        stats_.motion++;
+        decision.qoffset = options_.motion_qoffset;
+        [[fallthrough]];
+
+    case state_t::normal:
+        // the GOP is extended while still, and closed as soon as the scene moves again
+        if (since_key_ >= options_.gop) {
+            decision.keyframe = true;
+            since_key_        = 0;
+            stats_.keyframes++;
+        }
+        break;
+    }
+
+    return decision;
+}
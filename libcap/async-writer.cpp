@@ -0,0 +1,299 @@
+#include "libcap/async-writer.h"
+
+#include "libcap/media.h"
+#include "logging.h"
+
+#include <cstring>
+#include <filesystem>
+#include <probe/thread.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+extern "C" {
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+}
+
+// the logical block size of the O_DIRECT writes
+static constexpr size_t ALIGNMENT = 4096;
+
+// 64 KiB, the size of the AVIOContext buffer, which is copied into the blocks
+static constexpr int IO_BUFFER_SIZE = 64 * 1024;
+
+#ifdef __linux__
+static int pwrite_all(const int fd, const uint8_t *data, size_t size, int64_t offset)
+{
+    while (size) {
+        const auto n = ::pwrite(fd, data, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return AVERROR(errno);
+        }
+
+        data   += n;
+        size   -= n;
+        offset += n;
+    }
+    return 0;
+}
+#endif
+
+int async_writer::open(const std::string& filename, const options_t& options)
+{
+    options_            = options;
+    options_.block_size = FFALIGN(std::max<size_t>(options.block_size, IO_BUFFER_SIZE), ALIGNMENT);
+
+    const auto nb_blocks = std::max<size_t>(options_.buffer_size / options_.block_size, 2);
+
+#ifdef __linux__
+    fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        loge("[    AIO-OUT] failed to open '{}': {}", filename, std::strerror(errno));
+        return -1;
+    }
+
+    // the aligned part of the blocks bypasses the page cache, the rest goes through fd_
+    if (options_.direct && (dfd_ = ::open(filename.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC)) < 0) {
+        logw("[    AIO-OUT] O_DIRECT is not supported: {}", std::strerror(errno));
+    }
+
+    // extends the file, truncated to its real size at close()
+    if (options_.preallocate > 0 && ::posix_fallocate(fd_, 0, options_.preallocate) != 0) {
+        logw("[    AIO-OUT] failed to preallocate {} bytes", options_.preallocate);
+    }
+#else
+    const auto path = std::filesystem::path(std::u8string(filename.begin(), filename.end()));
+    file_.open(path, std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!file_) {
+        loge("[    AIO-OUT] failed to open '{}'", filename);
+        return -1;
+    }
+#endif
+
+    blocks_ = std::make_unique<spsc_queue<block_t>>(nb_blocks, options_.buffer_size);
+    blocks_->enable_telemetry("muxer.io");
+
+    const auto buffer = static_cast<uint8_t *>(av_malloc(IO_BUFFER_SIZE));
+    if (!buffer) return av::NOMEM;
+
+    pb_ = avio_alloc_context(buffer, IO_BUFFER_SIZE, 1, this, nullptr, write_packet, seek);
+    if (!pb_) {
+        av_free(buffer);
+        return av::NOMEM;
+    }
+    pb_->seekable = AVIO_SEEKABLE_NORMAL;
+
+    position_ = 0;
+    size_     = 0;
+
+    thread_ = std::jthread([this] { io_thread_fn(); });
+
+    logi("[    AIO-OUT] '{}', buffer = {} MiB, block = {} KiB, direct = {}, preallocate = {} MiB",
+         filename, options_.buffer_size >> 20, options_.block_size >> 10, options_.direct,
+         options_.preallocate >> 20);
+    return 0;
+}
+
+int async_writer::write_packet(void *opaque, write_buffer_t buf, const int size)
+{
+    const auto self = static_cast<async_writer *>(opaque);
+    if (self->errors_) return AVERROR(EIO);
+
+    auto& block = self->block_;
+
+    // seeked, continue in a new block
+    if (block.data && block.offset + static_cast<int64_t>(block.size) != self->position_) {
+        if (self->flush_block() < 0) return AVERROR(EIO);
+    }
+
+    for (int copied = 0; copied < size;) {
+        if (!block.data) {
+#ifdef __linux__
+            block.data = { static_cast<uint8_t *>(std::aligned_alloc(ALIGNMENT, self->options_.block_size)),
+                           std::free };
+#else
+            block.data = { static_cast<uint8_t *>(av_malloc(self->options_.block_size)), av_free };
+#endif
+            if (!block.data) return AVERROR(ENOMEM);
+
+            block.offset = self->position_;
+            block.size   = 0;
+        }
+
+        const auto n = std::min<size_t>(size - copied, self->options_.block_size - block.size);
+        std::memcpy(block.data.get() + block.size, buf + copied, n);
+
+        block.size      += n;
+        copied          += static_cast<int>(n);
+        self->position_ += static_cast<int64_t>(n);
+
+        if (block.size == self->options_.block_size && self->flush_block() < 0) return AVERROR(EIO);
+    }
+
+    self->size_ = std::max(self->size_, self->position_);
+
+    return size;
+}
+
+int64_t async_writer::seek(void *opaque, const int64_t offset, const int whence)
+{
+    const auto self = static_cast<async_writer *>(opaque);
+
+    int64_t position = 0;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE: return self->size_;
+    case SEEK_SET:    position = offset; break;
+    case SEEK_CUR:    position = self->position_ + offset; break;
+    case SEEK_END:    position = self->size_ + offset; break;
+    default:          return AVERROR(EINVAL);
+    }
+
+    if (position < 0) return AVERROR(EINVAL);
+
+    self->position_ = position;
+    return position;
+}
+
+int async_writer::flush_block()
+{
+    if (!block_.data || !block_.size) return 0;
+
+    // blocks while the buffer is full, the waits are recorded by the telemetry of the queue
+    if (!blocks_->wait_and_push(std::move(block_))) return -1;
+
+    block_ = {};
+    return 0;
+}
+
+void async_writer::io_thread_fn()
+{
+    probe::thread::set_name("MUXER-IO");
+
+    while (const auto block = blocks_->wait_and_pop()) {
+        if (block->eof) break;
+
+        const auto begin = queue_telemetry::now();
+        if (write_block(block.value()) < 0) {
+            errors_++;
+            continue;
+        }
+        latency_.record(std::max<int64_t>(queue_telemetry::now() - begin, 0));
+        written_ += block->size;
+    }
+}
+
+int async_writer::write_block(const block_t& block)
+{
+    const auto data = block.data.get();
+
+#ifdef __linux__
+    size_t done = 0;
+
+    if (dfd_ >= 0 && block.offset % ALIGNMENT == 0) {
+        const auto aligned = block.size / ALIGNMENT * ALIGNMENT;
+        if (const auto ret = aligned ? pwrite_all(dfd_, data, aligned, block.offset) : 0; ret < 0) {
+            logw("[    AIO-OUT] O_DIRECT write failed: {}, fall back to buffered writes",
+                 av::ff_errstr(ret));
+            ::close(dfd_);
+            dfd_ = -1;
+        }
+        else {
+            done = aligned;
+        }
+    }
+
+    if (const auto ret = pwrite_all(fd_, data + done, block.size - done, block.offset + done); ret < 0) {
+        loge("[    AIO-OUT] failed to write {} bytes at {}: {}", block.size - done, block.offset + done,
+             av::ff_errstr(ret));
+        return ret;
+    }
+#else
+    file_.seekp(block.offset);
+    file_.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(block.size));
+    if (!file_) {
+        loge("[    AIO-OUT] failed to write {} bytes at {}", block.size, block.offset);
+        file_.clear();
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+int async_writer::flush()
+{
+    if (!pb_) return -1;
+
+    avio_flush(pb_);
+    return flush_block();
+}
+
+int async_writer::close()
+{
+    int ret = 0;
+
+    if (pb_) {
+        avio_flush(pb_);
+
+        ret = flush_block();
+
+        block_t eof{};
+        eof.eof = true;
+        blocks_->wait_and_push(std::move(eof));
+
+        if (thread_.joinable()) thread_.join();
+    }
+
+#ifdef __linux__
+    // release the preallocated space beyond the end
+    if (fd_ >= 0 && options_.preallocate > 0 && ::ftruncate(fd_, size_) < 0) {
+        logw("[    AIO-OUT] failed to truncate the file to {} bytes", size_);
+    }
+
+    if (dfd_ >= 0) ::close(dfd_);
+    if (fd_ >= 0 && ::close(fd_) < 0) ret = -1;
+    dfd_ = fd_ = -1;
+#else
+    if (file_.is_open()) {
+        file_.close();
+        if (!file_) ret = -1;
+    }
+#endif
+
+    if (!pb_) return ret;
+
+    av_freep(&pb_->buffer);
+    avio_context_free(&pb_);
+
+    const auto stats = this->stats();
+    logi("[    AIO-OUT] written = {} bytes, write(ms) p50 = {:.2f}, p99 = {:.2f}, max = {:.2f} | "
+         "blocked(ms) p99 = {:.2f}, max = {:.2f} | high water = {} blocks, errors = {}",
+         stats.written, stats.latency.percentile(0.5) / 1e6, stats.latency.percentile(0.99) / 1e6,
+         stats.latency.max / 1e6, stats.blocked.percentile(0.99) / 1e6, stats.blocked.max / 1e6,
+         stats.high_water, stats.errors);
+
+    return errors_ ? -1 : ret;
+}
+
+async_writer::stats_t async_writer::stats() const
+{
+    const auto telemetry = blocks_ ? blocks_->telemetry() : nullptr;
+
+    return {
+        .latency    = latency_.snapshot(),
+        .blocked    = telemetry ? telemetry->push_wait.snapshot() : log_histogram::snapshot_t{},
+        .written    = written_.load(),
+        .buffered   = blocks_ ? blocks_->bytes() : 0,
+        .capacity   = options_.buffer_size,
+        .high_water = telemetry ? telemetry->high_water.load() : 0,
+        .errors     = errors_.load(),
+    };
+}
+
+async_writer::~async_writer()
+{
+    close();
+}
@@ -1,131 +1,225 @@
 #include "libcap/audio-fifo.h"
 
-safe_audio_fifo::safe_audio_fifo(AVSampleFormat sample_fmt, int channels, int capacity)
-    : capacity_(capacity)
-{
-    buffer_ = av_audio_fifo_alloc(sample_fmt, channels, capacity);
-}
+#include <algorithm>
+#include <cstring>
 
-safe_audio_fifo::~safe_audio_fifo()
-{
-    std::lock_guard lock(mtx_);
-    av_audio_fifo_free(buffer_);
+extern "C" {
+#include <libavutil/mem.h>
 }
 
-bool safe_audio_fifo::empty() const
+spsc_audio_fifo::spsc_audio_fifo(const AVSampleFormat sample_fmt, const int channels, const int capacity)
+    : channels_(av_sample_fmt_is_planar(sample_fmt) ? std::clamp(channels, 1, AV_NUM_DATA_POINTERS)
+                                                    : std::max(channels, 1)),
+      planes_(av_sample_fmt_is_planar(sample_fmt) ? channels_ : 1),
+      capacity_(std::max(capacity, 1)),
+      sample_size_(av_get_bytes_per_sample(sample_fmt) * (channels_ / planes_)),
+      sample_fmt_(sample_fmt)
 {
-    std::lock_guard lock(mtx_);
-    return stopped_ || av_audio_fifo_size(buffer_) == 0;
+    plane_size_ = FFALIGN(static_cast<size_t>(capacity_) * sample_size_, 64);
+    buffer_     = static_cast<uint8_t *>(av_malloc(plane_size_ * planes_));
+
+    for (auto& view : views_) {
+        view.owner = this;
+    }
 }
 
-int safe_audio_fifo::size() const
+spsc_audio_fifo::~spsc_audio_fifo() { av_freep(&buffer_); }
+
+int spsc_audio_fifo::size() const
 {
-    std::lock_guard lock(mtx_);
-    return stopped_ ? 0 : av_audio_fifo_size(buffer_);
+    if (stopped()) return 0;
+
+    return static_cast<int>(tail_.load() - head_.load());
 }
 
-int safe_audio_fifo::capacity() const
+uint64_t spsc_audio_fifo::reclaim()
 {
-    std::lock_guard lock(mtx_);
-    return capacity_;
+    // load the head before the views: a view is published before the head passes it
+    const auto head = head_.load();
+    const auto tail = views_tail_.load();
+
+    auto vhead = views_head_.load(std::memory_order_relaxed);
+    while (vhead < tail && views_[vhead % MAX_VIEWS].released.load()) {
+        ++vhead;
+    }
+    views_head_.store(vhead);
+
+    return vhead < tail ? views_[vhead % MAX_VIEWS].begin : head;
 }
 
-int safe_audio_fifo::reserve(int capacity)
+int spsc_audio_fifo::write(const uint8_t *const *data, const int nb_samples, const int64_t pts)
 {
-    std::lock_guard lock(mtx_);
+    if (stopped() || nb_samples <= 0 || !buffer_) return 0;
 
-    capacity_ = capacity;
+    const auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail + nb_samples - reclaim() > static_cast<uint64_t>(capacity_)) {
+        if (telemetry_) telemetry_->discard(nb_samples);
+        return 0;
+    }
 
-    const int ret = av_audio_fifo_realloc(buffer_, capacity_);
+    if (pts != AV_NOPTS_VALUE) origin_.store(pts - static_cast<int64_t>(tail));
 
-    nonfull_.notify_all();
+    // the only copy, split at the wrap point
+    const size_t offset = tail % capacity_;
+    const size_t first  = std::min<size_t>(nb_samples, capacity_ - offset);
+    for (int i = 0; i < planes_; ++i) {
+        auto plane = buffer_ + i * plane_size_;
+        std::memcpy(plane + offset * sample_size_, data[i], first * sample_size_);
+        std::memcpy(plane, data[i] + first * sample_size_, (nb_samples - first) * sample_size_);
+    }
+
+    if (telemetry_) {
+        const auto stamps = stamps_tail_.load(std::memory_order_relaxed);
+        stamps_[stamps % MAX_STAMPS].end.store(tail + nb_samples);
+        stamps_[stamps % MAX_STAMPS].ts.store(queue_telemetry::now());
+        stamps_tail_.store(stamps + 1);
+    }
 
-    return ret;
+    tail_.store(tail + nb_samples);
+
+    if (telemetry_) telemetry_->pushed(tail + nb_samples - head_.load());
+
+    return nb_samples;
 }
 
-int safe_audio_fifo::write(void **data, int nb_samples)
+int spsc_audio_fifo::wait_and_write(const uint8_t *const *data, const int nb_samples, const int64_t pts)
 {
-    std::unique_lock lock(mtx_);
+    if (nb_samples > capacity_) return 0;
 
-    if (nb_samples > capacity_ - av_audio_fifo_size(buffer_)) return 0;
+    const auto ready = [=, this] {
+        return stopped() || tail_.load(std::memory_order_relaxed) + nb_samples - reclaim() <=
+                                static_cast<uint64_t>(capacity_);
+    };
 
-    nb_samples = av_audio_fifo_write(buffer_, data, nb_samples);
+    if (ready()) return write(data, nb_samples, pts);
 
-    nonempty_.notify_all();
+    wait_timer timer(telemetry_ ? &telemetry_->push_wait : nullptr);
 
-    return nb_samples;
+    // see spsc_queue: announce the wait before re-checking, the consumer checks the announcement
+    while (!ready()) {
+        const auto seq = nonfull_.load();
+
+        push_waiting_.store(true);
+        if (!ready()) nonfull_.wait(seq);
+        push_waiting_.store(false);
+    }
+
+    return write(data, nb_samples, pts);
 }
 
-int safe_audio_fifo::wait_and_write(void **data, int nb_samples)
+int spsc_audio_fifo::read(av::frame& frame, const int nb_samples)
 {
-    std::unique_lock lock(mtx_);
-    nonfull_.wait(lock,
-                  [=, this] { return stopped_ || nb_samples < capacity_ - av_audio_fifo_size(buffer_); });
+    if (stopped() || nb_samples <= 0) return 0;
 
-    if (stopped_) return 0;
+    const auto head = head_.load(std::memory_order_relaxed);
+    const auto n    = static_cast<int>(std::min<uint64_t>(nb_samples, tail_.load() - head));
+    if (n <= 0) return 0;
 
-    nb_samples = av_audio_fifo_write(buffer_, data, nb_samples);
+    const size_t offset = head % capacity_;
+    const auto   vtail  = views_tail_.load(std::memory_order_relaxed);
 
-    nonempty_.notify_all();
+    frame.unref();
 
-    return nb_samples;
-}
+    // zero-copy: one buffer reference covering the same range of all planes
+    if (offset + n <= static_cast<size_t>(capacity_) && vtail - views_head_.load() < MAX_VIEWS) {
+        auto& view    = views_[vtail % MAX_VIEWS];
+        view.begin    = head;
+        view.released = false;
 
-int safe_audio_fifo::read(void **data, int nb_samples)
-{
-    std::unique_lock lock(mtx_);
+        const auto data = buffer_ + offset * sample_size_;
+        const auto size = (planes_ - 1) * plane_size_ + n * sample_size_;
+        frame->buf[0]   = av_buffer_create(data, size, release_view, &view, 0);
+        if (frame->buf[0]) {
+            views_tail_.store(vtail + 1);
+            nb_views_++;
 
-    nb_samples = av_audio_fifo_read(buffer_, data, nb_samples);
+            for (int i = 0; i < planes_; ++i) {
+                frame->data[i] = data + i * plane_size_;
+            }
+            frame->linesize[0] = n * sample_size_;
+        }
+    }
 
-    nonfull_.notify_all();
+    // copy
+    if (!frame->buf[0]) {
+        const int size = av_samples_get_buffer_size(nullptr, channels_, n, sample_fmt_, 0);
+        if (size < 0) return size;
 
-    return nb_samples;
-}
+        frame->buf[0] = av::pool::buffer(size);
+        if (!frame->buf[0]) return AVERROR(ENOMEM);
 
-int safe_audio_fifo::wait_and_read(void **data, int nb_samples)
-{
-    std::unique_lock lock(mtx_);
-    nonempty_.wait(lock, [=, this] { return stopped_ || nb_samples <= av_audio_fifo_size(buffer_); });
+        av_samples_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, channels_, n, sample_fmt_,
+                               0);
 
-    nb_samples = av_audio_fifo_read(buffer_, data, nb_samples);
+        const size_t first = std::min<size_t>(n, capacity_ - offset);
+        for (int i = 0; i < planes_; ++i) {
+            const auto plane = buffer_ + i * plane_size_;
+            std::memcpy(frame->data[i], plane + offset * sample_size_, first * sample_size_);
+            std::memcpy(frame->data[i] + first * sample_size_, plane, (n - first) * sample_size_);
+        }
 
-    nonfull_.notify_all();
+        nb_copies_++;
+    }
 
-    return nb_samples;
-}
+    frame->extended_data = frame->data;
+    frame->nb_samples    = n;
+    frame->format        = sample_fmt_;
 
-int safe_audio_fifo::peek(void **data, int nb_samples) const
-{
-    std::unique_lock lock(mtx_);
-    return av_audio_fifo_peek(buffer_, data, nb_samples);
-}
+    const auto origin = origin_.load();
+    frame->pts        = (origin == AV_NOPTS_VALUE) ? AV_NOPTS_VALUE : origin + static_cast<int64_t>(head);
 
-void safe_audio_fifo::drain()
-{
-    std::unique_lock lock(mtx_);
+    // sojourn of the first sample, the stamps of skipped writes may have been overwritten already
+    if (telemetry_) {
+        const auto stamps = stamps_tail_.load();
 
-    av_audio_fifo_reset(buffer_);
+        stamps_head_ = std::max(stamps_head_, stamps - std::min<uint64_t>(stamps, MAX_STAMPS));
+        while (stamps_head_ < stamps && stamps_[stamps_head_ % MAX_STAMPS].end.load() <= head) {
+            ++stamps_head_;
+        }
 
-    nonfull_.notify_all();
+        if (stamps_head_ < stamps) telemetry_->popped(stamps_[stamps_head_ % MAX_STAMPS].ts.load());
+    }
+
+    head_.store(head + n);
+
+    if (push_waiting_.load()) {
+        nonfull_.fetch_add(1);
+        nonfull_.notify_one();
+    }
+
+    return n;
 }
 
-void safe_audio_fifo::stop()
+void spsc_audio_fifo::release_view(void *opaque, uint8_t *)
 {
-    std::unique_lock lock(mtx_);
+    const auto view = static_cast<view_t *>(opaque);
+    view->released.store(true);
+
+    // may be called from any thread holding the last reference
+    auto owner = view->owner;
+    if (owner->push_waiting_.load()) {
+        owner->nonfull_.fetch_add(1);
+        owner->nonfull_.notify_one();
+    }
+}
 
-    stopped_ = true;
+void spsc_audio_fifo::drain()
+{
+    const auto tail = tail_.load();
+    if (telemetry_) telemetry_->discard(tail - head_.load());
 
+    head_.store(tail);
+
+    nonfull_.fetch_add(1);
     nonfull_.notify_all();
-    nonempty_.notify_all();
 }
 
-void safe_audio_fifo::start()
-{
-    std::unique_lock lock(mtx_);
+void spsc_audio_fifo::start() { stopped_.store(false); }
 
-    stopped_ = false;
+void spsc_audio_fifo::stop()
+{
+    stopped_.store(true);
 
+    nonfull_.fetch_add(1);
     nonfull_.notify_all();
-    nonempty_.notify_all();
 }
-
@@ -1,11 +1,14 @@
 #include "libcap/dispatcher.h"
 
+#include "libcap/adaptive-rc.h"
 #include "libcap/clock.h"
 #include "libcap/devices.h"
 #include "libcap/filter.h"
+#include "libcap/trace.h"
 #include "logging.h"
 
 #include <fmt/chrono.h>
+#include <fmt/ranges.h>
 #include <probe/defer.h>
 
 extern "C" {
@@ -15,50 +18,148 @@ extern "C" {
 #include <libavutil/time.h>
 }
 
+// instance names of the scales pinning the size of the video outputs, see set_crop
+static constexpr std::string_view PIN_PREFIX = "output-scale-";
+
 int Dispatcher::add_input(Producer<av::frame> *producer)
 {
     if (!producer) return av::NULLPTR;
-    if (!producer->is_realtime()) return av::INVALID;
 
+    // the capture clock & the media clock can not be merged
+    if (!producers_.empty() && producer->is_realtime() != realtime_) {
+        loge("[DISPATCHER] can not mix realtime and non-realtime inputs");
+        return av::INVALID;
+    }
+
+    realtime_ = producer->is_realtime();
     producers_.insert(producer);
 
-    if (producer->has(AVMEDIA_TYPE_AUDIO)) actx_.enabled = true;
-    if (producer->has(AVMEDIA_TYPE_VIDEO)) vctx_.enabled = true;
+    // a lane per producer and media type, the capturing threads never contend with each other
+    DispatchLane *alane = nullptr, *vlane = nullptr;
+    if (producer->has(AVMEDIA_TYPE_AUDIO)) {
+        actx_.enabled = true;
+        alane         = actx_.lanes.emplace_back(std::make_unique<DispatchLane>(producer, 8)).get();
+        alane->queue.enable_telemetry(fmt::format("dispatcher.a.{}", producer->name()));
+    }
+
+    if (producer->has(AVMEDIA_TYPE_VIDEO)) {
+        vctx_.enabled = true;
+        // at most 4 frames or 128 MiB (2 frames of 8K BGRA)
+        vlane =
+            vctx_.lanes.emplace_back(std::make_unique<DispatchLane>(producer, 4, 128 * 1024 * 1024)).get();
+        vlane->queue.enable_telemetry(fmt::format("dispatcher.v.{}", producer->name()));
+    }
 
     producer->onarrived = [=, this](const av::frame& frame, auto type) {
         switch (type) {
-        case AVMEDIA_TYPE_AUDIO: actx_.queue.wait_and_push({ frame, producer }); break;
-        case AVMEDIA_TYPE_VIDEO: vctx_.queue.wait_and_push({ frame, producer }); break;
-        default:                 break;
+        case AVMEDIA_TYPE_AUDIO:
+            if (alane && alane->queue.wait_and_push(frame)) wake(actx_);
+            break;
+        case AVMEDIA_TYPE_VIDEO:
+            if (vlane && vlane->queue.wait_and_push(frame)) wake(vctx_);
+            break;
+        default: break;
         }
     };
 
     return 0;
 }
 
-void Dispatcher::set_output(Consumer<av::frame> *encoder) { consumer_ = encoder; }
+int Dispatcher::add_output(Consumer<av::frame> *consumer, const branch_options_t& options)
+{
+    if (!consumer) return av::NULLPTR;
+
+    consumers_.emplace_back(consumer, options);
+    return 0;
+}
 
 void Dispatcher::set_hwaccel(const AVHWDeviceType hwaccel) { vctx_.hwaccel = hwaccel; }
 
+void Dispatcher::set_threading(const av::graph::threading_t& threading) { threading_ = threading; }
+
+void Dispatcher::set_activity_metering(const bool enabled) { vctx_.metering = enabled; }
+
 int Dispatcher::initialize(const std::string_view& video_filters, const std::string_view& audio_filters)
 {
-    if (producers_.empty() || !consumer_) return av::INVALID;
+    if (producers_.empty() || consumers_.empty()) return av::INVALID;
 
     vctx_.graph_desc = video_filters;
     actx_.graph_desc = audio_filters;
 
+    // a branch per output and media type
+    vctx_.branches.clear();
+    actx_.branches.clear();
+    vctx_.pinned = false;
+    for (size_t i = 0; i < consumers_.size(); ++i) {
+        const auto& [consumer, options] = consumers_[i];
+
+        const bool video  = vctx_.enabled && options.video;
+        const bool audio  = actx_.enabled && options.audio;
+        const bool queued = options.policy != overflow_policy::block;
+
+        if (video) {
+            auto& branch = vctx_.branches.emplace_back(
+                std::make_unique<DispatchBranch>(consumer, options.video_filters, options.policy, 4));
+            if (queued) branch->queue.enable_telemetry(fmt::format("dispatcher.v.out{}", i));
+        }
+
+        if (audio) {
+            auto& branch = actx_.branches.emplace_back(
+                std::make_unique<DispatchBranch>(consumer, options.audio_filters, options.policy, 16));
+            if (queued) branch->queue.enable_telemetry(fmt::format("dispatcher.a.out{}", i));
+        }
+
+        consumer->enable(AVMEDIA_TYPE_VIDEO, video);
+        consumer->enable(AVMEDIA_TYPE_AUDIO, audio);
+    }
+
+    // no output accepts the media type, the capturing threads must not block on the lanes
+    for (auto ctx : { &vctx_, &actx_ }) {
+        if (!ctx->enabled || !ctx->branches.empty()) continue;
+
+        ctx->enabled = false;
+        for (auto& lane : ctx->lanes) {
+            lane->queue.stop();
+        }
+    }
+
+    // admission at the highest framerate of the outputs, nothing is shed offline
+    vctx_.max_backlog = realtime_ ? 2 : std::numeric_limits<size_t>::max();
+    vctx_.framerate   = {};
+    for (const auto& branch : vctx_.branches) {
+        const auto framerate = branch->consumer->vfmt.framerate;
+        if (framerate.num > 0 && framerate.den > 0 &&
+            (!vctx_.framerate.num || av_cmp_q(framerate, vctx_.framerate) > 0))
+            vctx_.framerate = framerate;
+    }
+
     if (actx_.enabled && create_filter_graph(AVMEDIA_TYPE_AUDIO) < 0) return -1;
     if (vctx_.enabled && create_filter_graph(AVMEDIA_TYPE_VIDEO) < 0) return -1;
 
-    consumer_->enable(AVMEDIA_TYPE_AUDIO, actx_.enabled);
-    consumer_->enable(AVMEDIA_TYPE_VIDEO, vctx_.enabled);
-
     set_encoder_format_by_sinks();
 
     ready_ = true;
     return 0;
 }
 
+// from -> [filters] -> sink, the filters must have one input & one output
+static int link_branch(AVFilterGraph *graph, AVFilterContext *from, const int pad,
+                       const std::string& filters, AVFilterContext *sink)
+{
+    if (filters.empty()) return avfilter_link(from, pad, sink, 0);
+
+    AVFilterInOut *inputs = nullptr, *outputs = nullptr;
+    defer(avfilter_inout_free(&inputs); avfilter_inout_free(&outputs));
+
+    if (avfilter_graph_parse2(graph, filters.c_str(), &inputs, &outputs) < 0) return av::INVALID;
+
+    if (!inputs || inputs->next || !outputs || outputs->next) return av::INVALID;
+
+    if (avfilter_link(from, pad, inputs->filter_ctx, inputs->pad_idx) < 0) return -1;
+
+    return avfilter_link(outputs->filter_ctx, outputs->pad_idx, sink, 0);
+}
+
 int Dispatcher::create_filter_graph(const AVMediaType type)
 {
     auto& ctx = (type == AVMEDIA_TYPE_AUDIO) ? actx_ : vctx_;
@@ -67,6 +168,21 @@ int Dispatcher::create_filter_graph(const AVMediaType type)
     if (ctx.graph) avfilter_graph_free(&ctx.graph);
     if (ctx.graph = avfilter_graph_alloc(); !ctx.graph) return av::NOMEM;
 
+    // the slice threads are spawned along with the first filter, and inherit the affinity
+    av::graph::affinity_guard pinned(type == AVMEDIA_TYPE_VIDEO ? threading_.cpus : std::vector<int>{});
+    if (type == AVMEDIA_TYPE_VIDEO) {
+        // sized by the largest source, the pixel format conversion is the most expensive filter
+        int threads = 1;
+        for (const auto& producer : producers_) {
+            if (producer->has(AVMEDIA_TYPE_VIDEO))
+                threads = std::max(threads, av::graph::auto_threads(producer->vfmt));
+        }
+        av::graph::set_threading(ctx.graph, threading_, threads);
+    }
+    else {
+        av::graph::set_threading(ctx.graph, { .slice = false }, 1);
+    }
+
     // 2. create buffersrc
     std::vector<AVFilterContext *> src_ctxs{};
     for (auto& producer : producers_) {
@@ -88,28 +204,35 @@ int Dispatcher::create_filter_graph(const AVMediaType type)
         }
     }
 
-    // 3. create buffersink
-    if (type == AVMEDIA_TYPE_AUDIO &&
-        av::graph::create_audio_sink(actx_.graph, &actx_.sink, consumer_->afmt) < 0)
-        return -1;
-    if (type == AVMEDIA_TYPE_VIDEO &&
-        av::graph::create_video_sink(vctx_.graph, &vctx_.sink, consumer_->vfmt) < 0)
-        return -1;
+    // 3. create buffersinks, one per branch in the format of its output
+    for (auto& branch : ctx.branches) {
+        if (type == AVMEDIA_TYPE_AUDIO &&
+            av::graph::create_audio_sink(ctx.graph, &branch->sink, branch->consumer->afmt) < 0)
+            return -1;
+        if (type == AVMEDIA_TYPE_VIDEO &&
+            av::graph::create_video_sink(ctx.graph, &branch->sink, branch->consumer->vfmt) < 0)
+            return -1;
+    }
 
-    // 4.
+    // 4. the shared part, whose only output is branched off
     logi("[DISPATCHER] [{}] creating filter graph: '{}'", av::to_char(type), ctx.graph_desc);
 
+    AVFilterContext *shared     = nullptr;
+    int              shared_pad = 0;
+
+    AVFilterInOut *inputs = nullptr, *outputs = nullptr;
+    defer(avfilter_inout_free(&inputs); avfilter_inout_free(&outputs));
+
     if (ctx.graph_desc.empty()) {
         // 1 input & 1 output
-        if (avfilter_link(src_ctxs[0], 0, ctx.sink, 0) < 0) {
-            loge("[DISPATCHER] [{}] failed to link filter graph", av::to_char(type));
-            return -1;
+        if (src_ctxs.size() != 1) {
+            loge("[DISPATCHER] [{}] {} inputs need a filter to be merged", av::to_char(type),
+                 src_ctxs.size());
+            return av::INVALID;
         }
+        shared = src_ctxs[0];
     }
     else {
-        AVFilterInOut *inputs = nullptr, *outputs = nullptr;
-        defer(avfilter_inout_free(&inputs); avfilter_inout_free(&outputs));
-
         if (avfilter_graph_parse2(ctx.graph, ctx.graph_desc.c_str(), &inputs, &outputs) < 0)
             return av::INVALID;
 
@@ -122,11 +245,93 @@ int Dispatcher::create_filter_graph(const AVMediaType type)
             }
         }
 
-        for (auto ptr = outputs; ptr; ptr = ptr->next) {
-            if (avfilter_link(ptr->filter_ctx, ptr->pad_idx, ctx.sink, 0) < 0) {
-                loge("[DISPATCHER] failed to link output filters");
+        if (!outputs || outputs->next) {
+            loge("[DISPATCHER] [{}] the filter graph must have exactly one output", av::to_char(type));
+            return av::INVALID;
+        }
+        shared     = outputs->filter_ctx;
+        shared_pad = outputs->pad_idx;
+    }
+
+    // 5. branches: (a)split the shared output by reference, then the filters of each branch
+    //    the branches with the same filters share them, e.g. the outputs scaled to the same size,
+    //    and are split after them
+    std::vector<std::vector<DispatchBranch *>> groups{};
+    for (const auto& branch : ctx.branches) {
+        const auto group = std::ranges::find_if(groups, [&](const auto& group) {
+            return !branch->filters.empty() && group.front()->filters == branch->filters;
+        });
+
+        if (group != groups.end())
+            group->push_back(branch.get());
+        else
+            groups.push_back({ branch.get() });
+    }
+
+    const auto split_name = (type == AVMEDIA_TYPE_AUDIO) ? "asplit" : "split";
+
+    AVFilterContext *split = nullptr;
+    if (groups.size() > 1) {
+        const auto args = std::to_string(groups.size());
+        if (avfilter_graph_create_filter(&split, avfilter_get_by_name(split_name), "branches", args.c_str(),
+                                         nullptr, ctx.graph) < 0 ||
+            avfilter_link(shared, shared_pad, split, 0) < 0) {
+            loge("[DISPATCHER] [{}] failed to create '{}'", av::to_char(type), split_name);
+            return -1;
+        }
+    }
+
+    // the end of a branch: its sink, or the scale back to the size of its output, see set_crop
+    const auto end_of = [&](DispatchBranch *branch) -> AVFilterContext * {
+        if (type != AVMEDIA_TYPE_VIDEO || !ctx.pinned || branch->width <= 0 || branch->height <= 0)
+            return branch->sink;
+
+        const auto index = std::ranges::find_if(ctx.branches, [=](auto& b) { return b.get() == branch; }) -
+                           ctx.branches.begin();
+        const auto name  = fmt::format("{}{}", PIN_PREFIX, index);
+        const auto args  = fmt::format("w={}:h={}", branch->width, branch->height);
+
+        AVFilterContext *pin = nullptr;
+        if (avfilter_graph_create_filter(&pin, avfilter_get_by_name("scale"), name.c_str(), args.c_str(),
+                                         nullptr, ctx.graph) < 0 ||
+            avfilter_link(pin, 0, branch->sink, 0) < 0) {
+            loge("[DISPATCHER] [V] failed to create '{}'", name);
+            return nullptr;
+        }
+        return pin;
+    };
+
+    for (size_t i = 0; i < groups.size(); ++i) {
+        const auto& group = groups[i];
+
+        AVFilterContext *tail = nullptr;
+        if (group.size() == 1) {
+            tail = end_of(group.front());
+            if (!tail) return -1;
+        }
+        else {
+            const auto name = fmt::format("branches-{}", i);
+            const auto args = std::to_string(group.size());
+            if (avfilter_graph_create_filter(&tail, avfilter_get_by_name(split_name), name.c_str(),
+                                             args.c_str(), nullptr, ctx.graph) < 0) {
+                loge("[DISPATCHER] [{}] failed to create '{}'", av::to_char(type), name);
                 return -1;
             }
+
+            for (size_t j = 0; j < group.size(); ++j) {
+                const auto end = end_of(group[j]);
+                if (!end || avfilter_link(tail, static_cast<unsigned>(j), end, 0) < 0) return -1;
+            }
+
+            logi("[DISPATCHER] [{}] {} outputs share '{}'", av::to_char(type), group.size(),
+                 group.front()->filters);
+        }
+
+        if (link_branch(ctx.graph, split ? split : shared, split ? static_cast<int>(i) : shared_pad,
+                        group.front()->filters, tail) < 0) {
+            loge("[DISPATCHER] [{}] failed to link the branch {}: '{}'", av::to_char(type), i,
+                 group.front()->filters);
+            return -1;
         }
     }
 
@@ -137,33 +342,45 @@ int Dispatcher::create_filter_graph(const AVMediaType type)
         }
     }
 
-    // 5. configure
+    // 6. configure
     if (avfilter_graph_config(ctx.graph, nullptr) < 0) {
         loge("[DISPATCHER] failed to configure the filter graph");
         return -1;
     }
 
     logi("[DISPATCHER] filter graph \n{}\n", avfilter_graph_dump(ctx.graph, nullptr));
+    av::graph::dump_threading(ctx.graph, (type == AVMEDIA_TYPE_AUDIO) ? "[DISPATCHER] [A]"
+                                                                      : "[DISPATCHER] [V]");
     return 0;
 }
 
 int Dispatcher::set_encoder_format_by_sinks()
 {
-    if (consumer_ && consumer_->accepts(AVMEDIA_TYPE_VIDEO) && vctx_.sink) {
-        consumer_->vfmt.pix_fmt = static_cast<AVPixelFormat>(av_buffersink_get_format(vctx_.sink));
-        consumer_->vfmt.width   = av_buffersink_get_w(vctx_.sink);
-        consumer_->vfmt.height  = av_buffersink_get_h(vctx_.sink);
-        consumer_->vfmt.sample_aspect_ratio = av_buffersink_get_sample_aspect_ratio(vctx_.sink);
-        consumer_->vfmt.time_base           = av_buffersink_get_time_base(vctx_.sink);
-        consumer_->input_framerate          = av_buffersink_get_frame_rate(vctx_.sink);
+    for (const auto& branch : vctx_.branches) {
+        const auto consumer = branch->consumer;
+        const auto sink     = branch->sink;
+
+        consumer->vfmt.pix_fmt             = static_cast<AVPixelFormat>(av_buffersink_get_format(sink));
+        consumer->vfmt.width               = av_buffersink_get_w(sink);
+        consumer->vfmt.height              = av_buffersink_get_h(sink);
+        consumer->vfmt.sample_aspect_ratio = av_buffersink_get_sample_aspect_ratio(sink);
+        consumer->vfmt.time_base           = av_buffersink_get_time_base(sink);
+        consumer->input_framerate          = av_buffersink_get_frame_rate(sink);
+
+        // pinned, see set_crop
+        branch->width  = consumer->vfmt.width;
+        branch->height = consumer->vfmt.height;
     }
 
-    if (consumer_ && consumer_->accepts(AVMEDIA_TYPE_AUDIO) && actx_.sink) {
-        consumer_->afmt.sample_fmt     = static_cast<AVSampleFormat>(av_buffersink_get_format(actx_.sink));
-        consumer_->afmt.channels       = av_buffersink_get_channels(actx_.sink);
-        consumer_->afmt.channel_layout = av_buffersink_get_channel_layout(actx_.sink);
-        consumer_->afmt.sample_rate    = av_buffersink_get_sample_rate(actx_.sink);
-        consumer_->afmt.time_base      = av_buffersink_get_time_base(actx_.sink);
+    for (const auto& branch : actx_.branches) {
+        const auto consumer = branch->consumer;
+        const auto sink     = branch->sink;
+
+        consumer->afmt.sample_fmt     = static_cast<AVSampleFormat>(av_buffersink_get_format(sink));
+        consumer->afmt.channels       = av_buffersink_get_channels(sink);
+        consumer->afmt.channel_layout = av_buffersink_get_channel_layout(sink);
+        consumer->afmt.sample_rate    = av_buffersink_get_sample_rate(sink);
+        consumer->afmt.time_base      = av_buffersink_get_time_base(sink);
     }
     return 0;
 }
@@ -176,7 +393,19 @@ int Dispatcher::start()
         }
     }
 
-    if (consumer_->start() < 0) return -1;
+    for (auto& [consumer, _] : consumers_) {
+        if (consumer->start() < 0) return -1;
+    }
+
+    // the non-blocking outputs
+    for (const auto mt : { AVMEDIA_TYPE_VIDEO, AVMEDIA_TYPE_AUDIO }) {
+        for (auto& branch : (mt == AVMEDIA_TYPE_AUDIO) ? actx_.branches : vctx_.branches) {
+            if (branch->policy == overflow_policy::block) continue;
+
+            branch->queue.start();
+            branch->thread = std::jthread([branch = branch.get(), mt] { output_fn(*branch, mt); });
+        }
+    }
 
     //
     start_time_ = av::clock::ns();
@@ -199,13 +428,24 @@ int Dispatcher::dispatch_fn(const AVMediaType mt)
 {
     probe::thread::set_name(fmt::format("DISPATCH-{}", av::to_char(mt)));
 
+    // the video graph may be rebuilt on this thread, keep its filter threads on the same cores
+    av::graph::affinity_guard pinned(mt == AVMEDIA_TYPE_VIDEO ? threading_.cpus : std::vector<int>{});
+
     logi("[{}] STARTED", av::to_char(mt));
     defer(logi("[{}] EXITED", av::to_char(mt)));
 
     auto& ctx = (mt == AVMEDIA_TYPE_AUDIO) ? actx_ : vctx_;
 
+    const auto stop_lanes = [&] {
+        for (auto& lane : ctx.lanes) {
+            lane->queue.stop();
+        }
+    };
+
     av::frame frame{};
     while (ctx.running) {
+        if (ctx.commanded) apply_commands(ctx, mt);
+
         if (ctx.dirty) {
             if (create_filter_graph(mt) < 0) {
                 ctx.running = false;
@@ -213,84 +453,373 @@ int Dispatcher::dispatch_fn(const AVMediaType mt)
             }
 
             ctx.dirty = false;
+            reapply_commands(ctx, mt);
+
+            // the commands deferred by the rebuild, before the next frame
+            continue;
         }
 
-        auto has_next = ctx.queue.wait_and_pop();
-        if (!has_next || timeline_.paused()) continue;
+        auto deadline = av::clock::max;
+        auto lane     = merge(ctx, mt, deadline);
+        if (!lane) {
+            std::unique_lock lock(ctx.mtx);
+            ctx.sleeping = true;
 
-        frame         = has_next.value().first;
-        auto producer = has_next.value().second;
+            const auto ready = [&] {
+                return !ctx.running || std::ranges::any_of(ctx.lanes, [](const auto& lane) {
+                           return !lane->head && !lane->queue.empty();
+                       });
+            };
+
+            if (deadline == av::clock::max) {
+                ctx.arrived.wait(lock, ready);
+            }
+            else {
+                using namespace std::chrono;
+                const auto until =
+                    steady_clock::time_point{ duration_cast<steady_clock::duration>(deadline) };
+                ctx.arrived.wait_until(lock, until, ready);
+            }
+
+            ctx.sleeping = false;
+            continue;
+        }
+
+        frame = std::move(lane->head.value());
+        lane->head.reset();
+
+        const auto trace_id = trace::id(frame.get());
+        trace::mark(trace_id, trace::DISPATCHED);
+
+        // offline, stop pulling the frames instead, the inputs are held back by the lanes
+        if (!realtime_ && timeline_.paused()) {
+            std::unique_lock lock(ctx.mtx);
+            ctx.sleeping = true;
+            ctx.arrived.wait(lock, [&] { return !ctx.running || !timeline_.paused(); });
+            ctx.sleeping = false;
+        }
+
+        if (timeline_.paused()) {
+            trace::drop(trace_id, trace::DISPATCHED);
+            continue;
+        }
+
+        auto producer = lane->producer;
         auto src      = ctx.srcs[producer];
         auto timebase = (mt == AVMEDIA_TYPE_AUDIO) ? producer->afmt.time_base : producer->vfmt.time_base;
 
-        // pts
-        if (frame && frame->pts != AV_NOPTS_VALUE)
-            frame->pts -= av::clock::to(av::clock::us() - timeline_.time(), timebase);
+        // pts: the realtime frames are rebased on the timeline, the offline ones start at 0
+        if (frame && frame->pts != AV_NOPTS_VALUE) {
+            if (realtime_)
+                frame->pts -= av::clock::to(av::clock::us() - timeline_.time(), timebase);
+            else if (producer->start_time() != av::clock::nopts)
+                frame->pts -= av::clock::to(producer->start_time(), timebase);
+        }
+
+        if (!frame) lane->eof = true;
+
+        // drop early, before paying for the filters
+        if (mt == AVMEDIA_TYPE_VIDEO && frame && frame->pts != AV_NOPTS_VALUE &&
+            !admit(ctx, *lane, av::clock::ns(frame->pts, timebase))) {
+            trace::drop(trace_id, trace::DISPATCHED);
+            continue;
+        }
+
+        // the changes since the previous frame of the producer, before the filters resize the frame
+        if (mt == AVMEDIA_TYPE_VIDEO && ctx.metering) {
+            if (frame) activity::tag(frame.get(), activity::measure(lane->last.get(), frame.get()));
+
+            // only hold the buffer of a frame which can be compared
+            lane->last = activity::measurable(frame.get()) ? frame : av::frame{ nullptr };
+        }
+
+        // progress, before the frame is moved into the graph
+        if (frame) {
+            if (frame->pts != AV_NOPTS_VALUE) ctx.position = av::clock::ns(frame->pts, timebase).count();
+            ctx.frames++;
+        }
 
-        // send the frame to graph
-        if (av_buffersrc_add_frame_flags(src, frame.get(), AV_BUFFERSRC_FLAG_PUSH) < 0) {
+        // with the telemetry, the time of the graph and of each branch per input frame
+        const bool timed    = frame && telemetry::enabled();
+        int64_t    filtered = timed ? queue_telemetry::now() : 0;
+
+        // send the frame to graph, the filters run on this thread when the branches pull it below
+        if (av_buffersrc_add_frame_flags(src, frame.get(), 0) < 0) {
             loge("[{}] failed to send the frame to filter graph.", av::to_char(mt));
             ctx.running = false;
-            ctx.queue.stop();
+            stop_lanes();
             break;
         }
-
-        // output streams
-        while (ctx.running) {
-            const int ret =
-                av_buffersink_get_frame_flags(ctx.sink, frame.put(), AV_BUFFERSINK_FLAG_NO_REQUEST);
-            if (ret == AVERROR(EAGAIN)) {
-                break;
+        if (timed) filtered = std::max<int64_t>(queue_telemetry::now() - filtered, 0);
+
+        // output streams, the frames of all branches reference the same buffers
+        for (auto& branch : ctx.branches) {
+            int64_t pulled = 0; // ns, in the filters, without the delivery to the consumer
+
+            while (ctx.running) {
+                const auto pull_begin = timed ? queue_telemetry::now() : 0;
+                const int  ret        = av_buffersink_get_frame_flags(branch->sink, frame.put(), 0);
+                if (timed) pulled += std::max<int64_t>(queue_telemetry::now() - pull_begin, 0);
+
+                if (ret == AVERROR(EAGAIN)) {
+                    break;
+                }
+                else if (ret == AVERROR_EOF) {
+                    logi("[{}] DISPATCH EOF", av::to_char(mt));
+
+                    deliver(*branch, nullptr, mt);
+                    break;
+                }
+                else if (ret < 0) {
+                    loge("[{}] failed to get frame: {}", av::to_char(mt), av::ff_errstr(ret));
+                    ctx.running = false;
+                    stop_lanes();
+                    break;
+                }
+
+                trace::mark(trace::id(frame.get()), trace::FILTERED);
+
+                deliver(*branch, frame, mt);
             }
-            else if (ret == AVERROR_EOF) {
-                logi("[{}] DISPATCH EOF", av::to_char(mt));
 
-                consumer_->consume(nullptr, mt);
-                break;
+            if (timed) {
+                branch->filter_time.record(pulled);
+                filtered += pulled;
             }
-            else if (ret < 0) {
-                loge("[{}] failed to get frame: {}", av::to_char(mt), av::ff_errstr(ret));
-                ctx.running = false;
-                ctx.queue.stop();
-                break;
-            }
-
-            consumer_->consume(frame, mt);
         }
+
+        if (timed) ctx.filter_time.record(filtered);
     }
 
-    consumer_->consume(nullptr, mt);
+    for (auto& branch : ctx.branches) {
+        deliver(*branch, nullptr, mt);
+    }
+
+    return 0;
+}
+
+bool Dispatcher::admit(DispatchContext& ctx, DispatchLane& lane, const std::chrono::nanoseconds ts)
+{
+    if (!ctx.framerate.num || !ctx.framerate.den) {
+        ctx.admitted++;
+        return true;
+    }
+
+    const auto interval =
+        std::chrono::nanoseconds{ av_rescale(1'000'000'000, ctx.framerate.den, ctx.framerate.num) };
+
+    if (lane.origin == av::clock::nopts) lane.origin = ts;
+
+    const auto slot = static_cast<int64_t>(std::llround(static_cast<double>((ts - lane.origin).count()) /
+                                                        static_cast<double>(interval.count())));
+
+    // faster than the output, the consumer would drop it after filtering
+    if (slot <= lane.slot) {
+        ctx.dropped++;
+        return false;
+    }
+
+    // the outputs which block the dispatcher are behind, but let a frame pass every few slots
+    size_t backlog = 0;
+    for (const auto& branch : ctx.branches) {
+        if (branch->policy == overflow_policy::block)
+            backlog = std::max(backlog, branch->consumer->backlog(AVMEDIA_TYPE_VIDEO));
+    }
+
+    if (backlog >= ctx.max_backlog && lane.slot >= 0 && slot - lane.slot < 4) {
+        ctx.shed++;
+        return false;
+    }
+
+    if (lane.slot >= 0) ctx.duplicated += slot - lane.slot - 1;
+
+    lane.slot = slot;
+    ctx.admitted++;
+    return true;
+}
+
+void Dispatcher::deliver(DispatchBranch& branch, const av::frame& frame, const AVMediaType mt)
+{
+    if (branch.policy == overflow_policy::block) {
+        branch.consumer->consume(frame, mt);
+        return;
+    }
+
+    branch.queue.wait_and_push(frame);
+}
+
+int Dispatcher::output_fn(DispatchBranch& branch, const AVMediaType mt)
+{
+    probe::thread::set_name(fmt::format("OUTPUT-{}", av::to_char(mt)));
+
+    bool eof = false;
+    while (const auto frame = branch.queue.wait_and_pop()) {
+        eof = !frame.value();
+        branch.consumer->consume(frame.value(), mt);
+    }
+
+    // the EOF may have been dropped by the overflow policy or flushed by stop()
+    if (!eof) branch.consumer->consume(nullptr, mt);
 
     return 0;
 }
 
-void Dispatcher::pause() { timeline_.pause(); }
+DispatchLane *Dispatcher::merge(DispatchContext& ctx, const AVMediaType mt,
+                                std::chrono::nanoseconds& deadline) const
+{
+    DispatchLane *first    = nullptr;
+    auto          first_ts = av::clock::max;
+    bool          pending  = false; // a lane without queued frames may still deliver an earlier one
+
+    for (auto& lane : ctx.lanes) {
+        if (!lane->head) lane->head = lane->queue.pop();
+
+        if (!lane->head) {
+            // offline, a lane is waited for until its EOF
+            pending |= realtime_ ? lane->producer->running() : !lane->eof;
+            continue;
+        }
+
+        const auto& frame = lane->head.value();
+        const auto  tb    = (mt == AVMEDIA_TYPE_AUDIO) ? lane->producer->afmt.time_base
+                                                       : lane->producer->vfmt.time_base;
+        // EOF or unknown pts goes first
+        const auto ts =
+            (frame && frame->pts != AV_NOPTS_VALUE) ? av::clock::ns(frame->pts, tb) : av::clock::min;
+        if (!first || ts < first_ts) {
+            first    = lane.get();
+            first_ts = ts;
+        }
+    }
 
-void Dispatcher::resume() { timeline_.resume(); }
+    if (!first || !pending || first_ts == av::clock::min) return first;
+
+    // the media time is not the wall time
+    if (!realtime_) return nullptr;
+
+    // the realtime pts is the capture time, hold the earliest frame for at most max_run_ahead
+    if (av::clock::ns() >= first_ts + ctx.max_run_ahead) return first;
+
+    deadline = first_ts + ctx.max_run_ahead;
+    return nullptr;
+}
+
+void Dispatcher::wake(DispatchContext& ctx)
+{
+    // the frame is published before checking, the dispatching thread announces itself before checking
+    if (ctx.sleeping) {
+        std::lock_guard lock(ctx.mtx);
+        ctx.arrived.notify_one();
+    }
+}
+
+void Dispatcher::pause()
+{
+    // stop the timeline first, the frames in flight are discarded by the dispatching threads
+    timeline_.pause();
+
+    for (auto& producer : producers_) {
+        producer->pause();
+    }
+}
+
+void Dispatcher::resume()
+{
+    // the frames are stamped with the capture time, so the timeline must run before they arrive
+    timeline_.resume();
+
+    // offline, the dispatching threads wait for resuming
+    wake(vctx_);
+    wake(actx_);
+
+    for (auto& producer : producers_) {
+        producer->resume();
+    }
+}
 
 void Dispatcher::stop()
 {
     ready_ = false;
 
     // must be called before calling producer->stop()
-    actx_.queue.stop();
-    vctx_.queue.stop();
+    for (auto ctx : { &vctx_, &actx_ }) {
+        for (auto& lane : ctx->lanes) {
+            lane->queue.stop();
+        }
+    }
 
     // producers
     for (auto& producer : producers_) {
         producer->stop();
     }
 
-    // consumer
-    if (consumer_) consumer_->stop();
-
-    // dispatcher
+    // dispatcher, the consumers are still running and drain what is being pushed to them
     vctx_.running = false;
     actx_.running = false;
 
+    wake(vctx_);
+    wake(actx_);
+
     if (vctx_.thread.joinable()) vctx_.thread.join();
     if (actx_.thread.joinable()) actx_.thread.join();
 
+    // the non-blocking outputs, after the dispatching threads stopped feeding them
+    for (auto ctx : { &vctx_, &actx_ }) {
+        for (auto& branch : ctx->branches) {
+            branch->queue.stop();
+            if (branch->thread.joinable()) branch->thread.join();
+            branch->queue.drain();
+        }
+    }
+
+    // consumers, nothing feeds them anymore
+    for (auto& [consumer, _] : consumers_) {
+        consumer->stop();
+    }
+
+    // release the pending frames, the consumer side is quiescent now
+    for (auto ctx : { &vctx_, &actx_ }) {
+        for (auto& lane : ctx->lanes) {
+            lane->queue.drain();
+            lane->head.reset();
+        }
+    }
+
+    // the dispatcher & encoder queues of the recording
+    telemetry::dump();
+
+    if (const auto counters = admission(); counters.admitted) {
+        logi("[DISPATCHER] [V] admitted = {}, dropped = {}, shed = {}, duplicated = {}", counters.admitted,
+             counters.dropped, counters.shed, counters.duplicated);
+    }
+
+    // with the telemetry only
+    for (const auto ctx : { &vctx_, &actx_ }) {
+        const auto filter = ctx->filter_time.snapshot();
+        if (!filter.count) continue;
+
+        logi("[DISPATCHER] [{}] filter graph: {} frames, mean = {:.3f}ms, p50 = {:.3f}ms, p99 = {:.3f}ms, "
+             "max = {:.3f}ms",
+             (ctx == &vctx_) ? 'V' : 'A', filter.count, filter.mean() / 1e6, filter.percentile(0.5) / 1e6,
+             filter.percentile(0.99) / 1e6, filter.max / 1e6);
+
+        for (size_t i = 0; i < ctx->branches.size(); ++i) {
+            const auto branch = ctx->branches[i]->filter_time.snapshot();
+
+            logi("[DISPATCHER] [{}]   branch #{}{:<9}: mean = {:.3f}ms, p50 = {:.3f}ms, p99 = {:.3f}ms, "
+                 "max = {:.3f}ms, '{}'",
+                 (ctx == &vctx_) ? 'V' : 'A', i, (i == 0) ? " + shared" : "", branch.mean() / 1e6,
+                 branch.percentile(0.5) / 1e6, branch.percentile(0.99) / 1e6, branch.max / 1e6,
+                 ctx->branches[i]->filters);
+        }
+    }
+
+    // process-wide, what the pipeline still takes from the heap once warmed up
+    const auto pool = av::pool::counters();
+    logi("[DISPATCHER] pool: frames = {} / {} reused, packets = {} / {} reused, buffers = {} / {} reused",
+         pool.frames, pool.frames_reused, pool.packets, pool.packets_reused, pool.buffers,
+         pool.buffers_reused);
+
     logi("[DISPATCHER] STOPPED");
 }
 
@@ -308,5 +837,267 @@ std::chrono::nanoseconds Dispatcher::escaped() const
 {
     if (!running()) return 0ns;
 
+    if (!realtime_) return progress().position;
+
     return timeline_.time();
 }
+
+progress_t Dispatcher::progress() const
+{
+    progress_t progress{
+        .position = std::chrono::nanoseconds{ std::max(vctx_.position.load(), actx_.position.load()) },
+        .elapsed  = (start_time_ == av::clock::nopts) ? 0ns : av::clock::ns() - start_time_,
+        .frames   = vctx_.enabled ? vctx_.frames.load() : actx_.frames.load(),
+    };
+
+    for (const auto& producer : producers_) {
+        const auto duration = producer->duration();
+        if (duration != av::clock::nopts && duration > 0ns &&
+            (progress.duration == av::clock::nopts || duration > progress.duration))
+            progress.duration = duration;
+    }
+
+    if (progress.elapsed <= 0ns) return progress;
+
+    const auto elapsed = std::chrono::duration<double>(progress.elapsed).count();
+
+    progress.fps   = static_cast<double>(progress.frames) / elapsed;
+    progress.speed = std::chrono::duration<double>(progress.position).count() / elapsed;
+
+    if (progress.duration != av::clock::nopts && progress.speed > 0.0) {
+        const auto remaining = std::max(progress.duration - progress.position, 0ns);
+        progress.eta         = std::chrono::nanoseconds{ static_cast<int64_t>(
+            static_cast<double>(remaining.count()) / progress.speed) };
+    }
+
+    return progress;
+}
+
+admission_counters Dispatcher::admission() const
+{
+    return {
+        .admitted   = vctx_.admitted.load(),
+        .dropped    = vctx_.dropped.load(),
+        .shed       = vctx_.shed.load(),
+        .duplicated = vctx_.duplicated.load(),
+    };
+}
+
+int Dispatcher::post(const AVMediaType type, DispatchCommand command)
+{
+    auto& ctx = (type == AVMEDIA_TYPE_AUDIO) ? actx_ : vctx_;
+    if (!ctx.enabled) return av::INVALID;
+
+    std::lock_guard lock(ctx.mtx);
+    ctx.commands.emplace_back(std::move(command));
+    ctx.commanded = true;
+    return 0;
+}
+
+int Dispatcher::send_command(const AVMediaType type, const av::graph::command_t& command,
+                             const std::optional<std::chrono::nanoseconds> at)
+{
+    return post(type, { .command = command, .at = at });
+}
+
+int Dispatcher::set_volume(const Producer<av::frame> *producer, const double volume)
+{
+    // the amix inputs are linked in the order of the producers, see create_filter_graph
+    std::optional<size_t> index{};
+    size_t                i = 0;
+    for (const auto& p : producers_) {
+        if (!p->has(AVMEDIA_TYPE_AUDIO)) continue;
+
+        if (p == producer) {
+            index = i;
+            break;
+        }
+        i++;
+    }
+    if (!index) return av::INVALID;
+
+    volumes_.resize(std::max(volumes_.size(), *index + 1), 1.0);
+    volumes_[*index] = std::max(volume, 0.0);
+
+    const auto weights = fmt::format("{}", fmt::join(volumes_, " "));
+    return post(AVMEDIA_TYPE_AUDIO,
+                { .command = { "amix", "weights", weights }, .flags = AVFILTER_CMD_FLAG_ONE });
+}
+
+int Dispatcher::set_crop(const int x, const int y, const int w, const int h)
+{
+    int ret = 0;
+    for (const auto& [cmd, value] : { std::pair{ "x", x }, { "y", y }, { "w", w }, { "h", h } }) {
+        if ((cmd[0] == 'w' || cmd[0] == 'h') && value <= 0) continue;
+
+        ret |= post(AVMEDIA_TYPE_VIDEO, { .command = { "crop", cmd, std::to_string(value) },
+                                          .flags   = AVFILTER_CMD_FLAG_ONE });
+    }
+    return ret;
+}
+
+int Dispatcher::set_scale(const int w, const int h)
+{
+    int ret = 0;
+    for (const auto& [cmd, value] : { std::pair{ "w", w }, { "h", h } }) {
+        ret |= post(AVMEDIA_TYPE_VIDEO, { .command = { "scale", cmd, std::to_string(value) },
+                                          .flags   = AVFILTER_CMD_FLAG_ONE });
+    }
+    return ret;
+}
+
+int Dispatcher::set_overlay(const int x, const int y)
+{
+    int ret = 0;
+    for (const auto& [cmd, value] : { std::pair{ "x", x }, { "y", y } }) {
+        ret |= post(AVMEDIA_TYPE_VIDEO, { .command = { "overlay", cmd, std::to_string(value) },
+                                          .flags   = AVFILTER_CMD_FLAG_ONE });
+    }
+    return ret;
+}
+
+int Dispatcher::set_filters(const AVMediaType type, const std::string_view& filters)
+{
+    return post(type, { .filters = std::string{ filters } });
+}
+
+// the filters addressed as by avfilter_graph_send_command(), except that the scales pinning the size of
+// the outputs only answer to their own instance names
+static std::vector<AVFilterContext *> targets_of(const AVFilterGraph *graph, const std::string& target)
+{
+    std::vector<AVFilterContext *> filters{};
+    for (unsigned i = 0; i < graph->nb_filters; ++i) {
+        const auto filter = graph->filters[i];
+        const auto name   = std::string_view{ filter->name ? filter->name : "" };
+
+        if (name == target ||
+            ((target == "all" || target == filter->filter->name) && !name.starts_with(PIN_PREFIX)))
+            filters.push_back(filter);
+    }
+    return filters;
+}
+
+static int send_to(AVFilterGraph *graph, const av::graph::command_t& command, const int flags,
+                   const AVMediaType mt)
+{
+    int ret = AVERROR(ENOSYS);
+    for (const auto filter : targets_of(graph, command.target)) {
+        ret = avfilter_process_command(filter, command.cmd.c_str(), command.arg.c_str(), nullptr, 0, flags);
+        if (ret != AVERROR(ENOSYS) && ((flags & AVFILTER_CMD_FLAG_ONE) || ret < 0)) break;
+    }
+
+    if (ret < 0) {
+        logw("[DISPATCHER] [{}] '{} {} {}': {}", av::to_char(mt), command.target, command.cmd, command.arg,
+             av::ff_errstr(ret));
+    }
+    return ret;
+}
+
+// queued by the instance names, so that the pins are skipped the same way
+static void queue_to(AVFilterGraph *graph, const av::graph::command_t& command, const int flags,
+                     const double ts)
+{
+    for (const auto filter : targets_of(graph, command.target)) {
+        if (!filter->name) continue;
+
+        avfilter_graph_queue_command(graph, filter->name, command.cmd.c_str(), command.arg.c_str(), flags,
+                                     ts);
+        if (flags & AVFILTER_CMD_FLAG_ONE) break;
+    }
+}
+
+// the command may change the size of the video frames, e.g. 'crop w' or 'scale h'
+static bool resizes(const AVFilterGraph *graph, const DispatchCommand& command)
+{
+    if (command.filters) return true;
+
+    const auto& cmd = command.command.cmd;
+    for (const auto filter : targets_of(graph, command.command.target)) {
+        const std::string_view type{ filter->filter->name };
+
+        if (type == "crop" && (cmd == "w" || cmd == "h" || cmd == "out_w" || cmd == "out_h")) return true;
+        if (type == "scale" && (cmd == "w" || cmd == "h" || cmd == "width" || cmd == "height")) return true;
+    }
+    return false;
+}
+
+void Dispatcher::apply_commands(DispatchContext& ctx, const AVMediaType mt)
+{
+    std::vector<DispatchCommand> commands{};
+    {
+        std::lock_guard lock(ctx.mtx);
+        commands.swap(ctx.commands);
+        ctx.commanded = false;
+    }
+
+    for (size_t i = 0; i < commands.size(); ++i) {
+        // the outputs were opened at the size of the frames, pinned by a rebuild before the first resize
+        if (mt == AVMEDIA_TYPE_VIDEO && !ctx.pinned && ctx.graph && resizes(ctx.graph, commands[i])) {
+            if (ctx.hwaccel == AV_HWDEVICE_TYPE_NONE) {
+                logi("[DISPATCHER] [V] pinning the size of the outputs");
+                ctx.pinned = true;
+                ctx.dirty  = true;
+            }
+            // no software scale for the hardware frames
+            else if (!commands[i].filters) {
+                logw("[DISPATCHER] [V] '{} {}' would resize the hardware frames, dropped",
+                     commands[i].command.target, commands[i].command.cmd);
+                continue;
+            }
+        }
+
+        // the graph is about to be replaced, the rest is applied to the new one
+        if (ctx.dirty) {
+            std::lock_guard lock(ctx.mtx);
+            ctx.commands.insert(ctx.commands.begin(), std::make_move_iterator(commands.begin() + i),
+                                std::make_move_iterator(commands.end()));
+            ctx.commanded = true;
+            return;
+        }
+
+        const auto& [command, flags, at, filters] = commands[i];
+
+        // new description: the changed options as commands, or rebuild
+        if (filters) {
+            const auto updates = av::graph::diff(ctx.graph_desc, *filters);
+
+            // the runtime changes were relative to the previous description
+            ctx.graph_desc = *filters;
+            ctx.applied.clear();
+
+            if (!updates) {
+                logi("[DISPATCHER] [{}] rebuilding filter graph: '{}'", av::to_char(mt), *filters);
+                ctx.dirty = true;
+                continue;
+            }
+
+            // the instances named by the parser are unique in the shared graph, which is created first
+            for (const auto& update : *updates) {
+                if (send_to(ctx.graph, update, AVFILTER_CMD_FLAG_ONE, mt) < 0) ctx.dirty = true;
+            }
+            continue;
+        }
+
+        if (at) {
+            const auto ts = std::chrono::duration<double>(*at).count();
+            queue_to(ctx.graph, command, flags, ts);
+        }
+        else {
+            send_to(ctx.graph, command, flags, mt);
+        }
+
+        // the timed ones too, which take effect at once if the graph is rebuilt before their time
+        ctx.applied[{ command.target, command.cmd }] = { .command = command, .flags = flags };
+    }
+}
+
+void Dispatcher::reapply_commands(DispatchContext& ctx, const AVMediaType mt)
+{
+    if (ctx.applied.empty()) return;
+
+    logi("[DISPATCHER] [{}] reapplying {} runtime commands", av::to_char(mt), ctx.applied.size());
+
+    for (const auto& [_, applied] : ctx.applied) {
+        send_to(ctx.graph, applied.command, applied.flags, mt);
+    }
+}
@@ -2,18 +2,30 @@
 
 #include "libcap/clock.h"
 #include "libcap/hwaccel.h"
+#include "libcap/trace.h"
 #include "logging.h"
 
 #include <fmt/chrono.h>
 #include <fmt/ranges.h>
 #include <probe/defer.h>
+#include <set>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/opt.h>
 #include <libavutil/time.h>
 }
 
+// duration of the samples the audio fifo holds
+static constexpr int AFIFO_SECONDS = 2;
+
+// muxers of movenc, timed by the sample table
+static const std::set<std::string_view> MOV_MUXERS = {
+    "mov", "mp4", "ipod", "ismv", "3gp", "3g2", "psp", "f4v",
+};
+
 int Encoder::open(const std::string& filename, std::map<std::string, std::string> options)
 {
     if (!audio_enabled_ && !video_enabled_) {
@@ -37,24 +49,126 @@ int Encoder::open(const std::string& filename, std::map<std::string, std::string
         crf_ = std::clamp<int>(std::stoi(options.at("crf")), 0, 51);
     }
 
+    // threads of the video encoder, e.g. fewer per instance when several encoders run at once
+    if (options.contains("threads")) vthreads_ = options.at("threads");
+
+    // speed / compression tradeoff of x264 & x265, e.g. calibrated by preset_calibrator
+    if (options.contains("preset")) preset_ = options.at("preset");
+    if (options.contains("tune")) tune_ = options.at("tune");
+
+    // "crf", or "adaptive": crf biased by the changes of the screen, see adaptive-rc.h
+    if (options.contains("rate_control")) adaptive_ = options.at("rate_control") == "adaptive";
+
+    // rolling files, cut at the keyframes
+    if (options.contains("segment_time")) {
+        segment_time_ = std::stoll(options.at("segment_time")) * 1'000'000'000;
+    }
+    if (options.contains("segment_size")) segment_size_ = std::stoll(options.at("segment_size")) << 20;
+
+    // write-behind output of the local files
+    if (options.contains("io_buffer")) io_options_.buffer_size = std::stoull(options.at("io_buffer")) << 20;
+    if (options.contains("io_direct")) io_options_.direct = options.at("io_direct") == "1";
+    if (options.contains("io_preallocate")) {
+        io_options_.preallocate = std::stoll(options.at("io_preallocate")) << 20;
+    }
+
     // format context
     if (avformat_alloc_output_context2(&fmt_ctx_, nullptr, nullptr, filename.c_str()) < 0)
         return av::INVALID;
 
+    vbuffer_.enable_telemetry("encoder.video");
+    vpackets_.enable_telemetry("muxer.video");
+    apackets_.enable_telemetry("muxer.audio");
+
     // streams
     if (video_enabled_ && new_video_stream(vcodec_name) < 0) return -1;
     if (audio_enabled_ && new_auido_stream(acodec_name) < 0) return -1;
 
-    // output file
-    if (!(fmt_ctx_->oformat->flags & AVFMT_NOFILE)) {
+    // the frames duplicated for the constant frame rate are not encoded again if the container can
+    // time the frames on its own, the previous frame lasts until the next one instead
+    // the mov family stores the duration of each sample (stts) but does not set AVFMT_VARIABLE_FPS
+    if (vsync_ == av::vsync_t::cfr && vstream_idx_ >= 0) {
+        const auto flags    = fmt_ctx_->oformat->flags;
+        const auto mov      = MOV_MUXERS.contains(fmt_ctx_->oformat->name);
+        const auto variable = mov || ((flags & AVFMT_VARIABLE_FPS) && !(flags & AVFMT_NOTIMESTAMPS));
+        const auto mode     = options.contains("duplicates") ? options.at("duplicates") : "auto";
+
+        skip_duplicates_ = (mode == "skip") || (mode == "auto" && variable);
+
+        logi("[   ENCODER] [V] duplicated frames: {}", skip_duplicates_ ? "skipped" : "encoded");
+    }
+
+    // fragmented mp4 / mov, flushed periodically
+    if (options.contains("fragment_time")) {
+        const std::string_view name{ fmt_ctx_->oformat->name };
+
+        fragment_time_ = std::stoll(options.at("fragment_time")) * 1'000'000'000;
+        if (fragment_time_ > 0 && name != "mp4" && name != "mov") {
+            logw("[   ENCODER] '{}' can not be fragmented", name);
+            fragment_time_ = 0;
+        }
+    }
+
+    filename_ = filename;
+
+    // instant replay, the packets are kept in memory, and muxed only on demand
+    if (options.contains("replay_size") && std::stoll(options.at("replay_size")) > 0) {
+        const auto max_bytes    = std::stoull(options.at("replay_size")) << 20;
+        const auto max_duration = options.contains("replay_time")
+                                      ? std::stoll(options.at("replay_time")) * 1'000'000'000
+                                      : 0;
+
+        replay_ = std::make_unique<replay_buffer>(max_bytes, max_duration);
+        for (unsigned int i = 0; i < fmt_ctx_->nb_streams; ++i) {
+            const auto stream = fmt_ctx_->streams[i];
+            if (replay_->add_stream(stream->codecpar, stream->time_base) < 0) return av::NOMEM;
+        }
+
+        logi("[   ENCODER] replay buffer: {} MiB, {} s", max_bytes >> 20, max_duration / 1'000'000'000);
+    }
+    else if (open_output_file(filename) < 0) {
+        return -1;
+    }
+
+    // the packets are rescaled to the time bases of the first file by the encoding threads
+    if (vstream_idx_ >= 0) vtime_base_ = fmt_ctx_->streams[vstream_idx_]->time_base;
+    if (astream_idx_ >= 0) atime_base_ = fmt_ctx_->streams[astream_idx_]->time_base;
+
+    ready_ = true;
+
+    return 0;
+}
+
+int Encoder::open_output_file(const std::string& filename)
+{
+    // local files are written behind by an I/O thread
+    const auto protocol = avio_find_protocol_name(filename.c_str());
+    if (!(fmt_ctx_->oformat->flags & AVFMT_NOFILE) && protocol && std::string_view{ protocol } == "file") {
+        writer_ = std::make_unique<async_writer>();
+        if (writer_->open(filename, io_options_) < 0) {
+            loge("[   ENCODER] can not open the output file: {}", filename);
+            return -1;
+        }
+
+        fmt_ctx_->pb     = writer_->context();
+        fmt_ctx_->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    else if (!(fmt_ctx_->oformat->flags & AVFMT_NOFILE)) {
         if (avio_open(&fmt_ctx_->pb, filename.c_str(), AVIO_FLAG_WRITE) < 0) {
             loge("[   ENCODER] can not open the output file: {}", filename);
             return -1;
         }
     }
 
-    if (avformat_write_header(fmt_ctx_, nullptr) < 0) {
-        loge("[   ENCODER] can not write the header to the output file: ", filename);
+    AVDictionary *options = nullptr;
+    defer(av_dict_free(&options));
+    if (fragment_time_ > 0) {
+        // an empty 'moov' first, then a self-contained 'moof' + 'mdat' from each keyframe
+        av_dict_set(&options, "movflags", "+frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+
+    if (avformat_write_header(fmt_ctx_, &options) < 0) {
+        loge("[   ENCODER] can not write the header to the output file: {}", filename);
         return -1;
     }
 
@@ -62,11 +176,86 @@ int Encoder::open(const std::string& filename, std::map<std::string, std::string
 
     logi("[   ENCODER] [{}] is opened", filename);
 
-    ready_ = true;
+    return 0;
+}
+
+std::string Encoder::segment_name(const int idx) const
+{
+    if (idx == 0) return filename_;
+
+    // 'name.mp4' -> 'name-001.mp4'
+    const auto slash = filename_.find_last_of("/\\");
+    const auto dot   = filename_.find_last_of('.');
+    const auto stem  = (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+                           ? filename_.size()
+                           : dot;
+
+    return fmt::format("{}-{:03d}{}", filename_.substr(0, stem), idx, filename_.substr(stem));
+}
+
+int Encoder::next_segment()
+{
+    const auto filename = segment_name(++segment_idx_);
+
+    // the same streams, with the time bases requested for the first file
+    AVFormatContext *next = nullptr;
+    if (avformat_alloc_output_context2(&next, fmt_ctx_->oformat, nullptr, filename.c_str()) < 0) {
+        return av::NOMEM;
+    }
+
+    for (unsigned int i = 0; i < fmt_ctx_->nb_streams; ++i) {
+        const auto stream = avformat_new_stream(next, nullptr);
+        if (!stream || avcodec_parameters_copy(stream->codecpar, fmt_ctx_->streams[i]->codecpar) < 0) {
+            avformat_free_context(next);
+            return av::NOMEM;
+        }
+        stream->time_base = (static_cast<int>(i) == vstream_idx_) ? vtime_base_ : atime_base_;
+    }
+
+    // the trailer makes the finished segment playable on its own, its buffered bytes are written out
+    // behind, while the packets go on into the buffer of the next one
+    close_output_file(true);
+
+    fmt_ctx_ = next;
+    if (open_output_file(filename) < 0) {
+        if (!writer_) avio_closep(&fmt_ctx_->pb);
+
+        fmt_ctx_->pb = nullptr;
+        writer_      = nullptr;
+        avformat_free_context(fmt_ctx_);
+        fmt_ctx_ = nullptr;
+        return -1;
+    }
+
+    segment_start_ = AV_NOPTS_VALUE;
+    flushed_at_    = AV_NOPTS_VALUE;
 
     return 0;
 }
 
+bool Encoder::segment_due(const int64_t ts) const
+{
+    if (segment_time_ > 0 && segment_start_ != AV_NOPTS_VALUE && ts - segment_start_ >= segment_time_) {
+        return true;
+    }
+
+    return segment_size_ > 0 && fmt_ctx_->pb && avio_tell(fmt_ctx_->pb) >= segment_size_;
+}
+
+void Encoder::flush_fragment(const int64_t ts)
+{
+    if (flushed_at_ == AV_NOPTS_VALUE) flushed_at_ = ts;
+    if (ts - flushed_at_ < fragment_time_) return;
+
+    // the fragment of the packets written so far, then the buffered bytes to the file
+    av_interleaved_write_frame(fmt_ctx_, nullptr);
+    av_write_frame(fmt_ctx_, nullptr);
+    if (writer_) writer_->flush();
+    else avio_flush(fmt_ctx_->pb);
+
+    flushed_at_ = ts;
+}
+
 int Encoder::new_video_stream(const std::string& codec_name)
 {
     logi("[   ENCODER] [V] <<< [{}], {}", codec_name, av::to_string(vfmt));
@@ -89,8 +278,12 @@ int Encoder::new_video_stream(const std::string& codec_name)
 
     AVDictionary *options = nullptr;
     defer(av_dict_free(&options));
-    av_dict_set(&options, "threads", "auto", 0);
+    av_dict_set(&options, "threads", vthreads_.c_str(), 0);
     av_dict_set(&options, (vfmt.hwaccel) ? "cq" : "crf", std::to_string(crf_).c_str(), 0);
+    if (codec_name == "libx264" || codec_name == "libx265") {
+        if (!preset_.empty()) av_dict_set(&options, "preset", preset_.c_str(), 0);
+        if (!tune_.empty()) av_dict_set(&options, "tune", tune_.c_str(), 0);
+    }
 
     vcodec_ctx_->height              = vfmt.height;
     vcodec_ctx_->width               = vfmt.width;
@@ -104,6 +297,23 @@ int Encoder::new_video_stream(const std::string& codec_name)
         vcodec_ctx_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     }
 
+    // the keyframes are forced at the usual interval, and the GOP of the encoder is only reached while
+    // the screen is still; the qp offsets are applied by the region of interest support of x264 & x265
+    if (adaptive_ && (codec_name == "libx264" || codec_name == "libx265")) {
+        const auto fps = std::max<int>(std::lround(av_q2d(vfmt.framerate)), 1);
+        const auto gop = vcodec_ctx_->gop_size > 0 ? vcodec_ctx_->gop_size : 12;
+
+        rc_ = std::make_unique<adaptive_rc>(adaptive_rc::options_t{ .gop = gop, .hold = fps });
+
+        vcodec_ctx_->gop_size = std::max(gop, fps * 10);
+        av_dict_set(&options, "forced-idr", "1", 0);
+
+        logi("[   ENCODER] [V] adaptive rate control, gop = {} ~ {}", gop, vcodec_ctx_->gop_size);
+    }
+    else if (adaptive_) {
+        logw("[   ENCODER] [V] adaptive rate control is not supported by {}, use crf", codec_name);
+    }
+
     if (vfmt.hwaccel != AV_HWDEVICE_TYPE_NONE) {
         if (av::hwaccel::setup_for_encoding(vcodec_ctx_, vfmt.hwaccel) != 0) {
             loge("[   ENCODER] failed to set hardware device for encoding.");
@@ -173,8 +383,16 @@ int Encoder::new_auido_stream(const std::string& codec_name)
     if (avcodec_parameters_from_context(fmt_ctx_->streams[astream_idx_]->codecpar, acodec_ctx_) < 0)
         return av::INVALID;
 
-    abuffer_ =
-        std::make_unique<safe_audio_fifo>(afmt.sample_fmt, afmt.channels, acodec_ctx_->frame_size * 4);
+    // cached, the codec context is freed by stop() while the dispatcher may still feed the fifo,
+    // 20 ms per frame if the codec takes any number of samples, e.g. pcm
+    aframe_size_ = (acodec_ctx_->frame_size > 0) ? acodec_ctx_->frame_size
+                                                 : std::max(afmt.sample_rate / 50, 1);
+
+    // AFIFO_SECONDS of samples, a multiple of the codec frame size so that the encoder reads them
+    // without copying
+    const auto aframes = std::max(AFIFO_SECONDS * afmt.sample_rate / aframe_size_ + 1, 16);
+    abuffer_ = std::make_unique<spsc_audio_fifo>(afmt.sample_fmt, afmt.channels, aframe_size_ * aframes);
+    abuffer_->enable_telemetry("encoder.audio");
 
     if (astream_idx_ >= 0) {
         logi(
@@ -187,6 +405,129 @@ int Encoder::new_auido_stream(const std::string& codec_name)
     return 0;
 }
 
+size_t Encoder::backlog(const AVMediaType type) const
+{
+    switch (type) {
+    case AVMEDIA_TYPE_VIDEO: return vbuffer_.size();
+    case AVMEDIA_TYPE_AUDIO: // in frames of the encoder
+        return abuffer_ ? static_cast<size_t>(abuffer_->size() / aframe_size_) : 0;
+    default:                 return 0;
+    }
+}
+
+Encoder::load_t Encoder::video_load() const
+{
+    const auto interval = av_q2d(av_inv_q(vfmt.framerate)) * 1e9;
+    const auto frames   = vframes_measured_.load();
+
+    return {
+        .load       = vload_,
+        .average    = (frames && interval > 0) ? static_cast<double>(vbusy_) / (frames * interval) : 0.0,
+        .frames     = frames,
+        .crf_offset = crf_offset_,
+        .overloaded = overloaded_,
+    };
+}
+
+Encoder::stats_t Encoder::stats() const
+{
+    const auto qualified = vstats_.qualified.load();
+    const auto bytes     = vstats_.bytes.load();
+    const auto duration  = static_cast<double>(vstats_.duration.load());
+
+    // no packet for a while, e.g. the encoder stalls or all the frames are skipped duplicates
+    const auto stale = av::clock::ns().count() - vstats_.published > 2'000'000'000;
+
+    return {
+        .fps         = stale ? 0.0 : vstats_.fps.load(),
+        .bitrate     = stale ? 0.0 : vstats_.bitrate.load(),
+        .avg_bitrate = duration > 0 ? static_cast<double>(bytes) * 8e9 / duration : 0.0,
+        .qp          = qualified ? static_cast<double>(vstats_.quality) / (qualified * FF_QP2LAMBDA) : -1.0,
+
+        .frames     = vstats_.frames,
+        .packets    = vstats_.packets,
+        .bytes      = bytes,
+        .duplicated = vstats_.duplicated,
+        .dropped    = vstats_.dropped,
+
+        .send_time    = std::chrono::nanoseconds{ vstats_.send_time },
+        .receive_time = std::chrono::nanoseconds{ vstats_.receive_time },
+
+        .vqueue          = vbuffer_.size(),
+        .vqueue_capacity = vbuffer_.capacity(),
+        .afifo           = (abuffer_ && abuffer_->capacity() > 0)
+                               ? static_cast<double>(abuffer_->size()) / abuffer_->capacity()
+                               : 0.0,
+        .adropped        = adropped_,
+    };
+}
+
+void Encoder::account(const AVPacket *packet)
+{
+    const auto now = av::clock::ns().count();
+
+    vstats_.packets++;
+    vstats_.bytes += packet->size;
+
+    // the lambda the packet was coded with, exported by libx264 & most of the hardware encoders
+    if (const auto sd = av_packet_get_side_data(packet, AV_PKT_DATA_QUALITY_STATS, nullptr); sd) {
+        vstats_.quality += AV_RL32(sd);
+        vstats_.qualified++;
+    }
+
+    if (packet->pts != AV_NOPTS_VALUE) {
+        if (first_pts_ == AV_NOPTS_VALUE) first_pts_ = packet->pts;
+
+        const auto end = av::clock::ns(packet->pts + packet->duration - first_pts_, vtime_base_).count();
+        if (end > vstats_.duration) vstats_.duration = end;
+    }
+
+    // fps & bitrate of the last second
+    if (window_begin_ == AV_NOPTS_VALUE) window_begin_ = now;
+
+    window_packets_++;
+    window_bytes_ += packet->size;
+
+    if (const auto elapsed = static_cast<double>(now - window_begin_); elapsed >= 1e9) {
+        vstats_.fps       = static_cast<double>(window_packets_) * 1e9 / elapsed;
+        vstats_.bitrate   = static_cast<double>(window_bytes_) * 8e9 / elapsed;
+        vstats_.published = now;
+
+        window_begin_   = now;
+        window_packets_ = 0;
+        window_bytes_   = 0;
+    }
+}
+
+void Encoder::regulate(const size_t backlog)
+{
+    const auto now = av::clock::ns().count();
+
+    // the queue is filling up, or has been drained for a while
+    int offset = crf_offset_;
+    if (backlog >= vbuffer_.capacity() * 3 / 4 && now - regulated_at_ >= 1'000'000'000) {
+        overloaded_ = true;
+        offset      = std::min(offset + 2, 6);
+    }
+    else if (backlog <= 1 && vload_ < 0.6 && now - regulated_at_ >= 5'000'000'000) {
+        offset = std::max(offset - 2, 0);
+    }
+
+    if (offset == crf_offset_) return;
+
+    regulated_at_ = now;
+
+    // the preset can not be changed while encoding, but libx264 reconfigures its crf before the next
+    // frame, and fewer bits take less time to code
+    if (std::string_view{ vcodec_ctx_->codec->name } != "libx264" || vfmt.hwaccel || crf_ < 0) return;
+
+    if (av_opt_set(vcodec_ctx_->priv_data, "crf", std::to_string(crf_ + offset).c_str(), 0) < 0) return;
+
+    logw("[   ENCODER] [V] backlog = {}, load = {:.2f}, crf = {} -> {}", backlog, vload_.load(),
+         crf_ + crf_offset_, crf_ + offset);
+    crf_offset_ = offset;
+}
+
 bool Encoder::accepts(const AVMediaType type) const
 {
     switch (type) {
@@ -208,17 +549,36 @@ void Encoder::enable(const AVMediaType type, const bool v)
 int Encoder::consume(const av::frame& frame, const AVMediaType type)
 {
     switch (type) {
-    case AVMEDIA_TYPE_VIDEO: vbuffer_.wait_and_push(frame); return 0;
+    case AVMEDIA_TYPE_VIDEO:
+        if (!frame || !frame->data[0]) {
+            logi("[V] INPUT EOF");
+            vsrc_eof_ = true;
+            wake(vwakeup_);
+            return 0;
+        }
+
+        vbuffer_.wait_and_push(frame);
+        wake(vwakeup_);
+        return 0;
 
     case AVMEDIA_TYPE_AUDIO:
         if (!frame || frame->nb_samples == 0) {
             logi("[A] INPUT EOF");
             asrc_eof_ = true;
+            wake(awakeup_);
             return 0;
         }
 
-        abuffer_->write(reinterpret_cast<void **>(frame->data), frame->nb_samples);
-        audio_pts_ = frame->pts + abuffer_->size();
+        // blocks like the video, so that an offline dispatch is held back instead of losing samples,
+        // only larger writes than the fifo are dropped, counted in stats() and logged once
+        if (!abuffer_->wait_and_write(frame->extended_data, frame->nb_samples, frame->pts) &&
+            !abuffer_->stopped()) {
+            if (!adropped_) logw("[A] {} samples exceed the audio fifo, drop them", frame->nb_samples);
+            adropped_ += frame->nb_samples;
+        }
+
+        // only a complete codec frame is worth waking up for
+        if (abuffer_->size() >= aframe_size_) wake(awakeup_);
 
         return 0;
 
@@ -234,23 +594,156 @@ int Encoder::start()
     }
 
     running_ = true;
-    thread_  = std::jthread([this]() {
-        probe::thread::set_name("ENCODER");
 
-        while (running_ && !eof()) {
-            if (vbuffer_.empty() && (!abuffer_ || abuffer_->empty())) {
-                std::this_thread::sleep_for(20ms);
-                continue;
+    mthread_ = std::jthread([this] { mux_thread_fn(); });
+    if (vstream_idx_ >= 0) vthread_ = std::jthread([this] { vencode_thread_fn(); });
+    if (astream_idx_ >= 0) athread_ = std::jthread([this] { aencode_thread_fn(); });
+
+    return 0;
+}
+
+void Encoder::vencode_thread_fn()
+{
+    probe::thread::set_name("ENCODER-V");
+
+    while (running_ && !(eof_ & V_ENCODING_EOF)) {
+        sleep(vwakeup_, [this] { return video_idle(); });
+
+        process_video_frames();
+    }
+
+    // EOF of the stream for the muxer, even if stopped or failed
+    vpackets_.wait_and_push({ nullptr, 0 });
+    wake(mwakeup_);
+
+    logi("[    ENCODER] [V] encoded frames: {}, skipped duplicates: {}, exited", vcodec_ctx_->frame_number,
+         vduplicates_);
+
+    const auto load = video_load();
+    logi("[    ENCODER] [V] load = {:.2f}, crf offset = {}, overloaded = {}", load.average, load.crf_offset,
+         load.overloaded);
+
+    const auto summary = stats();
+    logi("[    ENCODER] [V] avg bitrate = {:.0f} kb/s, qp = {:.1f}, dropped = {}, duplicated = {}, "
+         "send = {}, receive = {}",
+         summary.avg_bitrate / 1000, summary.qp, summary.dropped, summary.duplicated,
+         std::chrono::duration_cast<std::chrono::milliseconds>(summary.send_time),
+         std::chrono::duration_cast<std::chrono::milliseconds>(summary.receive_time));
+
+    if (rc_) {
+        const auto stats = rc_->stats();
+        logi("[    ENCODER] [V] adaptive rc: still = {}, motion = {}, keyframes = {}, unmeasured = {}",
+             stats.still, stats.motion, stats.keyframes, stats.unmeasured);
+    }
+}
+
+void Encoder::aencode_thread_fn()
+{
+    probe::thread::set_name("ENCODER-A");
+
+    while (running_ && !(eof_ & A_ENCODING_EOF)) {
+        sleep(awakeup_, [this] { return audio_idle(); });
+
+        process_audio_frames();
+    }
+
+    apackets_.wait_and_push({ nullptr, 0 });
+    wake(mwakeup_);
+
+    logi("[    ENCODER] [A] encoded frames: {}, dropped samples: {}, exited", acodec_ctx_->frame_number,
+         adropped_.load());
+}
+
+void Encoder::mux_thread_fn()
+{
+    probe::thread::set_name("MUXER");
+
+    bool veof = vstream_idx_ < 0;
+    bool aeof = astream_idx_ < 0;
+    while (running_ && !(veof && aeof)) {
+        sleep(mwakeup_, [this] { return muxer_idle(); });
+
+        // the muxer buffers the packets until it can write them in dts order
+        if (!veof) veof = write_packets(vpackets_);
+        if (!aeof) aeof = write_packets(apackets_);
+    }
+
+    if (veof && aeof) eof_ |= MUXING_EOF;
+
+    // for stop()
+    {
+        std::lock_guard lock(eof_mtx_);
+    }
+    eof_cv_.notify_all();
+
+    logi("[    ENCODER] [M] exited");
+}
+
+bool Encoder::write_packets(spsc_queue<traced_packet>& packets)
+{
+    while (auto packet = packets.pop()) {
+        auto& [pkt, trace_id] = packet.value();
+        if (!pkt) return true;
+
+        if (replay_) {
+            replay_->push(pkt);
+            trace::mark(trace_id, trace::MUXED);
+            continue;
+        }
+
+        const auto tb = (pkt->stream_index == vstream_idx_) ? vtime_base_ : atime_base_;
+
+        // cut at the keyframes of the video, or at any packet of an audio-only recording
+        if ((pkt->flags & AV_PKT_FLAG_KEY) && (vstream_idx_ < 0 || pkt->stream_index == vstream_idx_)) {
+            const auto ts = av::clock::ns(pkt->pts, tb).count();
+
+            if (fmt_ctx_ && segment_due(ts) && next_segment() < 0) {
+                loge("[   ENCODER] failed to open the segment #{}, stop writing", segment_idx_);
             }
 
-            if (vstream_idx_ >= 0) process_video_frames();
-            if (astream_idx_ >= 0) process_audio_frames();
-        } // running
+            if (fmt_ctx_ && fragment_time_ > 0) flush_fragment(ts);
 
-        logi("[    ENCODER] encoded frames: {}, exited", vcodec_ctx_->frame_number);
-    });
+            if (segment_start_ == AV_NOPTS_VALUE) segment_start_ = ts;
+        }
 
-    return 0;
+        if (!fmt_ctx_) {
+            trace::drop(trace_id, trace::MUXED);
+            continue;
+        }
+
+        // the muxer may have chosen another time base for a segment
+        av_packet_rescale_ts(pkt.get(), tb, fmt_ctx_->streams[pkt->stream_index]->time_base);
+
+        if (av_interleaved_write_frame(fmt_ctx_, pkt.get()) != 0) {
+            loge("[{}] failed to write the packet to the file.", (&packets == &vpackets_) ? 'V' : 'A');
+            continue;
+        }
+
+        trace::mark(trace_id, trace::MUXED);
+    }
+
+    return false;
+}
+
+bool Encoder::video_idle() const
+{
+    return eof_ & V_ENCODING_EOF || (vbuffer_.empty() && !vsrc_eof_);
+}
+
+bool Encoder::audio_idle() const
+{
+    return eof_ & A_ENCODING_EOF || (abuffer_->size() < aframe_size_ && !asrc_eof_);
+}
+
+bool Encoder::muxer_idle() const { return vpackets_.empty() && apackets_.empty(); }
+
+void Encoder::wake(wakeup_t& wakeup)
+{
+    // the waker publishes the data before checking, the sleeper announces itself before re-checking
+    if (wakeup.sleeping) {
+        wakeup.seq.fetch_add(1);
+        wakeup.seq.notify_one();
+    }
 }
 
 std::pair<int, int> Encoder::video_sync_process(av::frame& vframe)
@@ -325,11 +818,92 @@ std::pair<int, int> Encoder::video_sync_process(av::frame& vframe)
 
 int Encoder::process_video_frames()
 {
-    if (vbuffer_.empty()) return AVERROR(EAGAIN);
+    if (eof_ & V_ENCODING_EOF) return AVERROR_EOF;
+
+    // the input EOF is a flag rather than a queued nullptr since the vbuffer_ only has one producer,
+    // load it before popping so that no frame pushed before the EOF is missed
+    const bool input_eof = vsrc_eof_;
+
+    // drain all the frames available at once
+    const auto n = vbuffer_.pop_bulk(vframes_);
+    if (n == 0) {
+        if (!input_eof) return AVERROR(EAGAIN);
 
-    auto vframe                       = vbuffer_.pop().value();
+        av::frame flush{ nullptr };
+        return encode_video_frame(flush);
+    }
+
+    const auto interval = av_q2d(av_inv_q(vfmt.framerate)) * 1e9;
+
+    int ret = 0;
+    for (size_t i = 0; i < n && ret >= 0; ++i) {
+        const auto begin = av::clock::ns();
+
+        ret = encode_video_frame(vframes_[i]);
+        vframes_[i].unref();
+
+        const auto busy = (av::clock::ns() - begin).count();
+        if (interval > 0) vload_ = vload_ * 0.95 + static_cast<double>(busy) / interval * 0.05;
+        vbusy_ += busy;
+        vframes_measured_++;
+    }
+
+    // how far behind: the frames popped at once, and the ones queued while encoding them
+    regulate(n + vbuffer_.size());
+
+    return ret;
+}
+
+bool Encoder::rate_control(av::frame& vframe)
+{
+    const auto [qoffset, keyframe] = rc_->update(activity::get(vframe.get()));
+
+    // a frame-wide region of interest, i.e. a qp offset of the whole frame
+    av_frame_remove_side_data(vframe.get(), AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    if (qoffset != 0.0f) {
+        const auto sd = av_frame_new_side_data(vframe.get(), AV_FRAME_DATA_REGIONS_OF_INTEREST,
+                                               sizeof(AVRegionOfInterest));
+        if (sd) {
+            *reinterpret_cast<AVRegionOfInterest *>(sd->data) = {
+                .self_size = sizeof(AVRegionOfInterest),
+                .top       = 0,
+                .bottom    = vframe->height,
+                .left      = 0,
+                .right     = vframe->width,
+                .qoffset   = av_d2q(qoffset, 1000),
+            };
+        }
+    }
+
+    return keyframe;
+}
+
+int Encoder::encode_video_frame(av::frame& vframe)
+{
     auto [num_frames, num_pre_frames] = video_sync_process(vframe);
 
+    if (num_frames == 0) trace::drop(trace::id(vframe.get()), trace::ENCODING);
+
+    if (vframe) {
+        if (num_frames == 0) vstats_.dropped++;
+        if (num_frames > 1) vstats_.duplicated += num_frames - 1;
+    }
+
+    // only the frame itself is encoded, at its position after the gap, and the duplicates after it
+    // are skipped as well, the timestamps of the next frames are the same as if they were encoded
+    int64_t skipped = 0;
+    if (skip_duplicates_ && vframe && num_frames > 1) {
+        expected_pts_ += num_pre_frames;
+        skipped        = num_frames - num_pre_frames - 1;
+        vduplicates_  += num_frames - 1;
+
+        num_frames     = 1;
+        num_pre_frames = 0;
+    }
+
+    // the first encoding of the frame only, not its duplicates
+    const auto keyframe = (rc_ && vframe && num_frames > 0) ? rate_control(vframe) : false;
+
     av::frame encoding_frame{};
     for (auto i = 0; i < num_frames; ++i) {
         encoding_frame = (i < num_pre_frames && last_frame_->buf[0]) ? last_frame_ : vframe;
@@ -337,13 +911,26 @@ int Encoder::process_video_frames()
         //
         if (encoding_frame) {
             encoding_frame->quality   = vcodec_ctx_->global_quality;
-            encoding_frame->pict_type = AV_PICTURE_TYPE_NONE;
+            encoding_frame->pict_type = (keyframe && i == num_pre_frames) ? AV_PICTURE_TYPE_I
+                                                                          : AV_PICTURE_TYPE_NONE;
             encoding_frame->pts       = expected_pts_;
+
+            // the packets are matched to the frames by pts
+            const auto trace_id = trace::id(encoding_frame.get());
+            vtraces_[static_cast<uint64_t>(expected_pts_) % vtraces_.size()] = trace_id;
+            trace::mark(trace_id, trace::ENCODING);
         }
 
-        int ret = avcodec_send_frame(vcodec_ctx_, encoding_frame.get());
+        auto begin = av::clock::ns();
+        int  ret   = avcodec_send_frame(vcodec_ctx_, encoding_frame.get());
+        vstats_.send_time += (av::clock::ns() - begin).count();
+        if (ret >= 0 && encoding_frame) vstats_.frames++;
+
         while (ret >= 0) {
-            ret = avcodec_receive_packet(vcodec_ctx_, packet_.put());
+            begin = av::clock::ns();
+            ret   = avcodec_receive_packet(vcodec_ctx_, vpacket_.put());
+            vstats_.receive_time += (av::clock::ns() - begin).count();
+
             if (ret == AVERROR(EAGAIN)) {
                 break;
             }
@@ -357,28 +944,34 @@ int Encoder::process_video_frames()
                 return ret;
             }
 
-            av_packet_rescale_ts(packet_.get(), vcodec_ctx_->time_base,
-                                 fmt_ctx_->streams[vstream_idx_]->time_base);
+            const auto trace_id =
+                vpacket_->pts >= 0 ? vtraces_[static_cast<uint64_t>(vpacket_->pts) % vtraces_.size()] : 0;
+            trace::mark(trace_id, trace::ENCODED);
+
+            av_packet_rescale_ts(vpacket_.get(), vcodec_ctx_->time_base, vtime_base_);
 
-            if (v_last_dts_ != AV_NOPTS_VALUE && v_last_dts_ >= packet_->dts) {
-                logw("[V] drop the packet with dts {} <= {}", packet_->dts, v_last_dts_);
+            if (v_last_dts_ != AV_NOPTS_VALUE && v_last_dts_ >= vpacket_->dts) {
+                logw("[V] drop the packet with dts {} <= {}", vpacket_->dts, v_last_dts_);
+                trace::drop(trace_id, trace::ENCODED);
                 continue;
             }
-            v_last_dts_ = packet_->dts;
+            v_last_dts_ = vpacket_->dts;
 
-            logd("[V] pts = {:>14d}, dts = {:>14d}, ts = {:.3%T}", packet_->pts, packet_->dts,
-                 av::clock::ns(packet_->pts, fmt_ctx_->streams[vstream_idx_]->time_base));
+            account(vpacket_.get());
 
-            packet_->stream_index = vstream_idx_;
-            if (av_interleaved_write_frame(fmt_ctx_, packet_.get()) != 0) {
-                loge("[V] failed to write the the packet to file.");
-                return -1;
-            }
+            logd("[V] pts = {:>14d}, dts = {:>14d}, ts = {:.3%T}", vpacket_->pts, vpacket_->dts,
+                 av::clock::ns(vpacket_->pts, vtime_base_));
+
+            vpacket_->stream_index = vstream_idx_;
+            vpackets_.wait_and_push({ std::move(vpacket_), trace_id });
+            wake(mwakeup_);
         }
 
         expected_pts_++;
     }
 
+    expected_pts_ += skipped;
+
     last_frame_ = vframe;
 
     return 0;
@@ -386,29 +979,26 @@ int Encoder::process_video_frames()
 
 int Encoder::process_audio_frames()
 {
-    if (abuffer_->size() < acodec_ctx_->frame_size && !asrc_eof_) return AVERROR(EAGAIN);
+    if (abuffer_->size() < aframe_size_ && !asrc_eof_) return AVERROR(EAGAIN);
 
-    const auto stream = fmt_ctx_->streams[astream_idx_];
-    av::frame  aframe{};
+    av::frame aframe{};
 
     int ret = 0;
     // encode and write to the output
-    while (!(eof_ & A_ENCODING_EOF) && (abuffer_->size() >= acodec_ctx_->frame_size || asrc_eof_)) {
+    while (!(eof_ & A_ENCODING_EOF) && (abuffer_->size() >= aframe_size_ || asrc_eof_)) {
 
-        if ((abuffer_->size() >= acodec_ctx_->frame_size) || (!abuffer_->empty() && asrc_eof_)) {
-            aframe.unref();
-
-            aframe->nb_samples     = std::min(acodec_ctx_->frame_size, abuffer_->size());
-            aframe->channels       = stream->codecpar->channels;
-            aframe->channel_layout = stream->codecpar->channel_layout;
-            aframe->format         = stream->codecpar->format;
-            aframe->sample_rate    = stream->codecpar->sample_rate;
-            aframe->pts            = audio_pts_ - abuffer_->size();
+        if ((abuffer_->size() >= aframe_size_) || (!abuffer_->empty() && asrc_eof_)) {
+            // references the fifo, released by the codec after encoding
+            if ((ret = abuffer_->read(aframe, aframe_size_)) < 0) {
+                loge("[A] failed to read samples from the fifo");
+                return ret;
+            }
 
-            av_frame_get_buffer(aframe.get(), 0);
+            if (ret == 0) return AVERROR(EAGAIN); // stopped
 
-            CHECK(abuffer_->read(reinterpret_cast<void **>(aframe->data), aframe->nb_samples) >=
-                  aframe->nb_samples);
+            aframe->channels       = acodec_ctx_->channels;
+            aframe->channel_layout = acodec_ctx_->channel_layout;
+            aframe->sample_rate    = acodec_ctx_->sample_rate;
 
             ret = avcodec_send_frame(acodec_ctx_, aframe.get());
         }
@@ -421,7 +1011,7 @@ int Encoder::process_audio_frames()
         }
 
         while (ret >= 0) {
-            ret = avcodec_receive_packet(acodec_ctx_, packet_.put());
+            ret = avcodec_receive_packet(acodec_ctx_, apacket_.put());
             if (ret == AVERROR(EAGAIN)) {
                 break;
             }
@@ -435,66 +1025,104 @@ int Encoder::process_audio_frames()
                 return ret;
             }
 
-            av_packet_rescale_ts(packet_.get(), acodec_ctx_->time_base, stream->time_base);
+            av_packet_rescale_ts(apacket_.get(), acodec_ctx_->time_base, atime_base_);
 
-            if (a_last_dts_ != AV_NOPTS_VALUE && a_last_dts_ >= packet_->dts) {
-                logw("[A] drop the frame: dts {} <= {}", packet_->dts, a_last_dts_);
+            if (a_last_dts_ != AV_NOPTS_VALUE && a_last_dts_ >= apacket_->dts) {
+                logw("[A] drop the frame: dts {} <= {}", apacket_->dts, a_last_dts_);
                 continue;
             }
-            a_last_dts_ = packet_->dts;
-
-            logi("[A] pts = {:>14d}, dts = {:>14d}, ts = {:.3%T}", packet_->pts, packet_->dts,
-                 av::clock::ns(packet_->pts, stream->time_base));
+            a_last_dts_ = apacket_->dts;
 
-            packet_->stream_index = astream_idx_;
+            logi("[A] pts = {:>14d}, dts = {:>14d}, ts = {:.3%T}", apacket_->pts, apacket_->dts,
+                 av::clock::ns(apacket_->pts, atime_base_));
 
-            if (av_interleaved_write_frame(fmt_ctx_, packet_.get()) != 0) {
-                loge("[A] failed to write the packet to the file.");
-                return -1;
-            }
+            apacket_->stream_index = astream_idx_;
+            apackets_.wait_and_push({ std::move(apacket_), 0 });
+            wake(mwakeup_);
         }
     }
 
     return ret;
 }
 
-void Encoder::close_output_file()
+void Encoder::close_output_file(const bool behind)
 {
     if (!fmt_ctx_) return;
 
+    // no header written
+    if (replay_) {
+        avformat_free_context(fmt_ctx_);
+        fmt_ctx_ = nullptr;
+        return;
+    }
+
     if (av_write_trailer(fmt_ctx_) < 0) {
         loge("[   ENCODER] failed to write trailer");
     }
 
-    if (!(fmt_ctx_->oformat->flags & AVFMT_NOFILE) && avio_close(fmt_ctx_->pb) < 0) {
+    if (writer_ && behind) {
+        fmt_ctx_->pb = nullptr;
+
+        // at most one segment behind, waits only if the disk is slower than a whole segment
+        if (closer_.joinable()) closer_.join();
+        closer_ = std::jthread([writer = std::move(writer_)] {
+            probe::thread::set_name("MUXER-CLOSE");
+            if (writer->close() < 0) loge("[   ENCODER] failed to write the output file.");
+        });
+    }
+    else if (writer_) {
+        fmt_ctx_->pb = nullptr;
+        if (writer_->close() < 0) loge("[   ENCODER] failed to write the output file.");
+        writer_ = nullptr;
+    }
+    else if (!(fmt_ctx_->oformat->flags & AVFMT_NOFILE) && avio_close(fmt_ctx_->pb) < 0) {
         loge("[   ENCODER] failed to close the output file.");
     }
 
-    avcodec_free_context(&vcodec_ctx_);
-    avcodec_free_context(&acodec_ctx_);
     avformat_free_context(fmt_ctx_);
     fmt_ctx_ = nullptr;
 }
 
+int Encoder::save_replay(const std::string& filename, replay_buffer::callback_t callback)
+{
+    if (!replay_) return av::UNSUPPORTED;
+
+    return replay_->save(filename, std::move(callback));
+}
+
 void Encoder::stop()
 {
     asrc_eof_ = true;
-    vbuffer_.push(nullptr);
-
-    // wait <= 3s for draining
-    for (int i = 0; (i < 300) && ready() && !eof(); i++) {
-        std::this_thread::sleep_for(10ms);
+    vsrc_eof_ = true;
+    wake(vwakeup_);
+    wake(awakeup_);
+
+    // wait <= 3s for draining, the muxing thread signals when it reaches the EOF
+    {
+        std::unique_lock lock(eof_mtx_);
+        eof_cv_.wait_for(lock, 3s, [this] { return !ready() || !running_ || eof(); });
     }
 
     if (abuffer_) abuffer_->stop();
     vbuffer_.stop();
+    vpackets_.stop();
+    apackets_.stop();
 
     ready_   = false;
     running_ = false;
+    wake(vwakeup_);
+    wake(awakeup_);
+    wake(mwakeup_);
 
-    if (thread_.joinable()) thread_.join();
+    if (vthread_.joinable()) vthread_.join();
+    if (athread_.joinable()) athread_.join();
+    if (mthread_.joinable()) mthread_.join();
 
     close_output_file();
+    if (closer_.joinable()) closer_.join();
+
+    avcodec_free_context(&vcodec_ctx_);
+    avcodec_free_context(&acodec_ctx_);
 
     logi("[   ENCODER] STOPPED");
 }
@@ -502,20 +1130,34 @@ void Encoder::stop()
 Encoder::~Encoder()
 {
     vbuffer_.stop();
-    vbuffer_.drain();
+    vpackets_.stop();
+    apackets_.stop();
 
-    if (abuffer_) {
-        abuffer_->stop();
-        abuffer_->drain();
-    }
+    if (abuffer_) abuffer_->stop();
 
     asrc_eof_ = true;
+    vsrc_eof_ = true;
     ready_    = false;
     running_  = false;
+    wake(vwakeup_);
+    wake(awakeup_);
+    wake(mwakeup_);
 
-    if (thread_.joinable()) thread_.join();
+    if (vthread_.joinable()) vthread_.join();
+    if (athread_.joinable()) athread_.join();
+    if (mthread_.joinable()) mthread_.join();
+
+    // consumer side of the queues, only after the threads exited
+    vbuffer_.drain();
+    vpackets_.drain();
+    apackets_.drain();
+    if (abuffer_) abuffer_->drain();
 
     close_output_file();
+    if (closer_.joinable()) closer_.join();
+
+    avcodec_free_context(&vcodec_ctx_);
+    avcodec_free_context(&acodec_ctx_);
 
     logi("[   ENCODER] ~");
 }
\ No newline at end of file
@@ -0,0 +1,284 @@
+#include "libcap/ffmpeg-wrapper.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/samplefmt.h>
+}
+
+// structs kept for reuse, per type
+static constexpr size_t MAX_FREE = 256;
+
+// AVBufferPools alive at once, the least recently used one is dropped beyond
+static constexpr size_t MAX_POOLS = 32;
+
+// the buffers are rounded up to a power of 2 below, and to a multiple of it above
+static constexpr size_t BUCKET = 64 * 1024;
+
+namespace
+{
+    struct bucket_t
+    {
+        size_t        size{};
+        AVBufferPool *pool{};
+        uint64_t      used{}; // tick of the last use
+    };
+
+    struct pools_t
+    {
+        std::mutex             frames_mtx{};
+        std::vector<AVFrame *> frames{};
+
+        std::mutex              packets_mtx{};
+        std::vector<AVPacket *> packets{};
+
+        std::mutex            buckets_mtx{};
+        std::vector<bucket_t> buckets{};
+        uint64_t              tick{};
+
+        // @{
+        std::atomic<uint64_t> frames_allocated{};
+        std::atomic<uint64_t> frames_reused{};
+        std::atomic<uint64_t> packets_allocated{};
+        std::atomic<uint64_t> packets_reused{};
+        std::atomic<uint64_t> buffers_requested{};
+        std::atomic<uint64_t> buffers_allocated{};
+        // @}
+    };
+
+    // never destroyed, the frames may be released by the threads still running at exit
+    pools_t& pools()
+    {
+        static auto instance = new pools_t{};
+        return *instance;
+    }
+
+    AVBufferRef *alloc_buffer(void *, const size_t size)
+    {
+        pools().buffers_allocated++;
+        return av_buffer_alloc(size);
+    }
+
+    size_t bucket_size(const size_t size)
+    {
+        if (size >= BUCKET) return (size + BUCKET - 1) / BUCKET * BUCKET;
+
+        size_t bucket = 64;
+        while (bucket < size) bucket <<= 1;
+        return bucket;
+    }
+
+    int channels_of(const AVFrame *frame)
+    {
+#if LIBAVUTIL_VERSION_MAJOR >= 59
+        return frame->ch_layout.nb_channels;
+#elif LIBAVUTIL_VERSION_MAJOR >= 57
+        return frame->ch_layout.nb_channels ? frame->ch_layout.nb_channels : frame->channels;
+#else
+        return frame->channels;
+#endif
+    }
+
+    int get_video_buffer(AVFrame *frame, int align)
+    {
+        const auto pix_fmt = static_cast<AVPixelFormat>(frame->format);
+        const auto desc    = av_pix_fmt_desc_get(pix_fmt);
+        if (!desc || frame->width <= 0 || frame->height <= 0) return AVERROR(EINVAL);
+
+        if (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_PAL))
+            return av_frame_get_buffer(frame, align);
+
+        align = (align > 0) ? align : 64;
+
+        int linesizes[4]{};
+        if (const int ret = av_image_fill_linesizes(linesizes, pix_fmt, FFALIGN(frame->width, align));
+            ret < 0)
+            return ret;
+
+        for (int i = 0; i < 4; ++i) {
+            frame->linesize[i] = FFALIGN(linesizes[i], align);
+        }
+
+        // padded like av_frame_get_buffer(), some of the SIMD reads over the last rows
+        const auto height = FFALIGN(frame->height, 32);
+
+        uint8_t *data[4]{};
+        const int size = av_image_fill_pointers(data, pix_fmt, height, nullptr, frame->linesize);
+        if (size < 0) return size;
+
+        frame->buf[0] = av::pool::buffer(static_cast<size_t>(size) + 16 + align - 1);
+        if (!frame->buf[0]) return AVERROR(ENOMEM);
+
+        av_image_fill_pointers(frame->data, pix_fmt, height, frame->buf[0]->data, frame->linesize);
+        frame->extended_data = frame->data;
+
+        return 0;
+    }
+
+    int get_audio_buffer(AVFrame *frame, const int align)
+    {
+        const auto sample_fmt = static_cast<AVSampleFormat>(frame->format);
+        const auto channels   = channels_of(frame);
+        if (channels <= 0 || frame->nb_samples <= 0) return AVERROR(EINVAL);
+
+        // the planes beyond the data pointers are in the extended_data, not worth it
+        if (av_sample_fmt_is_planar(sample_fmt) && channels > AV_NUM_DATA_POINTERS)
+            return av_frame_get_buffer(frame, align);
+
+        const int size =
+            av_samples_get_buffer_size(&frame->linesize[0], channels, frame->nb_samples, sample_fmt, align);
+        if (size < 0) return size;
+
+        frame->buf[0] = av::pool::buffer(static_cast<size_t>(size));
+        if (!frame->buf[0]) return AVERROR(ENOMEM);
+
+        const int ret = av_samples_fill_arrays(frame->data, &frame->linesize[0], frame->buf[0]->data,
+                                               channels, frame->nb_samples, sample_fmt, align);
+        if (ret < 0) {
+            av_buffer_unref(&frame->buf[0]);
+            return ret;
+        }
+
+        frame->extended_data = frame->data;
+
+        return 0;
+    }
+} // namespace
+
+namespace av::pool
+{
+    AVFrame *frame()
+    {
+        auto& self = pools();
+        {
+            std::lock_guard lock(self.frames_mtx);
+            if (!self.frames.empty()) {
+                const auto frame = self.frames.back();
+                self.frames.pop_back();
+                self.frames_reused++;
+                return frame;
+            }
+        }
+
+        self.frames_allocated++;
+        return av_frame_alloc();
+    }
+
+    void recycle(AVFrame *frame)
+    {
+        if (!frame) return;
+
+        av_frame_unref(frame);
+
+        auto& self = pools();
+        {
+            std::lock_guard lock(self.frames_mtx);
+            if (self.frames.size() < MAX_FREE) {
+                if (self.frames.capacity() < MAX_FREE) self.frames.reserve(MAX_FREE);
+
+                self.frames.push_back(frame);
+                return;
+            }
+        }
+
+        av_frame_free(&frame);
+    }
+
+    AVPacket *packet()
+    {
+        auto& self = pools();
+        {
+            std::lock_guard lock(self.packets_mtx);
+            if (!self.packets.empty()) {
+                const auto packet = self.packets.back();
+                self.packets.pop_back();
+                self.packets_reused++;
+                return packet;
+            }
+        }
+
+        self.packets_allocated++;
+        return av_packet_alloc();
+    }
+
+    void recycle(AVPacket *packet)
+    {
+        if (!packet) return;
+
+        av_packet_unref(packet);
+
+        auto& self = pools();
+        {
+            std::lock_guard lock(self.packets_mtx);
+            if (self.packets.size() < MAX_FREE) {
+                if (self.packets.capacity() < MAX_FREE) self.packets.reserve(MAX_FREE);
+
+                self.packets.push_back(packet);
+                return;
+            }
+        }
+
+        av_packet_free(&packet);
+    }
+
+    AVBufferRef *buffer(const size_t size)
+    {
+        if (!size) return nullptr;
+
+        auto& self = pools();
+        self.buffers_requested++;
+
+        const auto bsize = bucket_size(size);
+
+        std::lock_guard lock(self.buckets_mtx);
+
+        auto it = std::ranges::find(self.buckets, bsize, &bucket_t::size);
+        if (it == self.buckets.end()) {
+            // e.g. the frames of the previous size after a resize
+            if (self.buckets.size() >= MAX_POOLS) {
+                const auto lru = std::ranges::min_element(self.buckets, {}, &bucket_t::used);
+                // the pool is freed after its last buffer is returned
+                av_buffer_pool_uninit(&lru->pool);
+                self.buckets.erase(lru);
+            }
+
+            const auto pool = av_buffer_pool_init2(bsize, nullptr, alloc_buffer, nullptr);
+            if (!pool) return alloc_buffer(nullptr, size);
+
+            it = self.buckets.insert(self.buckets.end(), { .size = bsize, .pool = pool });
+        }
+
+        it->used = ++self.tick;
+
+        return av_buffer_pool_get(it->pool);
+    }
+
+    int get_buffer(AVFrame *frame, const int align)
+    {
+        if (!frame || frame->format < 0 || frame->buf[0]) return AVERROR(EINVAL);
+
+        return (frame->width > 0 || frame->height > 0) ? get_video_buffer(frame, align)
+                                                        : get_audio_buffer(frame, align);
+    }
+
+    counters_t counters()
+    {
+        const auto& self      = pools();
+        const auto  requested = self.buffers_requested.load();
+        const auto  allocated = self.buffers_allocated.load();
+
+        return {
+            .frames         = self.frames_allocated.load(),
+            .frames_reused  = self.frames_reused.load(),
+            .packets        = self.packets_allocated.load(),
+            .packets_reused = self.packets_reused.load(),
+            .buffers        = allocated,
+            .buffers_reused = requested > allocated ? requested - allocated : 0,
+        };
+    }
+} // namespace av::pool
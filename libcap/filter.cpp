@@ -1,6 +1,21 @@
 #include "libcap/filter.h"
 
 #include "logging.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fmt/ranges.h>
+#include <map>
+#include <ranges>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#elif _WIN32
+#include <Windows.h>
+#endif
+
 extern "C" {
 #include <libavutil/opt.h>
 }
@@ -108,4 +123,297 @@ namespace av::graph
 
         return 0;
     }
-} // namespace av::graph
\ No newline at end of file
+
+    // split at the delimiter outside of quotes, keeping the quotes & escapes
+    static std::vector<std::string> split(const std::string& str, const char delim)
+    {
+        std::vector<std::string> tokens{ std::string{} };
+
+        bool quoted = false;
+        for (size_t i = 0; i < str.size(); ++i) {
+            if (str[i] == '\\' && i + 1 < str.size()) {
+                tokens.back() += str[i];
+                tokens.back() += str[++i];
+                continue;
+            }
+
+            if (str[i] == '\'') quoted = !quoted;
+
+            if (str[i] == delim && !quoted)
+                tokens.emplace_back();
+            else
+                tokens.back() += str[i];
+        }
+        return tokens;
+    }
+
+    static std::string unescape(const std::string& str)
+    {
+        std::string value{};
+        for (size_t i = 0; i < str.size(); ++i) {
+            if (str[i] == '\\' && i + 1 < str.size())
+                value += str[++i];
+            else if (str[i] != '\'')
+                value += str[i];
+        }
+        return value;
+    }
+
+    static std::string trim(const std::string& str)
+    {
+        const auto begin = str.find_first_not_of(" \t\r\n");
+        const auto end   = str.find_last_not_of(" \t\r\n");
+        return begin == std::string::npos ? std::string{} : str.substr(begin, end - begin + 1);
+    }
+
+    description_t parse_description(const std::string& desc)
+    {
+        description_t parsed{};
+
+        std::string name{}, args{};
+        bool        in_args = false, quoted = false;
+
+        const auto flush = [&] {
+            if (!name.empty()) {
+                parsed.topology += name;
+                parsed.filters.emplace_back(name, trim(args));
+            }
+            name.clear();
+            args.clear();
+            in_args = false;
+        };
+
+        for (size_t i = 0; i < desc.size(); ++i) {
+            const char c = desc[i];
+
+            if (in_args) {
+                if (c == '\\' && i + 1 < desc.size()) {
+                    args += c;
+                    args += desc[++i];
+                    continue;
+                }
+
+                if (c == '\'') quoted = !quoted;
+
+                if (quoted || (c != ',' && c != ';' && c != '[')) {
+                    args += c;
+                    continue;
+                }
+            }
+
+            switch (c) {
+            case '[': // link label
+                flush();
+                for (; i < desc.size() && desc[i] != ']'; ++i) {
+                    parsed.topology += desc[i];
+                }
+                if (i < desc.size()) parsed.topology += ']';
+                break;
+
+            case ',':
+            case ';':
+                flush();
+                parsed.topology += c;
+                break;
+
+            case '=':
+                if (!name.empty()) {
+                    in_args = true;
+                    break;
+                }
+                [[fallthrough]];
+
+            default:
+                if (!std::isspace(static_cast<unsigned char>(c))) name += c;
+                break;
+            }
+        }
+        flush();
+
+        return parsed;
+    }
+
+    // 'key=value' & positional arguments by option name, see process_options() in libavfilter
+    static std::optional<std::map<std::string, std::string>> options(const AVClass *cls,
+                                                                     const std::string& args)
+    {
+        std::map<std::string, std::string> opts{};
+        if (args.empty()) return opts;
+
+        // names of the positional arguments, in order and without the aliases
+        std::vector<std::string> shorthand{};
+        int                      offset = -1;
+        for (const AVOption *opt = nullptr; (opt = av_opt_next(&cls, opt));) {
+            if (opt->type == AV_OPT_TYPE_CONST || opt->offset == offset) continue;
+
+            offset = opt->offset;
+            shorthand.emplace_back(opt->name);
+        }
+
+        size_t positional = 0;
+        bool   named      = false;
+        for (const auto& arg : split(args, ':')) {
+            const auto kv = split(arg, '=');
+            if (kv.size() == 1) {
+                // no positional arguments after named ones
+                if (named || positional >= shorthand.size()) return std::nullopt;
+
+                opts[shorthand[positional++]] = unescape(arg);
+            }
+            else {
+                named = true;
+
+                opts[trim(kv[0])] = unescape(arg.substr(kv[0].size() + 1));
+            }
+        }
+
+        return opts;
+    }
+
+    std::optional<std::vector<command_t>> diff(const std::string& from, const std::string& to)
+    {
+        const auto prev = parse_description(from);
+        const auto next = parse_description(to);
+
+        if (prev.topology != next.topology) return std::nullopt;
+
+        std::vector<command_t> commands{};
+        for (size_t i = 0; i < next.filters.size(); ++i) {
+            const auto& [name, args] = next.filters[i];
+            if (args == prev.filters[i].second) continue;
+
+            const auto at     = name.find('@');
+            const auto filter = avfilter_get_by_name(name.substr(0, at).c_str());
+            if (!filter || !filter->priv_class) return std::nullopt;
+
+            const auto prev_opts = options(filter->priv_class, prev.filters[i].second);
+            const auto next_opts = options(filter->priv_class, args);
+            if (!prev_opts || !next_opts) return std::nullopt;
+
+            // reverting an option to its default is not a command
+            for (const auto& key : *prev_opts | std::views::keys) {
+                if (!next_opts->contains(key)) return std::nullopt;
+            }
+
+            // the instance names given by avfilter_graph_parse2()
+            const auto target = (at != std::string::npos) ? name : fmt::format("Parsed_{}_{}", name, i);
+
+            for (const auto& [key, value] : *next_opts) {
+                if (const auto it = prev_opts->find(key); it != prev_opts->end() && it->second == value)
+                    continue;
+
+                auto       cls = filter->priv_class;
+                const auto opt = av_opt_find(&cls, key.c_str(), nullptr, 0, AV_OPT_SEARCH_FAKE_OBJ);
+                if (!opt || !(opt->flags & AV_OPT_FLAG_RUNTIME_PARAM)) return std::nullopt;
+
+                commands.push_back({ .target = target, .cmd = key, .arg = value });
+            }
+        }
+
+        return commands;
+    }
+
+    int auto_threads(const av::vformat_t& fmt)
+    {
+        const int cores  = std::max<int>(static_cast<int>(std::thread::hardware_concurrency()), 1);
+        const int pixels = std::max(fmt.width, 1) * std::max(fmt.height, 1);
+
+        // 1080p: 4, 4K: 16, but never more than half of the cores
+        return std::clamp((pixels + 960 * 540 - 1) / (960 * 540), 1, std::clamp(cores / 2, 1, 16));
+    }
+
+    void set_threading(AVFilterGraph *graph, const threading_t& threading, const int auto_threads)
+    {
+        if (!graph) return;
+
+        const int threads = threading.threads > 0 ? threading.threads : auto_threads;
+
+        // nb_threads = 1 spawns no thread at all
+        graph->thread_type = threading.slice ? AVFILTER_THREAD_SLICE : 0;
+        graph->nb_threads  = threading.slice ? std::max(threads, 1) : 1;
+    }
+
+    void dump_threading(const AVFilterGraph *graph, const char *tag)
+    {
+        if (!graph) return;
+
+        const int threads = (graph->thread_type & AVFILTER_THREAD_SLICE) ? graph->nb_threads : 1;
+        logi("{} filter graph: {} filters, {} slice threads", tag, graph->nb_filters, threads);
+
+        for (unsigned i = 0; i < graph->nb_filters; ++i) {
+            const auto filter = graph->filters[i];
+            const bool sliced = filter->filter->flags & AVFILTER_FLAG_SLICE_THREADS;
+            const int  limit  = filter->nb_threads > 0 ? std::min(filter->nb_threads, threads) : threads;
+
+            logi("{}   {:>24} ({:>12}): {} thread(s)", tag, filter->name, filter->filter->name,
+                 sliced ? limit : 1);
+        }
+    }
+
+#ifdef __linux__
+    static std::vector<int> get_affinity()
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0) return {};
+
+        std::vector<int> cpus{};
+        for (int i = 0; i < CPU_SETSIZE; ++i) {
+            if (CPU_ISSET(i, &set)) cpus.push_back(i);
+        }
+        return cpus;
+    }
+
+    static bool set_affinity(const std::vector<int>& cpus)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (const auto cpu : cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+        }
+
+        return CPU_COUNT(&set) > 0 && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+#elif _WIN32
+    static std::vector<int> get_affinity()
+    {
+        // no GetThreadAffinityMask, query it by setting the mask of the process
+        DWORD_PTR process = 0, system = 0;
+        if (!::GetProcessAffinityMask(::GetCurrentProcess(), &process, &system)) return {};
+
+        const auto mask = ::SetThreadAffinityMask(::GetCurrentThread(), process);
+        if (!mask) return {};
+        ::SetThreadAffinityMask(::GetCurrentThread(), mask);
+
+        std::vector<int> cpus{};
+        for (int i = 0; i < static_cast<int>(sizeof(DWORD_PTR) * 8); ++i) {
+            if (mask & (DWORD_PTR{ 1 } << i)) cpus.push_back(i);
+        }
+        return cpus;
+    }
+
+    static bool set_affinity(const std::vector<int>& cpus)
+    {
+        DWORD_PTR mask = 0;
+        for (const auto cpu : cpus) {
+            if (cpu >= 0 && cpu < static_cast<int>(sizeof(DWORD_PTR) * 8)) mask |= DWORD_PTR{ 1 } << cpu;
+        }
+
+        return mask && ::SetThreadAffinityMask(::GetCurrentThread(), mask);
+    }
+#endif
+
+    affinity_guard::affinity_guard(const std::vector<int>& cpus)
+    {
+        if (cpus.empty()) return;
+
+        saved_  = get_affinity();
+        pinned_ = !saved_.empty() && set_affinity(cpus);
+        if (!pinned_) logw("failed to pin the thread to cores: {}", fmt::join(cpus, ","));
+    }
+
+    affinity_guard::~affinity_guard()
+    {
+        if (pinned_) set_affinity(saved_);
+    }
+} // namespace av::graph
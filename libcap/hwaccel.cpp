@@ -1,6 +1,5 @@
 #include "libcap/hwaccel.h"
 
-#include <probe/defer.h>
 #include <probe/library.h>
 
 extern "C" {
@@ -141,18 +140,22 @@ namespace av::hwaccel
             return 0;
         }
 
-        auto output = av_frame_alloc();
+        av::frame output{};
         if (!output) return AVERROR(ENOMEM);
-        defer(av_frame_free(&output));
 
         output->format = pix_fmt;
+        output->width  = input->width;
+        output->height = input->height;
 
-        if (av_hwframe_transfer_data(output, input, 0) < 0) return -1;
+        // downloaded into a pooled buffer, av_hwframe_transfer_data() allocates one per frame otherwise
+        if (av::pool::get_buffer(output.get()) < 0) return -1;
 
-        if (av_frame_copy_props(output, input) < 0) return -1;
+        if (av_hwframe_transfer_data(output.get(), input, 0) < 0) return -1;
+
+        if (av_frame_copy_props(output.get(), input) < 0) return -1;
 
         av_frame_unref(input);
-        av_frame_move_ref(input, output);
+        av_frame_move_ref(input, output.get());
 
         return 0;
     }
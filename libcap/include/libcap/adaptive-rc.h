@@ -0,0 +1,101 @@
+#ifndef CAPTURER_ADAPTIVE_RC_H
+#define CAPTURER_ADAPTIVE_RC_H
+
+#include <cstdint>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+/**
+ * Content-adaptive rate control of the screen recordings.
+ *
+ * The screen is mostly static, with bursts of changes while scrolling or switching windows. The
+ * dispatcher measures how much of each captured frame has changed since the previous one, by
+ * comparing a few sampled rows of every 64x64 block, and the activity is carried to the encoder in
+ * AVFrame::opaque_ref (av_frame_copy_props keeps it through the filters).
+ *
+ * The encoder keeps its crf and biases the quantizer of the whole frame by the state of the scene,
+ * with a frame-wide region of interest, which libx264 & libx265 apply as a qp offset:
+ *
+ *  still : nothing changed for a while, fewer bits, and no keyframes until the scene moves again or
+ *          the maximum GOP of the encoder is reached
+ *  normal: unchanged crf, a keyframe every 'gop' frames
+ *  motion: a large part of the screen is changing, more bits
+ */
+namespace activity
+{
+    // the changed fraction of the sampled blocks, 0 ~ 1, or < 0 if the frames can not be compared,
+    // e.g. the hardware frames or the frames of different sizes
+    float measure(const AVFrame *prev, const AVFrame *frame);
+
+    // the frame is in system memory, and in a pixel format that can be measured
+    bool measurable(const AVFrame *frame);
+
+    // the activity is carried by the frame @{
+    void tag(AVFrame *frame, float activity);
+
+    // < 0 if not tagged
+    float get(const AVFrame *frame);
+    // @}
+} // namespace activity
+
+class adaptive_rc
+{
+public:
+    enum class state_t
+    {
+        normal,
+        still,
+        motion,
+    };
+
+    struct options_t
+    {
+        int gop{ 12 };  // keyframe interval, except while still
+        int hold{ 30 }; // frames without any change before the scene is still
+
+        float still_threshold{ 0.002f }; // activity of an unchanged frame, e.g. a blinking caret
+        float motion_threshold{ 0.08f };
+
+        // qp offsets, in the range of AVRegionOfInterest::qoffset, x264 scales them by 25
+        float still_qoffset{ 0.1f };
+        float motion_qoffset{ -0.06f };
+    };
+
+    struct decision_t
+    {
+        float qoffset{};
+        bool  keyframe{};
+    };
+
+    struct stats_t
+    {
+        uint64_t frames{};
+        uint64_t still{};
+        uint64_t motion{};
+        uint64_t keyframes{};  // forced
+        uint64_t unmeasured{}; // frames without activity, encoded as normal
+    };
+
+    explicit adaptive_rc(const options_t& options);
+
+    // the decision for the next frame to encode
+    decision_t update(float activity);
+
+    [[nodiscard]] state_t state() const { return state_; }
+
+    [[nodiscard]] stats_t stats() const { return stats_; }
+
+private:
+    const options_t options_{};
+
+    state_t state_{ state_t::normal };
+    float   ema_{ -1.0f }; // smoothed activity
+    int     idle_{};       // frames since the last change
+    int     since_key_{};
+
+    stats_t stats_{};
+};
+
+#endif //! CAPTURER_ADAPTIVE_RC_H
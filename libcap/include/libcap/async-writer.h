@@ -0,0 +1,135 @@
+#ifndef CAPTURER_ASYNC_WRITER_H
+#define CAPTURER_ASYNC_WRITER_H
+
+#include "queue.h"
+#include "telemetry.h"
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include <libavformat/avio.h>
+#include <libavformat/version.h>
+}
+
+/**
+ * Write-behind output of a muxer: an AVIOContext whose writes are copied into blocks of a large
+ * buffer, and written to the file by an I/O thread, so that a slow disk, a network mount or a
+ * writeback stall does not block the muxing thread until the buffer is full.
+ *
+ * Each block carries its file offset and the blocks are written in order with positioned writes,
+ * so the seeks of the muxers (e.g. mp4 updating the size of 'mdat') need no flushing. Reading is
+ * not supported, e.g. the second pass of 'movflags=faststart'.
+ *
+ * ATTENTION: the AVIOContext must only be used by one thread.
+ */
+class async_writer
+{
+public:
+    struct options_t
+    {
+        size_t  buffer_size{ 64 * 1024 * 1024 }; // write-behind, in bytes
+        size_t  block_size{ 1024 * 1024 };       // bytes per write of the I/O thread
+        bool    direct{};                        // O_DIRECT for the aligned blocks, Linux only
+        int64_t preallocate{};                   // bytes reserved for the file at open, Linux only
+    };
+
+    struct stats_t
+    {
+        log_histogram::snapshot_t latency{}; // per write of the I/O thread, ns
+        log_histogram::snapshot_t blocked{}; // the muxer waiting for the buffer, ns
+
+        uint64_t written{};    // bytes
+        size_t   buffered{};   // bytes not written yet
+        size_t   capacity{};   // bytes
+        uint64_t high_water{}; // blocks
+        uint64_t errors{};
+
+        [[nodiscard]] double fill() const
+        {
+            return capacity ? static_cast<double>(buffered) / static_cast<double>(capacity) : 0.0;
+        }
+    };
+
+    async_writer() = default;
+
+    async_writer(const async_writer&)            = delete;
+    async_writer& operator=(const async_writer&) = delete;
+
+    ~async_writer();
+
+    // create the file and the AVIOContext, and start the I/O thread
+    int open(const std::string& filename, const options_t& options);
+
+    // flush the AVIOContext, write all the blocks, release the unused preallocated space and close the file
+    int close();
+
+    // hand the buffered bytes over to the I/O thread, without waiting for them to be written
+    int flush();
+
+    // owned by the writer, valid between open() and close()
+    [[nodiscard]] AVIOContext *context() const { return pb_; }
+
+    [[nodiscard]] stats_t stats() const;
+
+private:
+    struct block_t
+    {
+        std::unique_ptr<uint8_t, void (*)(void *)> data{ nullptr, nullptr };
+
+        int64_t offset{};
+        size_t  size{};
+        bool    eof{}; // the last one, written at close()
+
+        friend size_t buffer_size(const block_t& block) { return block.size; }
+    };
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+    using write_buffer_t = const uint8_t *;
+#else
+    using write_buffer_t = uint8_t *;
+#endif
+
+    // AVIOContext callbacks, on the muxing thread @{
+    static int     write_packet(void *opaque, write_buffer_t buf, int size);
+    static int64_t seek(void *opaque, int64_t offset, int whence);
+    // @}
+
+    // queue the current block, if any
+    int flush_block();
+
+    void io_thread_fn();
+
+    // positioned write of a whole block, with the O_DIRECT descriptor if aligned
+    int write_block(const block_t& block);
+
+    options_t options_{};
+
+    AVIOContext *pb_{};
+
+    // muxing thread @{
+    block_t block_{};
+    int64_t position_{}; // of the next write
+    int64_t size_{};     // of the file once all blocks are written
+    // @}
+
+    std::unique_ptr<spsc_queue<block_t>> blocks_{};
+    std::jthread                         thread_{};
+
+#ifdef __linux__
+    int fd_{ -1 };
+    int dfd_{ -1 }; // O_DIRECT
+#else
+    std::ofstream file_{};
+#endif
+
+    log_histogram         latency_{};
+    std::atomic<uint64_t> written_{};
+    std::atomic<uint64_t> errors_{};
+};
+
+#endif //! CAPTURER_ASYNC_WRITER_H
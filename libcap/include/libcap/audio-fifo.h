@@ -1,81 +1,153 @@
 #ifndef CAPTURER_AuDIO_FIFO_H
 #define CAPTURER_AuDIO_FIFO_H
 
-#include <condition_variable>
-#include <mutex>
+#include "ffmpeg-wrapper.h"
+#include "telemetry.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
 
 extern "C" {
-#include <libavutil/audio_fifo.h>
+#include <libavutil/avutil.h>
+#include <libavutil/samplefmt.h>
 }
 
-class safe_audio_fifo
+/**
+ * Single-producer / single-consumer ring of planar or packed audio samples.
+ *
+ * Writing copies the samples into the ring, which is the only copy on the way to the encoder.
+ * Reading hands out frames referencing the ring directly through AVBufferRef-backed views, and only
+ * copies if the samples straddle the wrap point. The space of a view is reused after the last
+ * reference to the frame is released, so the encoder may keep the frames as long as it needs.
+ *
+ * ATTENTION:
+ *   - write / wait_and_write must always be called from the same (producer) thread, and
+ *     read / drain from the same (consumer) thread. Neither side takes a lock.
+ *   - all frames read from the fifo must be released before the fifo is destroyed.
+ *   - at most AV_NUM_DATA_POINTERS planes.
+ */
+class spsc_audio_fifo
 {
 public:
-    explicit safe_audio_fifo(AVSampleFormat sample_fmt, int channels, int capacity);
+    /**
+     * @param capacity  number of samples per plane, a multiple of the read size avoids copying
+     */
+    spsc_audio_fifo(AVSampleFormat sample_fmt, int channels, int capacity);
+
+    spsc_audio_fifo(const spsc_audio_fifo&)            = delete;
+    spsc_audio_fifo& operator=(const spsc_audio_fifo&) = delete;
 
-    safe_audio_fifo(const safe_audio_fifo&)            = delete;
-    safe_audio_fifo& operator=(const safe_audio_fifo&) = delete;
+    ~spsc_audio_fifo();
 
-    ~safe_audio_fifo();
+    [[nodiscard]] bool empty() const { return size() == 0; }
 
-    bool empty() const;
+    [[nodiscard]] int size() const;
 
-    int size() const;
+    [[nodiscard]] int capacity() const { return capacity_; }
 
-    int capacity() const;
+    [[nodiscard]] bool stopped() const { return stopped_.load(); }
 
-    int reserve(int nb_samples);
+    // telemetry in samples, must be enabled before the fifo is shared between threads @{
+    void enable_telemetry(const std::string& name) { telemetry_ = telemetry::make_queue(name); }
+
+    [[nodiscard]] std::shared_ptr<const queue_telemetry> telemetry() const { return telemetry_; }
+    // @}
+
+    // producer @{
 
     /**
-     * Write data to the AVAudioFifo.
-     *
-     * The safe_audio_fifo will be reallocated automatically if the available space
-     * is less than nb_samples.
+     * Write all nb_samples or nothing, without blocking.
      *
      * @param data        audio data plane pointers
      * @param nb_samples  number of samples to write
-     * @return            number of samples actually written, or negative AVERROR
-     *                    code on failure. If successful, the number of samples
-     *                    actually written will always be nb_samples.
+     * @param pts         pts of the first sample in 1/sample_rate, AV_NOPTS_VALUE if unknown
+     * @return            nb_samples, or 0 if the fifo is stopped or has not enough space
      */
-    int write(void **data, int nb_samples);
+    int write(const uint8_t *const *data, int nb_samples, int64_t pts = AV_NOPTS_VALUE);
 
-    int wait_and_write(void **data, int nb_samples);
+    // same as write, but waits for the consumer to free enough space
+    int wait_and_write(const uint8_t *const *data, int nb_samples, int64_t pts = AV_NOPTS_VALUE);
+    // @}
+
+    // consumer @{
 
     /**
-     * Read data from the AVAudioFifo.
+     * Read at most nb_samples into the frame, and set its data, linesize, buf, nb_samples, format
+     * and pts. The frame references the ring unless the samples wrap around.
      *
-     * @param data        audio data plane pointers
-     * @param nb_samples  number of samples to read
-     * @return            number of samples actually read, or negative AVERROR code
-     *                    on failure. The number of samples actually read will not
-     *                    be greater than nb_samples, and will only be less than
-     *                    nb_samples if av_audio_fifo_size is less than nb_samples.
+     * @return the number of samples read, 0 if the fifo is empty or stopped, or negative AVERROR
      */
-    int read(void **data, int nb_samples);
-
-    int wait_and_read(void **data, int nb_samples);
-
-    int peek(void **data, int nb_samples) const;
-
-    //
+    int read(av::frame& frame, int nb_samples);
 
     void drain();
+    // @}
 
     void start();
 
     void stop();
 
+    // frames handed out without copying / copied because of the wrap point
+    [[nodiscard]] uint64_t views() const { return nb_views_.load(); }
+
+    [[nodiscard]] uint64_t copies() const { return nb_copies_.load(); }
+
 private:
-    mutable std::mutex      mtx_{};
-    std::condition_variable nonempty_{};
-    std::condition_variable nonfull_{};
+    static constexpr size_t MAX_VIEWS  = 16;
+    static constexpr size_t MAX_STAMPS = 64;
+
+    struct view_t
+    {
+        spsc_audio_fifo  *owner{};
+        uint64_t          begin{}; // the first sample referenced by the view
+        std::atomic<bool> released{};
+    };
+
+    static void release_view(void *opaque, uint8_t *);
+
+    // producer: the first sample still in use, either queued or referenced by a view
+    uint64_t reclaim();
+
+    int channels_{};
+    int planes_{};
+    int capacity_{};
+    int sample_size_{}; // bytes per sample per plane
+
+    AVSampleFormat sample_fmt_{ AV_SAMPLE_FMT_NONE };
+
+    size_t   plane_size_{}; // aligned capacity_ * sample_size_
+    uint8_t *buffer_{};     // planes_ * plane_size_
+
+    alignas(64) std::atomic<uint64_t> head_{}; // consumer
+    alignas(64) std::atomic<uint64_t> tail_{}; // producer
+
+    // pts of the sample index 0, assuming the samples are contiguous
+    std::atomic<int64_t> origin_{ AV_NOPTS_VALUE };
+
+    // views in [views_head_, views_tail_) may still be referenced
+    std::array<view_t, MAX_VIEWS> views_{};
+    std::atomic<uint64_t>         views_head_{}; // producer
+    std::atomic<uint64_t>         views_tail_{}; // consumer
+
+    std::atomic<bool> stopped_{};
+
+    std::atomic<uint32_t> nonfull_{};
+    std::atomic<bool>     push_waiting_{};
 
-    int capacity_{ std::numeric_limits<int>::max() };
+    std::atomic<uint64_t> nb_views_{};
+    std::atomic<uint64_t> nb_copies_{};
 
-    bool stopped_{};
+    // enqueue timestamps of the last MAX_STAMPS writes, with telemetry only
+    struct stamp_t
+    {
+        std::atomic<uint64_t> end{}; // tail after the write
+        std::atomic<int64_t>  ts{};
+    };
 
-    AVAudioFifo *buffer_{};
+    std::shared_ptr<queue_telemetry> telemetry_{};
+    std::array<stamp_t, MAX_STAMPS>  stamps_{};
+    std::atomic<uint64_t>            stamps_tail_{}; // producer
+    uint64_t                         stamps_head_{}; // consumer
 };
 
-#endif //! CAPTURER_AuDIO_FIFO_H
\ No newline at end of file
+#endif //! CAPTURER_AuDIO_FIFO_H
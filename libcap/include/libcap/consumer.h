@@ -36,6 +36,9 @@ public:
 
     virtual int consume(const T&, AVMediaType) = 0;
 
+    // frames consumed but not processed yet, how far the consumer is behind
+    [[nodiscard]] virtual size_t backlog(AVMediaType) const { return 0; }
+
     [[nodiscard]] virtual bool accepts(AVMediaType) const = 0;
     virtual void               enable(AVMediaType, bool)  = 0;
 
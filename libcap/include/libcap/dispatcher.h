@@ -3,34 +3,198 @@
 
 #include "consumer.h"
 #include "ffmpeg-wrapper.h"
+#include "filter.h"
 #include "hwaccel.h"
 #include "media.h"
 #include "producer.h"
 #include "queue.h"
 #include "timeline.h"
 
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <optional>
 #include <set>
+#include <string>
 #include <thread>
+#include <vector>
 
 extern "C" {
 #include <libavfilter/avfilter.h>
 }
 
+// the frames of one producer, pushed by its capturing thread only
+struct DispatchLane
+{
+    DispatchLane(Producer<av::frame> *producer, const size_t capacity,
+                 const size_t max_bytes = std::numeric_limits<size_t>::max())
+        : producer(producer),
+          queue(capacity, max_bytes)
+    {}
+
+    Producer<av::frame>     *producer{};
+    spsc_queue<av::frame>    queue;
+    std::optional<av::frame> head{}; // popped, waiting for the other lanes to be merged
+    bool                     eof{};  // the EOF of the producer has been dispatched
+
+    // video admission: the output slot of the first & the last admitted frame
+    std::chrono::nanoseconds origin{ av::clock::nopts };
+    int64_t                  slot{ -1 };
+
+    // the previous admitted frame, whose activity is measured against, see adaptive-rc.h
+    av::frame last{};
+};
+
+// decisions taken on the input frames before filtering them
+struct admission_counters
+{
+    uint64_t admitted{};
+    uint64_t dropped{};    // a frame was already admitted for its output slot
+    uint64_t shed{};       // the outputs are behind
+    uint64_t duplicated{}; // output slots without a frame, the consumers repeat the previous one
+};
+
+// how far an offline dispatch is, e.g. for transcoding a file
+struct progress_t
+{
+    std::chrono::nanoseconds position{};                   // of the latest dispatched frame
+    std::chrono::nanoseconds duration{ av::clock::nopts }; // of the longest input, nopts if unknown
+    std::chrono::nanoseconds elapsed{};                    // wall time since started
+    std::chrono::nanoseconds eta{ av::clock::nopts };
+
+    uint64_t frames{}; // video frames dispatched, audio frames if there is no video
+    double   fps{};    // frames per second of the wall time
+    double   speed{};  // media time per wall time, 1.0 is realtime
+
+    // 0 ~ 1, 0 if the duration is unknown
+    [[nodiscard]] double ratio() const
+    {
+        if (duration == av::clock::nopts || duration <= 0ns) return 0.0;
+        return std::clamp(static_cast<double>(position.count()) / static_cast<double>(duration.count()),
+                          0.0, 1.0);
+    }
+};
+
+// how an output branches off the filter graph shared by all outputs
+struct branch_options_t
+{
+    bool video{ true };
+    bool audio{ true };
+
+    // applied to this output only, after the shared filters, e.g. "scale=640:-2" for a preview
+    std::string video_filters{};
+    std::string audio_filters{};
+
+    // block : fed on the dispatching thread, its backpressure stalls all the outputs,
+    //         e.g. the recording which must not lose frames
+    // drop_*: fed by its own thread through a short queue, a slow consumer only loses its own frames,
+    //         e.g. a live preview
+    overflow_policy policy{ overflow_policy::block };
+};
+
+// the tail of the graph feeding one output
+struct DispatchBranch
+{
+    DispatchBranch(Consumer<av::frame> *consumer, std::string filters, const overflow_policy policy,
+                   const size_t capacity)
+        : consumer(consumer),
+          filters(std::move(filters)),
+          policy(policy),
+          queue(capacity, std::numeric_limits<size_t>::max(), policy)
+    {}
+
+    Consumer<av::frame> *consumer{};
+    std::string          filters{};
+    AVFilterContext     *sink{};
+
+    // video: the size the output was opened at, the frames resized by a command are scaled back to it
+    int width{};
+    int height{};
+
+    // time spent pulling the frames of an input frame from the sink, in ns, with the telemetry only;
+    // the first branch pulled also runs the shared filters, e.g. the pixel format conversion
+    log_histogram filter_time{};
+
+    // only with the non-blocking policies @{
+    overflow_policy       policy{ overflow_policy::block };
+    safe_queue<av::frame> queue;
+    std::jthread          thread{};
+    // @}
+};
+
+// a runtime update of the filter graph
+struct DispatchCommand
+{
+    av::graph::command_t command{};
+    int                  flags{}; // AVFILTER_CMD_FLAG_*
+
+    // queued until the frame at this time of the timeline, or sent before the next frame
+    std::optional<std::chrono::nanoseconds> at{};
+
+    // replaces the description of the shared graph instead, see Dispatcher::set_filters
+    std::optional<std::string> filters{};
+};
+
 struct DispatchContext
 {
     std::unordered_map<Producer<av::frame> *, AVFilterContext *> srcs{};
-    AVFilterContext                                             *sink{};
 
-    safe_queue<std::pair<av::frame, Producer<av::frame> *>> queue{ 4 };
+    // split after the shared graph, one per output accepting the media type
+    std::vector<std::unique_ptr<DispatchBranch>> branches{};
 
     AVFilterGraph    *graph{};
     AVHWDeviceType    hwaccel{ AV_HWDEVICE_TYPE_NONE };
     std::string       graph_desc{};
-    std::atomic<bool> dirty{};
+    std::atomic<bool> dirty{}; // rebuild the graph before the next frame
+
+    // video: the branches end with a scale to the size of their outputs, since the first command
+    // which may resize the frames; not from the start, so that the pixel format conversion is shared
+    bool pinned{};
+
+    // runtime updates, guarded by mtx and applied by the dispatching thread before the next frame
+    std::vector<DispatchCommand> commands{};
+    std::atomic<bool>            commanded{};
+
+    // the latest runtime command sent per target & option, e.g. the crop window or the amix weights,
+    // sent again to a rebuilt graph; reset by a new description of the shared filters
+    std::map<std::pair<std::string, std::string>, DispatchCommand> applied{};
 
     std::atomic<bool> enabled{};
     std::atomic<bool> running{};
 
+    // per-producer input lanes, merged in pts order @{
+    std::vector<std::unique_ptr<DispatchLane>> lanes{};
+
+    // how long the earliest frame waits for the lanes without any queued frame,
+    // i.e. how far a producer may run ahead of the others
+    std::chrono::nanoseconds max_run_ahead{ 40ms };
+
+    // the dispatching thread sleeps on it when no lane is ready, producers only notify it if so
+    std::mutex              mtx{};
+    std::condition_variable arrived{};
+    std::atomic<bool>       sleeping{};
+    // @}
+
+    // time spent in the filter graph per input frame, in ns, with the telemetry only
+    log_histogram filter_time{};
+
+    // progress @{
+    std::atomic<int64_t>  position{}; // ns, of the latest dispatched frame
+    std::atomic<uint64_t> frames{};
+    // @}
+
+    // video admission @{
+    AVRational framerate{}; // the highest of the outputs, 0: admit every frame
+    size_t     max_backlog{ 2 };
+
+    std::atomic<uint64_t> admitted{};
+    std::atomic<uint64_t> dropped{};
+    std::atomic<uint64_t> shed{};
+    std::atomic<uint64_t> duplicated{};
+    // @}
+
+    bool metering{}; // tag the video frames with their activity, for the adaptive rate control
+
     std::jthread thread;
 };
 
@@ -41,12 +205,24 @@ public:
 
     ~Dispatcher();
 
-    int add_input(Producer<av::frame> *decoder);
+    /**
+     * The inputs are either all realtime, e.g. capturers, whose frames are rebased on the timeline
+     * and shed while the outputs are behind, or all non-realtime, e.g. decoders. The non-realtime
+     * inputs are dispatched offline: as fast as the outputs consume the frames, and none is lost.
+     */
+    int add_input(Producer<av::frame> *producer);
 
-    void set_output(Consumer<av::frame> *encoder);
+    // the outputs share the capturing & the filter graph, and branch off at its end
+    int add_output(Consumer<av::frame> *consumer, const branch_options_t& options = {});
 
     void set_hwaccel(AVHWDeviceType);
 
+    // slice threads & pinning of the video filter graph, the audio graph is always single-threaded
+    void set_threading(const av::graph::threading_t&);
+
+    // measure the changes of the video frames for the adaptive rate control of the encoders
+    void set_activity_metering(bool);
+
     int initialize(const std::string_view& video_filters, const std::string_view& audio_filters);
 
     int start();
@@ -58,8 +234,41 @@ public:
 
     [[nodiscard]] bool running() const { return vctx_.running || actx_.running; }
 
+    [[nodiscard]] bool realtime() const { return realtime_; }
+
+    // the time of the timeline, or the position of the inputs when dispatching offline
     [[nodiscard]] std::chrono::nanoseconds escaped() const;
 
+    [[nodiscard]] progress_t progress() const;
+
+    [[nodiscard]] admission_counters admission() const;
+
+    // runtime updates of the filter graphs, without rebuilding them @{
+
+    /**
+     * Send a command to the filters of the graph, see avfilter_graph_send_command().
+     * With 'at', the command is queued until the frame at that time of the timeline, see escaped().
+     */
+    int send_command(AVMediaType type, const av::graph::command_t& command,
+                     std::optional<std::chrono::nanoseconds> at = std::nullopt);
+
+    // the weight of the producer in 'amix', 0 mutes it; amix normalizes the weights by their sum
+    int set_volume(const Producer<av::frame> *producer, double volume);
+
+    // move the 'crop' window, and resize it if w & h > 0; the outputs keep the size they were opened at,
+    // the cropped frames are stretched to it. Resizing is dropped with hwaccel.
+    int set_crop(int x, int y, int w = 0, int h = 0);
+
+    // the first 'scale', which is the pixel format conversion inserted by FFmpeg if the graph has none;
+    // the outputs keep their size, see set_crop
+    int set_scale(int w, int h);
+
+    int set_overlay(int x, int y);
+
+    // replace the shared filters, only rebuild the graph if the topology or a non-runtime option changes
+    int set_filters(AVMediaType type, const std::string_view& filters);
+    // @}
+
 private:
     int create_filter_graph(AVMediaType);
 
@@ -67,15 +276,42 @@ private:
 
     int dispatch_fn(AVMediaType mt);
 
+    int post(AVMediaType type, DispatchCommand command);
+
+    // pace the video frames at the output framerate, and shed them while the outputs are behind
+    static bool admit(DispatchContext& ctx, DispatchLane& lane, std::chrono::nanoseconds ts);
+
+    // on the dispatching thread, the commands after one which needs a rebuild wait for the new graph
+    static void apply_commands(DispatchContext& ctx, AVMediaType mt);
+
+    // the runtime state of the previous graph onto the rebuilt one
+    static void reapply_commands(DispatchContext& ctx, AVMediaType mt);
+
+    // hand a filtered frame over to the output of the branch
+    static void deliver(DispatchBranch& branch, const av::frame& frame, AVMediaType mt);
+
+    // the thread feeding a non-blocking output
+    static int output_fn(DispatchBranch& branch, AVMediaType mt);
+
+    // k-way merge: the lane holding the earliest frame, or nullptr with the deadline to wait until
+    DispatchLane *merge(DispatchContext& ctx, AVMediaType mt, std::chrono::nanoseconds& deadline) const;
+
+    static void wake(DispatchContext& ctx);
+
     // clock @{
     std::chrono::nanoseconds start_time_{ av::clock::nopts };
     av::timeline_t           timeline_{};
     //@}
 
-    std::set<Producer<av::frame> *> producers_{};
-    Consumer<av::frame>            *consumer_{};
+    std::set<Producer<av::frame> *>                                 producers_{};
+    std::vector<std::pair<Consumer<av::frame> *, branch_options_t>> consumers_{};
 
     std::atomic<bool> ready_{};
+    bool              realtime_{ true };
+
+    av::graph::threading_t threading_{};
+
+    std::vector<double> volumes_{}; // amix weights, by the input index
 
     DispatchContext vctx_{};
     DispatchContext actx_{};
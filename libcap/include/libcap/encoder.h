@@ -1,17 +1,48 @@
 #ifndef CAPTURER_ENCODER_H
 #define CAPTURER_ENCODER_H
 
+#include "adaptive-rc.h"
+#include "async-writer.h"
 #include "audio-fifo.h"
 #include "consumer.h"
 #include "ffmpeg-wrapper.h"
 #include "logging.h"
 #include "queue.h"
+#include "replay-buffer.h"
+
+#include <array>
+#include <chrono>
+#include <utility>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 }
 
+/**
+ * The video and the audio are encoded by their own threads, which hand the packets over to a muxing
+ * thread, so that a slow video frame neither stalls the audio encoding nor the writing, and the other
+ * way around. av_interleaved_write_frame() orders the packets of the streams by dts.
+ *
+ *  dispatcher -> vbuffer_ -> [ENCODER-V] -> vpackets_ -> [MUXER] -> file
+ *  dispatcher -> abuffer_ -> [ENCODER-A] -> apackets_ ---^
+ *
+ * Local files are written behind by an I/O thread (async_writer), so that a disk stall blocks the
+ * muxer only once the write buffer is full.
+ *
+ * Crash safety:
+ *  - segmented: the output rolls over to 'name-001.ext', 'name-002.ext', ... at the first keyframe
+ *    after 'segment_time' seconds or 'segment_size' MiB, each segment is finalized by its trailer
+ *  - fragmented: mp4 / mov is written as an empty 'moov' followed by fragments, which are flushed
+ *    to the file every 'fragment_time' seconds, so only the last fragment is lost on a crash
+ *
+ * Instant replay: with 'replay_size' (MiB) and optionally 'replay_time' (seconds), no file is written,
+ * the muxing thread keeps the latest packets in a replay_buffer instead, and save_replay() muxes them
+ * into a file in the background. The file name passed to open() only selects the container.
+ *
+ * Each encoding thread queues a null packet after its last one, the muxing thread reaches the EOF
+ * after the null packets of all streams.
+ */
 class Encoder final : public Consumer<av::frame>
 {
 public:
@@ -20,6 +51,7 @@ public:
         V_ENCODING_EOF = 0x01,
         A_ENCODING_EOF = 0x02,
         ENCODING_EOF   = V_ENCODING_EOF | A_ENCODING_EOF,
+        MUXING_EOF     = 0x04,
     };
 
 public:
@@ -33,30 +65,140 @@ public:
 
     int consume(const av::frame& frame, AVMediaType type) override;
 
+    size_t backlog(AVMediaType type) const override;
+
     bool accepts(AVMediaType type) const override;
 
     void enable(AVMediaType type, bool v) override;
 
-    bool eof() const override
+    // all packets have been written
+    bool eof() const override { return eof_ & MUXING_EOF; }
+
+    // mux the packets of the replay buffer into the file in the background, av::UNSUPPORTED if not
+    // recording into the replay buffer
+    int save_replay(const std::string& filename, replay_buffer::callback_t callback = {});
+
+    bool replaying() const { return replay_ != nullptr; }
+
+    // how busy the video encoder is, from any thread
+    struct load_t
     {
-        return (vstream_idx_ < 0 || eof_ & V_ENCODING_EOF) && (astream_idx_ < 0 || eof_ & A_ENCODING_EOF);
-    }
+        double   load{};       // encoding time per frame interval, smoothed
+        double   average{};    // of the whole recording
+        uint64_t frames{};     // measured
+        int      crf_offset{}; // raised while the encoder is behind, libx264 only
+        bool     overloaded{}; // the encoder has been behind during the recording
+    };
+
+    load_t video_load() const;
+
+    // a snapshot of the encoding, lock-free, e.g. polled by the UI while recording
+    struct stats_t
+    {
+        double fps{};         // video packets per second of the wall time, over the last second
+        double bitrate{};     // bits per second of the video, over the last second
+        double avg_bitrate{}; // bits per second of the video, over the encoded duration
+        double qp{ -1.0 };    // average of the video packets, < 0 if the encoder does not export it
+
+        uint64_t frames{};     // video frames sent to the encoder, with the encoded duplicates
+        uint64_t packets{};    // video
+        uint64_t bytes{};      // video
+        uint64_t duplicated{}; // frames repeated by the video sync, encoded or skipped
+        uint64_t dropped{};    // frames dropped by the video sync
+
+        // spent in the video encoder @{
+        std::chrono::nanoseconds send_time{};    // avcodec_send_frame()
+        std::chrono::nanoseconds receive_time{}; // avcodec_receive_packet()
+        // @}
+
+        size_t   vqueue{};          // frames waiting for the video encoder
+        size_t   vqueue_capacity{};
+        double   afifo{};           // fill of the audio fifo, 0 ~ 1
+        uint64_t adropped{};        // samples dropped, larger writes than the audio fifo
+    };
+
+    stats_t stats() const;
+
+    // statistics of the write-behind output, empty if not writing to a local file
+    async_writer::stats_t io_stats() const { return writer_ ? writer_->stats() : async_writer::stats_t{}; }
 
 private:
+    // a packet and the trace id of its frame, null at the EOF of the stream
+    using traced_packet = std::pair<av::packet, uint64_t>;
+
+    // a thread sleeps on it while idle @{
+    struct wakeup_t
+    {
+        std::atomic<uint32_t> seq{};
+        std::atomic<bool>     sleeping{};
+    };
+
+    // load the sequence before checking, so that a wake() in between makes the wait return at once
+    template<class Idle> void sleep(wakeup_t& wakeup, Idle idle)
+    {
+        if (const auto seq = wakeup.seq.load(); idle()) {
+            wakeup.sleeping = true;
+            if (running_ && idle()) wakeup.seq.wait(seq);
+            wakeup.sleeping = false;
+        }
+    }
+
+    static void wake(wakeup_t& wakeup);
+    // @}
+
     int new_video_stream(const std::string& codec_name);
     int new_auido_stream(const std::string& codec_name);
 
+    // nothing to encode / write until new input, EOF or stop
+    bool video_idle() const;
+    bool audio_idle() const;
+    bool muxer_idle() const;
+
+    void vencode_thread_fn();
+    void aencode_thread_fn();
+    void mux_thread_fn();
+
     std::pair<int, int> video_sync_process(av::frame& frame);
     int                 process_video_frames();
+    int                 encode_video_frame(av::frame& vframe);
+    bool                rate_control(av::frame& vframe); // true: encode it as a keyframe
+    void                regulate(size_t backlog);
+    void                account(const AVPacket *packet); // an encoded video packet, for stats()
     int                 process_audio_frames();
-    void                close_output_file();
+
+    // write the queued packets, true after the EOF of the stream
+    bool write_packets(spsc_queue<traced_packet>& packets);
+
+    // the output file, or the current segment @{
+    int open_output_file(const std::string& filename);
+
+    // behind: the write-behind buffer of a local file is written out and closed by closer_
+    void close_output_file(bool behind = false);
+
+    // the file name of the segment, the first one is the requested file name
+    std::string segment_name(int idx) const;
+
+    // finalize the current segment and continue in the next one, on the muxing thread
+    int  next_segment();
+    bool segment_due(int64_t ts) const;
+
+    // write the pending fragment of the fragmented mp4 and flush it to the file, if due
+    void flush_fragment(int64_t ts);
+    // @}
 
     int               vstream_idx_{ -1 };
     int               astream_idx_{ -1 };
     std::atomic<bool> video_enabled_{ false };
     std::atomic<bool> audio_enabled_{ false };
 
-    int crf_{ -1 };
+    int         crf_{ -1 };
+    std::string vthreads_{ "auto" };
+    std::string preset_{}; // libx264 & libx265 only
+    std::string tune_{};
+
+    // crf biased by the activity of the frames, on the video encoding thread after open()
+    bool                         adaptive_{};
+    std::unique_ptr<adaptive_rc> rc_{};
 
     // ffmpeg encoders @ {
     AVFormatContext *fmt_ctx_{};
@@ -64,23 +206,110 @@ private:
     AVCodecContext  *acodec_ctx_{};
     // @}
 
-    std::jthread thread_{};
+    std::jthread vthread_{};
+    std::jthread athread_{};
+    std::jthread mthread_{};
+
+    wakeup_t vwakeup_{};
+    wakeup_t awakeup_{};
+    wakeup_t mwakeup_{};
+
+    // signaled when the muxing thread reaches the EOF @{
+    std::mutex              eof_mtx_{};
+    std::condition_variable eof_cv_{};
+    // @}
 
     int64_t v_last_dts_{ AV_NOPTS_VALUE };
     int64_t a_last_dts_{ AV_NOPTS_VALUE };
-    int64_t audio_pts_{ 0 };
 
-    av::packet packet_{};
+    av::packet vpacket_{};
+    av::packet apacket_{};
     av::frame  last_frame_{};
 
     // the expected pts of next video frame computed by last pts and duration
     int64_t expected_pts_{ AV_NOPTS_VALUE };
 
+    // trace ids of the frames being encoded, by pts, deeper than the encoder delay
+    std::array<uint64_t, 256> vtraces_{};
+
+    // samples per frame of the audio encoder, cached since stop() frees the codec context
+    int aframe_size_{ 1 };
+
+    std::atomic<uint64_t> adropped_{}; // samples, see stats_t::adropped
+
     std::atomic<bool>                asrc_eof_{};
-    std::unique_ptr<safe_audio_fifo> abuffer_{};
-    safe_queue<av::frame>            vbuffer_{ 8 };
+    std::unique_ptr<spsc_audio_fifo> abuffer_{};
+    std::atomic<bool>                vsrc_eof_{};
+    spsc_queue<av::frame>            vbuffer_{ 8, 256 * 1024 * 1024 };      // dispatcher -> encoder
+    std::vector<av::frame>           vframes_ = std::vector<av::frame>(8); // popped from vbuffer_ at once
+
+    // encoders -> muxer, deep enough for the audio to go on while the video is behind
+    spsc_queue<traced_packet> vpackets_{ 64, 64 * 1024 * 1024 };
+    spsc_queue<traced_packet> apackets_{ 256 };
 
     av::vsync_t vsync_{ av::vsync_t::cfr };
+
+    // load of the video encoder, updated by its thread @{
+    std::atomic<double>   vload_{};
+    std::atomic<int64_t>  vbusy_{};   // ns, encoding time of the recording
+    std::atomic<uint64_t> vframes_measured_{};
+    std::atomic<int>      crf_offset_{};
+    std::atomic<bool>     overloaded_{};
+    int64_t               regulated_at_{}; // ns
+    // @}
+
+    // cfr: the duplicated frames are dropped, the previous frame is shown until the next one
+    bool     skip_duplicates_{};
+    uint64_t vduplicates_{};
+
+    // statistics of the video, updated by its encoding thread, see stats() @{
+    struct vstats_t
+    {
+        std::atomic<uint64_t> frames{};
+        std::atomic<uint64_t> packets{};
+        std::atomic<uint64_t> bytes{};
+        std::atomic<uint64_t> duplicated{};
+        std::atomic<uint64_t> dropped{};
+        std::atomic<int64_t>  send_time{};    // ns
+        std::atomic<int64_t>  receive_time{}; // ns
+        std::atomic<uint64_t> quality{};      // sum of the lambdas of the packets exporting it
+        std::atomic<uint64_t> qualified{};    // packets exporting the quality
+        std::atomic<int64_t>  duration{};     // ns, of the encoded packets
+
+        // over the last window
+        std::atomic<double>  fps{};
+        std::atomic<double>  bitrate{};
+        std::atomic<int64_t> published{}; // ns, when the window was closed
+    };
+
+    vstats_t vstats_{};
+    int64_t  window_begin_{ AV_NOPTS_VALUE }; // ns
+    uint64_t window_packets_{};
+    uint64_t window_bytes_{};
+    int64_t  first_pts_{ AV_NOPTS_VALUE };
+    // @}
+
+    // time bases of the streams in the first file, the encoding threads rescale the packets to them,
+    // and the muxing thread to the ones of the current segment
+    AVRational vtime_base_{ 1, 1000 };
+    AVRational atime_base_{ 1, 1000 };
+
+    // segmented & fragmented output, on the muxing thread after open() @{
+    std::string filename_{};
+    int64_t     segment_time_{};                  // ns, 0: not limited
+    int64_t     segment_size_{};                  // bytes, 0: not limited
+    int         segment_idx_{};
+    int64_t     segment_start_{ AV_NOPTS_VALUE }; // ns, the first keyframe of the segment
+    int64_t     fragment_time_{};                 // ns, 0: not fragmented
+    int64_t     flushed_at_{ AV_NOPTS_VALUE };    // ns, the last flushed fragment
+    // @}
+
+    async_writer::options_t       io_options_{};
+    std::unique_ptr<async_writer> writer_{};
+    std::jthread                  closer_{}; // closing the previous segment, see next_segment()
+
+    // instead of the output file, if any
+    std::unique_ptr<replay_buffer> replay_{};
 };
 
 #endif //! CAPTURER_ENCODER_H
@@ -1,6 +1,9 @@
 #ifndef CAPTURER_FFMPEG_WRAPPER_H
 #define CAPTURER_FFMPEG_WRAPPER_H
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <utility>
 
 extern "C" {
@@ -16,6 +19,52 @@ namespace av
     inline constexpr take_ownership_t take_ownership{};
 } // namespace av
 
+/**
+ * Recycling of the frames & packets, so that the pipeline does not hit the heap per frame once warmed
+ * up, see the counters.
+ *
+ * The AVFrame / AVPacket structs released by av::ptr are unreferenced and kept in a bounded free list
+ * shared by all threads, the frames are usually released by another thread than the one which got them.
+ * The data buffers of get_buffer() come from AVBufferPools by size: the video frames have a fixed size,
+ * the sizes of the audio frames are rounded up to a power of 2.
+ *
+ * FFmpeg still mallocs the small AVBufferRef of each reference, and the side data & metadata if any.
+ */
+namespace av::pool
+{
+    struct counters_t
+    {
+        uint64_t frames{};         // AVFrame allocated from the heap
+        uint64_t frames_reused{};  // from the free list
+        uint64_t packets{};        // AVPacket allocated from the heap
+        uint64_t packets_reused{}; // from the free list
+        uint64_t buffers{};        // data buffers allocated from the heap
+        uint64_t buffers_reused{}; // from the AVBufferPools
+    };
+
+    // a blank frame / packet, nullptr if out of memory @{
+    AVFrame  *frame();
+    AVPacket *packet();
+    // @}
+
+    // unreference it and keep it for reuse, or free it if the free list is full @{
+    void recycle(AVFrame *frame);
+    void recycle(AVPacket *packet);
+    // @}
+
+    // a data buffer of at least 'size' bytes, its content is undefined
+    AVBufferRef *buffer(size_t size);
+
+    /**
+     * av_frame_get_buffer() from the pools: the format, the size / nb_samples and the channels
+     * must be set. All planes share one buffer. Falls back to av_frame_get_buffer() for the hardware,
+     * the palette & the bitstream formats.
+     */
+    int get_buffer(AVFrame *frame, int align = 0);
+
+    counters_t counters();
+} // namespace av::pool
+
 namespace av
 {
     namespace ffmpeg
@@ -32,15 +81,20 @@ namespace av
 
         inline void move_ref(AVFrame *dst, AVFrame *src) { av_frame_move_ref(dst, src); }
 
-        inline void alloc(AVPacket **packet) { *packet = av_packet_alloc(); }
+        inline void alloc(AVPacket **packet) { *packet = pool::packet(); }
 
-        inline void alloc(AVFrame **frame) { *frame = av_frame_alloc(); }
+        inline void alloc(AVFrame **frame) { *frame = pool::frame(); }
 
-        inline void free(AVPacket **packet) { av_packet_free(packet); }
+        inline void free(AVPacket **packet) { pool::recycle(std::exchange(*packet, nullptr)); }
 
-        inline void free(AVFrame **frame) { av_frame_free(frame); }
+        inline void free(AVFrame **frame) { pool::recycle(std::exchange(*frame, nullptr)); }
     } // namespace ffmpeg
 
+    // owns an AVFrame / AVPacket taken from av::pool
+    //
+    // moved-from: the ptr is null, like ptr{ nullptr }. operator bool() is false, get() and operator->()
+    // return nullptr and must not be dereferenced. put() takes a new one from the pool, so the ptr can be
+    // reused as the output of avcodec_receive_packet(), av_read_frame(), av_buffersink_get_frame(), ...
     template<typename T>
     requires std::same_as<T, AVFrame> || std::same_as<T, AVPacket>
     struct ptr
@@ -64,13 +118,10 @@ namespace av
             }
         }
 
+        // steals the frame / packet, see the moved-from state above
         ptr(ptr&& other) noexcept
-        {
-            if (other.ptr_) {
-                ffmpeg::alloc(&ptr_);
-                ffmpeg::move_ref(ptr_, other.ptr_);
-            }
-        }
+            : ptr_(std::exchange(other.ptr_, nullptr))
+        {}
 
         ~ptr() { release(); }
 
@@ -93,14 +144,8 @@ namespace av
         ptr& operator=(ptr&& other) noexcept
         {
             if (this != &other) {
-                if (other.ptr_) {
-                    ptr_ ? ffmpeg::unref(ptr_) : ffmpeg::alloc(&ptr_);
-                    ffmpeg::move_ref(ptr_, other.ptr_);
-                }
-                // = nullptr
-                else {
-                    release();
-                }
+                release();
+                ptr_ = std::exchange(other.ptr_, nullptr);
             }
             return *this;
         }
@@ -138,6 +183,45 @@ namespace av
 
     using frame  = ptr<AVFrame>;
     using packet = ptr<AVPacket>;
+
+    // bytes held by the data buffers, 0 for a null (EOF) frame / packet @{
+    inline size_t buffer_size(const frame& frame) noexcept
+    {
+        if (!frame) return 0;
+
+        size_t size = 0;
+        for (const auto buf : frame->buf) {
+            if (buf) size += buf->size;
+        }
+        for (int i = 0; i < frame->nb_extended_buf; ++i) {
+            size += frame->extended_buf[i]->size;
+        }
+        return size;
+    }
+
+    inline size_t buffer_size(const packet& packet) noexcept
+    {
+        if (!packet) return 0;
+
+        return packet->buf ? packet->buf->size : static_cast<size_t>(std::max(packet->size, 0));
+    }
+    // @}
+
+    // null (EOF) frames / packets are treated as keyframes, so they are never dropped @{
+    inline bool is_keyframe(const frame& frame) noexcept
+    {
+#ifdef AV_FRAME_FLAG_KEY
+        return !frame || (frame->flags & AV_FRAME_FLAG_KEY);
+#else
+        return !frame || frame->key_frame;
+#endif
+    }
+
+    inline bool is_keyframe(const packet& packet) noexcept
+    {
+        return !packet || (packet->flags & AV_PKT_FLAG_KEY);
+    }
+    // @}
 } // namespace av
 
 namespace av
@@ -2,6 +2,12 @@
 #define CAPTURER_FILTER_H
 
 #include "media.h"
+
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
 extern "C" {
 #include <libavfilter/avfilter.h>
 }
@@ -14,6 +20,77 @@ namespace av::graph
     int create_video_sink(AVFilterGraph *graph, AVFilterContext **ctx, const av::vformat_t& args);
     int create_audio_sink(AVFilterGraph *graph, AVFilterContext **ctx, const av::aformat_t& args);
 
+    // runtime commands @{
+    struct command_t
+    {
+        std::string target{}; // instance name, e.g. "Parsed_crop_0", filter name or "all"
+        std::string cmd{};    // usually a runtime option, e.g. "x"
+        std::string arg{};
+    };
+
+    // a graph description split into its filters, e.g. "[0][1]amix=inputs=2,volume=0.5"
+    struct description_t
+    {
+        std::string topology{}; // without the arguments: "[0][1]amix,volume"
+
+        // name (with the @id if any) & arguments: { "amix", "inputs=2" }, { "volume", "0.5" }
+        std::vector<std::pair<std::string, std::string>> filters{};
+    };
+
+    description_t parse_description(const std::string& desc);
+
+    /**
+     * The commands turning a graph parsed from 'from' into one parsed from 'to', addressed to the
+     * instances named by avfilter_graph_parse2(). Empty if nothing changed, and std::nullopt if the
+     * graph must be rebuilt: the topology changed, or an option is removed or not a runtime one.
+     */
+    std::optional<std::vector<command_t>> diff(const std::string& from, const std::string& to);
+    // @}
+
+    // threading @{
+    struct threading_t
+    {
+        int              threads{};     // slice threads per graph, 0: auto
+        bool             slice{ true }; // false: run every filter on the calling thread
+        std::vector<int> cpus{};        // pin the filter threads to these cores, empty: no pinning
+    };
+
+    /**
+     * Slice threads for a video graph: about one per 960x540 pixels, bounded by half of the cores,
+     * leaving the rest to the capturer & encoder. Audio graphs are cheap and run single-threaded.
+     */
+    int auto_threads(const av::vformat_t& fmt);
+
+    /**
+     * Must be called right after avfilter_graph_alloc(), the thread pool of the graph is created
+     * along with its first filter. Without it, FFmpeg spawns (cores + 1) threads for every graph.
+     */
+    void set_threading(AVFilterGraph *graph, const threading_t& threading, int auto_threads);
+
+    // log the filters of a configured graph and how many threads each of them may run on
+    void dump_threading(const AVFilterGraph *graph, const char *tag);
+
+    /**
+     * Pin the calling thread to the cores, and restore its affinity on destruction.
+     * On Linux, the threads it creates meanwhile inherit the affinity, e.g. the slice threads of
+     * a filter graph allocated in the scope. A no-op if the cores are empty.
+     */
+    class affinity_guard
+    {
+    public:
+        explicit affinity_guard(const std::vector<int>& cpus);
+
+        affinity_guard(const affinity_guard&)            = delete;
+        affinity_guard& operator=(const affinity_guard&) = delete;
+
+        ~affinity_guard();
+
+    private:
+        bool             pinned_{};
+        std::vector<int> saved_{}; // the cores of the previous affinity
+    };
+    // @}
+
 } // namespace av::graph
 
 #endif //! CAPTURER_FILTER_H
\ No newline at end of file
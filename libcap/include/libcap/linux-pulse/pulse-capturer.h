@@ -22,6 +22,11 @@ public:
 
     void stop() override;
 
+    // cork the record stream, the server stops capturing
+    void pause() override;
+
+    void resume() override;
+
     bool has(AVMediaType type) const override;
 
     bool is_realtime() const override { return true; }
@@ -31,6 +36,8 @@ public:
 private:
     static void pulse_stream_read_callback(pa_stream *, size_t, void *);
 
+    static void pulse_stream_success_callback(pa_stream *, int, void *);
+
     av::frame frame_{};
     size_t    bytes_per_frame_{ 1 };
     size_t    frame_number_{ 0 };
@@ -20,6 +20,8 @@ public:
 
     void stop() override;
 
+    void resume() override;
+
 private:
     int xfixes_draw_cursor(av::frame& frame) const;
 
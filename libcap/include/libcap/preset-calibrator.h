@@ -0,0 +1,93 @@
+#ifndef CAPTURER_PRESET_CALIBRATOR_H
+#define CAPTURER_PRESET_CALIBRATOR_H
+
+#include "ffmpeg-wrapper.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/pixfmt.h>
+}
+
+/**
+ * Picks the x264 / x265 preset of a recording by measuring the machine instead of guessing.
+ *
+ * A short synthetic clip of screen content, lines of text scrolling over the whole frame, which is
+ * the worst case of a screen recording, is encoded at the target size & framerate, and the load of a
+ * preset is its encoding time per duration of the clip. Starting at 'veryfast', the presets are
+ * stepped to the slower ones while the load is within the budget, or to the faster ones until it is.
+ * The threads of the encoder are then halved if the load still fits, which leaves the cores to the
+ * capturing & the filters, and 'zerolatency' is tried if even 'ultrafast' is over the budget.
+ *
+ * A trial is abandoned as soon as it is over the budget, the whole calibration takes a few seconds.
+ */
+class preset_calibrator
+{
+public:
+    struct options_t
+    {
+        std::string   codec{ "libx264" };
+        int           width{};
+        int           height{};
+        AVRational    framerate{ 30, 1 };
+        AVPixelFormat pix_fmt{ AV_PIX_FMT_YUV420P };
+        int           crf{ 23 };
+        std::string   tune{};
+
+        double                   budget{ 0.7 }; // encoding time per realtime, the rest is headroom
+        std::chrono::nanoseconds duration{ std::chrono::seconds{ 1 } }; // of the synthetic clip
+    };
+
+    struct result_t
+    {
+        std::string              preset{};
+        std::string              tune{};
+        std::string              threads{ "auto" };
+        double                   load{};    // of the chosen combination
+        std::chrono::nanoseconds elapsed{}; // of the calibration
+    };
+
+    preset_calibrator() = default;
+
+    preset_calibrator(const preset_calibrator&)            = delete;
+    preset_calibrator& operator=(const preset_calibrator&) = delete;
+
+    ~preset_calibrator();
+
+    // blocks until calibrated, av::UNSUPPORTED if the codec is not libx264 / libx265
+    int run(const options_t& options);
+
+    [[nodiscard]] result_t result() const { return result_; }
+
+    // the presets shared by x264 & x265 which may keep realtime, from the fastest to the slowest
+    static const std::vector<std::string>& presets();
+
+    // the neighbours of the preset, the same one at the ends or if unknown @{
+    static std::string faster(const std::string& preset);
+    static std::string slower(const std::string& preset);
+    // @}
+
+private:
+    // a page of text twice the height of the frames, which scroll over it
+    int generate(const options_t& options);
+
+    av::frame clip_frame(int idx) const;
+
+    // encoding time per duration of the clip, > budget if abandoned, < 0 on failure
+    double measure(const options_t& options, const std::string& preset, const std::string& tune,
+                   const std::string& threads) const;
+
+    AVPixelFormat pix_fmt_{ AV_PIX_FMT_YUV420P };
+    int           width_{};
+    int           height_{};
+    AVBufferRef  *luma_{};   // width x 2 * height
+    AVBufferRef  *chroma_{}; // flat gray, shared by both chroma planes
+    int           chroma_linesize_{};
+
+    result_t result_{};
+};
+
+#endif //! CAPTURER_PRESET_CALIBRATOR_H
@@ -30,6 +30,16 @@ public:
 
     virtual void stop() { running_ = false; }
 
+    /**
+     * Realtime producers stop capturing while paused, instead of producing frames to be discarded,
+     * and keep stamping the frames with the capture time after resuming; the dispatcher's timeline
+     * removes the paused duration. Frames already in flight may still arrive after pause().
+     */
+    virtual void               pause() { paused_ = true; }
+    [[nodiscard]] virtual bool paused() const { return paused_; }
+
+    virtual void resume() { paused_ = false; }
+
     [[nodiscard]] virtual bool eof() { return eof_ != 0; }
 
     //
@@ -65,6 +75,7 @@ protected:
     std::atomic<bool>    ready_{};
     std::atomic<bool>    running_{};
     std::atomic<bool>    muted_{};
+    std::atomic<bool>    paused_{};
     std::atomic<uint8_t> eof_{};
 
     std::chrono::nanoseconds start_time_{ av::clock::nopts };
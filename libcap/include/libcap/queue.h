@@ -1,16 +1,83 @@
 #ifndef CAPTURER_QUEUE_H
 #define CAPTURER_QUEUE_H
 
+#include "telemetry.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <limits>
 #include <mutex>
 #include <optional>
-#include <queue>
+#include <span>
 #include <utility>
+#include <vector>
+
+// what a full safe_queue does with a new element
+enum class overflow_policy : uint8_t
+{
+    block,       // wait for space, non-blocking pushes fail
+    drop_oldest, // discard queued elements from the front until the new one fits
+    drop_newest, // discard the new element
+    drop_nonkey, // discard queued non-keyframes, then the new element if it is not a keyframe,
+                 // and block if neither makes room
+};
+
+struct queue_counters
+{
+    uint64_t pushed{};
+    uint64_t popped{};
+    uint64_t dropped{}; // discarded by the overflow policy
+    uint64_t blocked{}; // pushes that had to wait for space
+
+    size_t bytes{};
+    size_t peak_bytes{};
+};
+
+/**
+ * Size and droppability of the queued elements, used by byte-budgeted queues.
+ * buffer_size(value) and is_keyframe(value) are found by ADL, e.g. for av::frame and av::packet.
+ */
+template<class T> struct queue_traits
+{
+    static size_t bytes(const T& value)
+    {
+        if constexpr (requires { buffer_size(value); })
+            return buffer_size(value);
+        else
+            return sizeof(T);
+    }
+
+    static bool droppable(const T& value)
+    {
+        if constexpr (requires { is_keyframe(value); })
+            return !is_keyframe(value);
+        else
+            return true;
+    }
+};
+
+template<class T, class U> struct queue_traits<std::pair<T, U>>
+{
+    static size_t bytes(const std::pair<T, U>& value) { return queue_traits<T>::bytes(value.first); }
+
+    static bool droppable(const std::pair<T, U>& value) { return queue_traits<T>::droppable(value.first); }
+};
 
+/**
+ * Mutex-based queue bounded by an element count and, optionally, by the bytes of the queued elements.
+ *
+ * The byte budget is always exceeded by at least one element, so that an element larger than the whole
+ * budget can still pass. When the queue is full, wait_and_push / push follow the overflow policy.
+ */
 template<class T> class safe_queue
 {
+    using clock = std::chrono::steady_clock;
+
 public:
     using value_type      = T;
     using reference       = T&;
@@ -25,6 +92,13 @@ public:
         : capacity_(capacity)
     {}
 
+    safe_queue(const size_t capacity, const size_t max_bytes,
+               const overflow_policy policy = overflow_policy::block)
+        : capacity_(capacity),
+          max_bytes_(max_bytes),
+          policy_(policy)
+    {}
+
     // capacity
 
     [[nodiscard]] bool empty() const noexcept(noexcept(buffer_.empty()))
@@ -45,23 +119,55 @@ public:
         return capacity_;
     }
 
+    [[nodiscard]] size_t bytes() const noexcept
+    {
+        std::lock_guard lock(mtx_);
+        return bytes_;
+    }
+
+    [[nodiscard]] size_t max_bytes() const noexcept
+    {
+        std::lock_guard lock(mtx_);
+        return max_bytes_;
+    }
+
+    [[nodiscard]] overflow_policy policy() const noexcept
+    {
+        std::lock_guard lock(mtx_);
+        return policy_;
+    }
+
+    [[nodiscard]] queue_counters counters() const noexcept
+    {
+        std::lock_guard lock(mtx_);
+
+        auto counters  = counters_;
+        counters.bytes = bytes_;
+        return counters;
+    }
+
     [[nodiscard]] bool stopped() const noexcept
     {
         std::lock_guard lock(mtx_);
         return stopped_;
     }
 
+    // telemetry, must be enabled before the queue is shared between threads @{
+    void enable_telemetry(const std::string& name) { telemetry_ = telemetry::make_queue(name); }
+
+    [[nodiscard]] std::shared_ptr<const queue_telemetry> telemetry() const { return telemetry_; }
+    // @}
+
     // modifiers
 
     [[nodiscard]] std::optional<value_type> wait_and_pop()
     {
         std::unique_lock lock(mtx_);
-        nonempty_.wait(lock, [this] { return stopped_ || !buffer_.empty(); });
+        _wait_nonempty(lock);
 
         if (buffer_.empty()) return std::nullopt;
 
-        value_type front = std::move(buffer_.front());
-        buffer_.pop();
+        value_type front = _pop_front();
 
         nonfull_.notify_one();
 
@@ -74,121 +180,142 @@ public:
 
         if (buffer_.empty()) return std::nullopt;
 
-        value_type front = std::move(buffer_.front());
-        buffer_.pop();
+        value_type front = _pop_front();
 
         nonfull_.notify_one();
 
         return front;
     }
 
+    /**
+     * Push the value, the overflow policy decides what happens if the queue is full.
+     *
+     * @return false if the queue is stopped or the value is dropped
+     */
     bool wait_and_push(const value_type& value)
     {
         std::unique_lock lock(mtx_);
-        nonfull_.wait(lock, [this] { return stopped_ || buffer_.size() < capacity_; });
-
-        if (stopped_) return false;
-
-        buffer_.push(value);
-
-        nonempty_.notify_one();
-
-        return true;
+        return _push(value, policy_, &lock);
     }
 
+    /**
+     * Same as wait_and_push(value), but waits at most duration for space.
+     *
+     * @return false if the queue is stopped, the value is dropped or the wait timed out
+     */
     template<class Rep, class Period>
     bool wait_and_push(const value_type& value, const std::chrono::duration<Rep, Period>& duration)
     {
         std::unique_lock lock(mtx_);
-        if (!nonfull_.wait_for(lock, duration, [this] { return stopped_ || buffer_.size() < capacity_; })) {
-            return false;
-        }
-
-        if (stopped_) return false;
-
-        buffer_.push(value);
-
-        nonempty_.notify_one();
-
-        return true;
+        return _push(value, policy_, &lock, clock::now() + duration);
     }
 
+    /**
+     * Push the value without blocking. With the block policy, a full queue rejects the value
+     * unless discard is set, in which case the oldest elements are dropped.
+     */
     bool push(const value_type& value, const bool discard = false)
     {
         std::lock_guard lock(mtx_);
-
-        if (stopped_) return false;
-
-        if (buffer_.size() >= capacity_) {
-            if (!discard) {
-                return false;
-            }
-            buffer_.pop();
-        }
-
-        buffer_.push(value);
-
-        nonempty_.notify_one();
-
-        return true;
+        return _push(value, _nonblocking_policy(discard), nullptr);
     }
 
     bool wait_and_push(value_type&& value)
     {
         std::unique_lock lock(mtx_);
-        nonfull_.wait(lock, [this] { return stopped_ || buffer_.size() < capacity_; });
-
-        if (stopped_) return false;
-
-        buffer_.push(std::move(value));
-
-        nonempty_.notify_one();
-
-        return true;
+        return _push(std::move(value), policy_, &lock);
     }
 
     template<class Rep, class Period>
     bool wait_and_push(value_type&& value, const std::chrono::duration<Rep, Period>& duration)
     {
         std::unique_lock lock(mtx_);
-        if (!nonfull_.wait_for(lock, duration, [this] { return stopped_ || buffer_.size() < capacity_; })) {
-            return false;
-        }
+        return _push(std::move(value), policy_, &lock, clock::now() + duration);
+    }
 
-        if (stopped_) return false;
+    bool push(value_type&& value, const bool discard = false)
+    {
+        std::lock_guard lock(mtx_);
+        return _push(std::move(value), _nonblocking_policy(discard), nullptr);
+    }
 
-        buffer_.push(std::move(value));
+    // bulk modifiers, one lock acquisition for many elements @{
 
-        nonempty_.notify_one();
+    /**
+     * Pop at most max elements into the out span without blocking.
+     *
+     * @return the number of elements moved to the front of out
+     */
+    size_t pop_bulk(std::span<value_type> out, const size_t max = std::numeric_limits<size_t>::max())
+    {
+        std::lock_guard lock(mtx_);
 
-        return true;
+        return _pop_bulk(out, max);
     }
 
-    bool push(value_type&& value, const bool discard = false)
+    /**
+     * Wait until the queue is not empty or stopped, then pop at most max elements into out.
+     *
+     * @return the number of elements popped, 0 if the queue has been stopped
+     */
+    size_t wait_and_pop_bulk(std::span<value_type> out,
+                             const size_t           max = std::numeric_limits<size_t>::max())
+    {
+        std::unique_lock lock(mtx_);
+        _wait_nonempty(lock);
+
+        return _pop_bulk(out, max);
+    }
+
+    /**
+     * Push the elements of values without blocking until one does not fit, the elements are moved from.
+     * Elements dropped by the overflow policy count as pushed.
+     *
+     * @return the number of elements taken from the front of values
+     */
+    size_t push_bulk(std::span<value_type> values)
     {
         std::lock_guard lock(mtx_);
 
-        if (stopped_) return false;
+        size_t n = 0;
+        for (; n < values.size() && !stopped_; ++n) {
+            if (policy_ == overflow_policy::block && !_fits(queue_traits<T>::bytes(values[n]))) break;
 
-        if (buffer_.size() >= capacity_) {
-            if (!discard) {
-                return false;
-            }
-            buffer_.pop();
+            _push(std::move(values[n]), policy_, nullptr, std::nullopt, false);
         }
 
-        buffer_.push(std::move(value));
+        _notify_pushed(n);
 
-        nonempty_.notify_one();
+        return n;
+    }
 
-        return true;
+    /**
+     * Push all elements of values, waiting for space as needed. The elements are moved from.
+     * Elements dropped by the overflow policy count as pushed.
+     *
+     * @return the number of elements taken, less than values.size() only if the queue is stopped
+     */
+    size_t wait_and_push_bulk(std::span<value_type> values)
+    {
+        std::unique_lock lock(mtx_);
+
+        size_t n = 0;
+        for (; n < values.size(); ++n) {
+            if (!_push(std::move(values[n]), policy_, &lock, std::nullopt, false) && stopped_) break;
+        }
+
+        _notify_pushed(n);
+
+        return n;
     }
 
+    // @}
+
     void drain()
     {
         std::lock_guard lock(mtx_);
 
-        buffer_ = {};
+        _clear();
 
         nonfull_.notify_all();
         nonempty_.notify_all();
@@ -209,7 +336,7 @@ public:
         std::lock_guard lock(mtx_);
 
         stopped_ = true;
-        buffer_  = {};
+        _clear();
 
         nonempty_.notify_all();
         nonfull_.notify_all();
@@ -224,15 +351,480 @@ public:
     }
 
 private:
+    [[nodiscard]] bool _fits(const size_t bytes) const noexcept
+    {
+        return buffer_.size() < capacity_ && (buffer_.empty() || bytes_ + bytes <= max_bytes_);
+    }
+
+    [[nodiscard]] overflow_policy _nonblocking_policy(const bool discard) const noexcept
+    {
+        return (discard && policy_ == overflow_policy::block) ? overflow_policy::drop_oldest : policy_;
+    }
+
+    void _wait_nonempty(std::unique_lock<std::mutex>& lock)
+    {
+        if (stopped_ || !buffer_.empty()) return;
+
+        wait_timer timer(telemetry_ ? &telemetry_->pop_wait : nullptr);
+        nonempty_.wait(lock, [this] { return stopped_ || !buffer_.empty(); });
+    }
+
+    value_type _pop_front()
+    {
+        value_type front = std::move(buffer_.front());
+        buffer_.pop_front();
+
+        bytes_ -= std::min(bytes_, queue_traits<T>::bytes(front));
+        counters_.popped++;
+
+        if (telemetry_) {
+            telemetry_->popped(stamps_.front());
+            stamps_.pop_front();
+        }
+
+        return front;
+    }
+
+    auto _drop(typename std::deque<T>::iterator it)
+    {
+        bytes_ -= std::min(bytes_, queue_traits<T>::bytes(*it));
+        counters_.dropped++;
+
+        if (telemetry_) {
+            stamps_.erase(stamps_.begin() + (it - buffer_.begin()));
+            telemetry_->discard();
+        }
+
+        return buffer_.erase(it);
+    }
+
+    void _clear()
+    {
+        if (telemetry_) {
+            telemetry_->discard(buffer_.size());
+            stamps_.clear();
+        }
+
+        buffer_ = {};
+        bytes_  = 0;
+    }
+
+    // make room for an element as the policy says, lock is null for non-blocking pushes
+    bool _reserve(const size_t bytes, const bool droppable, const overflow_policy policy,
+                  std::unique_lock<std::mutex> *lock, const std::optional<clock::time_point>& deadline)
+    {
+        if (stopped_) return false;
+
+        if (_fits(bytes)) return true;
+
+        switch (policy) {
+        case overflow_policy::drop_oldest:
+            while (!buffer_.empty() && !_fits(bytes)) _drop(buffer_.begin());
+            return _fits(bytes);
+
+        case overflow_policy::drop_newest:
+            counters_.dropped++;
+            if (telemetry_) telemetry_->discard();
+            return false;
+
+        case overflow_policy::drop_nonkey:
+            for (auto it = buffer_.begin(); it != buffer_.end() && !_fits(bytes);) {
+                it = queue_traits<T>::droppable(*it) ? _drop(it) : std::next(it);
+            }
+
+            if (_fits(bytes)) return true;
+
+            if (droppable) {
+                counters_.dropped++;
+                if (telemetry_) telemetry_->discard();
+                return false;
+            }
+            [[fallthrough]];
+
+        case overflow_policy::block:
+        default: {
+            if (!lock) return false;
+
+            counters_.blocked++;
+
+            // the consumer may sleep on elements pushed by a bulk push before this one
+            nonempty_.notify_all();
+
+            wait_timer timer(telemetry_ ? &telemetry_->push_wait : nullptr);
+
+            const auto ready = [=, this] { return stopped_ || _fits(bytes); };
+            if (deadline) {
+                if (!nonfull_.wait_until(*lock, *deadline, ready)) return false;
+            }
+            else {
+                nonfull_.wait(*lock, ready);
+            }
+
+            return !stopped_;
+        }
+        }
+    }
+
+    template<class U>
+    bool _push(U&& value, const overflow_policy policy, std::unique_lock<std::mutex> *lock,
+               const std::optional<clock::time_point>& deadline = std::nullopt, const bool notify = true)
+    {
+        const size_t bytes = queue_traits<T>::bytes(value);
+
+        if (!_reserve(bytes, queue_traits<T>::droppable(value), policy, lock, deadline)) return false;
+
+        buffer_.push_back(std::forward<U>(value));
+
+        bytes_               += bytes;
+        counters_.peak_bytes  = std::max(counters_.peak_bytes, bytes_);
+        counters_.pushed++;
+
+        if (telemetry_) {
+            stamps_.push_back(queue_telemetry::now());
+            telemetry_->pushed(buffer_.size());
+        }
+
+        if (notify) nonempty_.notify_one();
+
+        return true;
+    }
+
+    void _notify_pushed(const size_t n)
+    {
+        if (n == 1) nonempty_.notify_one();
+        if (n > 1) nonempty_.notify_all();
+    }
+
+    size_t _pop_bulk(std::span<value_type> out, const size_t max)
+    {
+        const size_t n = std::min({ out.size(), max, buffer_.size() });
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = _pop_front();
+        }
+
+        if (n == 1) nonfull_.notify_one();
+        if (n > 1) nonfull_.notify_all();
+
+        return n;
+    }
+
     mutable std::mutex      mtx_;
     std::condition_variable nonempty_{};
     std::condition_variable nonfull_{};
 
     size_t capacity_{ std::numeric_limits<size_t>::max() };
+    size_t max_bytes_{ std::numeric_limits<size_t>::max() };
+    size_t bytes_{};
+
+    overflow_policy policy_{ overflow_policy::block };
+    queue_counters  counters_{};
 
     bool stopped_{};
 
-    std::queue<T> buffer_{};
+    std::deque<T> buffer_{};
+
+    std::shared_ptr<queue_telemetry> telemetry_{};
+    std::deque<int64_t>              stamps_{}; // enqueue timestamps of buffer_, with telemetry only
+};
+
+
+/**
+ * Bounded single-producer / single-consumer ring with the interface of safe_queue.
+ *
+ * Pushing and popping never take a lock, the threads only sleep on an atomic wait (futex on Linux)
+ * when the ring is full or empty, and a wake-up is only issued if the other side is really sleeping.
+ *
+ * ATTENTION:
+ *   - push / wait_and_push must always be called from the same (producer) thread, and
+ *     pop / wait_and_pop / drain from the same (consumer) thread.
+ *   - stop / start / notify_all may be called from any thread. The elements pending at stop() are
+ *     released by the consumer on its next pop, or by drain() / the destructor.
+ *   - an optional byte budget (see queue_traits) bounds the ring like in safe_queue, but the only
+ *     overflow policy is to block, dropping would need the producer to touch the consumer's end.
+ */
+template<class T> class spsc_queue
+{
+public:
+    using value_type      = T;
+    using reference       = T&;
+    using const_reference = const T&;
+
+    explicit spsc_queue(const size_t capacity,
+                        const size_t max_bytes = std::numeric_limits<size_t>::max())
+        : capacity_(std::max<size_t>(capacity, 1)),
+          mask_(std::bit_ceil(capacity_) - 1),
+          max_bytes_(max_bytes),
+          buffer_(mask_ + 1)
+    {}
+
+    spsc_queue(const spsc_queue&)            = delete;
+    spsc_queue& operator=(const spsc_queue&) = delete;
+
+    // capacity
+
+    [[nodiscard]] bool empty() const noexcept { return size() == 0; }
+
+    [[nodiscard]] size_t size() const noexcept
+    {
+        if (stopped()) return 0;
+
+        const auto head = std::max(head_.load(), discarded_.load());
+        const auto tail = tail_.load();
+        return tail > head ? tail - head : 0;
+    }
+
+    [[nodiscard]] size_t capacity() const noexcept { return capacity_; }
+
+    [[nodiscard]] size_t bytes() const noexcept { return bytes_.load(); }
+
+    [[nodiscard]] size_t max_bytes() const noexcept { return max_bytes_; }
+
+    [[nodiscard]] bool stopped() const noexcept { return stopped_.load(); }
+
+    // telemetry, must be enabled before the queue is shared between threads @{
+    void enable_telemetry(const std::string& name)
+    {
+        telemetry_ = telemetry::make_queue(name);
+        stamps_.assign(buffer_.size(), 0);
+    }
+
+    [[nodiscard]] std::shared_ptr<const queue_telemetry> telemetry() const { return telemetry_; }
+    // @}
+
+    // modifiers: consumer
+
+    [[nodiscard]] std::optional<value_type> wait_and_pop()
+    {
+        wait_until(nonempty_, pop_waiting_, [this] { return stopped() || !empty(); }, pop_wait());
+
+        return pop();
+    }
+
+    [[nodiscard]] std::optional<value_type> pop()
+    {
+        if (stopped()) {
+            drain();
+            return std::nullopt;
+        }
+
+        auto head = discard(head_.load(std::memory_order_relaxed), discarded_.load());
+        if (head == tail_.load()) return std::nullopt;
+
+        value_type front = std::move(buffer_[head & mask_]);
+        bytes_.fetch_sub(queue_traits<T>::bytes(front));
+        if (telemetry_) telemetry_->popped(stamps_[head & mask_]);
+        head_.store(head + 1);
+
+        wake(nonfull_, push_waiting_);
+
+        return front;
+    }
+
+    /**
+     * Pop at most max elements into the out span with a single index update.
+     *
+     * @return the number of elements moved to the front of out
+     */
+    size_t pop_bulk(std::span<value_type> out, const size_t max = std::numeric_limits<size_t>::max())
+    {
+        if (stopped()) {
+            drain();
+            return 0;
+        }
+
+        const auto head  = discard(head_.load(std::memory_order_relaxed), discarded_.load());
+        const auto n     = std::min({ out.size(), max, static_cast<size_t>(tail_.load() - head) });
+        size_t     bytes = 0;
+        for (size_t i = 0; i < n; ++i) {
+            out[i]  = std::move(buffer_[(head + i) & mask_]);
+            bytes  += queue_traits<T>::bytes(out[i]);
+            if (telemetry_) telemetry_->popped(stamps_[(head + i) & mask_]);
+        }
+        bytes_.fetch_sub(bytes);
+        head_.store(head + n);
+
+        if (n) wake(nonfull_, push_waiting_);
+
+        return n;
+    }
+
+    size_t wait_and_pop_bulk(std::span<value_type> out,
+                             const size_t           max = std::numeric_limits<size_t>::max())
+    {
+        wait_until(nonempty_, pop_waiting_, [this] { return stopped() || !empty(); }, pop_wait());
+
+        return pop_bulk(out, max);
+    }
+
+    void drain()
+    {
+        head_.store(discard(head_.load(std::memory_order_relaxed), tail_.load()));
+
+        wake(nonfull_, push_waiting_);
+    }
+
+    // modifiers: producer
+
+    bool wait_and_push(const value_type& value)
+    {
+        const auto bytes = queue_traits<T>::bytes(value);
+        wait_until(nonfull_, push_waiting_, [=, this] { return stopped() || fits(bytes); }, push_wait());
+
+        return push(value);
+    }
+
+    bool wait_and_push(value_type&& value)
+    {
+        const auto bytes = queue_traits<T>::bytes(value);
+        wait_until(nonfull_, push_waiting_, [=, this] { return stopped() || fits(bytes); }, push_wait());
+
+        return push(std::move(value));
+    }
+
+    bool push(const value_type& value) { return emplace(value); }
+
+    bool push(value_type&& value) { return emplace(std::move(value)); }
+
+    // the pushed elements are moved from, returns the number of elements pushed
+    size_t push_bulk(std::span<value_type> values)
+    {
+        if (stopped()) return 0;
+
+        const auto tail = tail_.load(std::memory_order_relaxed);
+
+        size_t n = 0;
+        for (; n < values.size(); ++n) {
+            const auto bytes = queue_traits<T>::bytes(values[n]);
+            if (!fits(bytes, n)) break;
+
+            // accounted before being published, the consumer never subtracts bytes not added yet
+            bytes_.fetch_add(bytes);
+            buffer_[(tail + n) & mask_] = std::move(values[n]);
+            if (telemetry_) stamps_[(tail + n) & mask_] = queue_telemetry::now();
+        }
+        tail_.store(tail + n);
+
+        if (telemetry_ && n) telemetry_->pushed(tail + n - head_.load());
+
+        if (n) wake(nonempty_, pop_waiting_);
+
+        return n;
+    }
+
+    // control
+
+    void start() { stopped_.store(false); }
+
+    void stop()
+    {
+        // the consumer skips everything pushed before, even if the queue is restarted in the meantime
+        discarded_.store(tail_.load());
+        stopped_.store(true);
+
+        notify_all();
+    }
+
+    void notify_all()
+    {
+        nonempty_.fetch_add(1);
+        nonempty_.notify_all();
+
+        nonfull_.fetch_add(1);
+        nonfull_.notify_all();
+    }
+
+private:
+    // whether an element of the given bytes fits after the pending unpublished ones, always true if empty
+    [[nodiscard]] bool fits(const size_t bytes, const size_t pending = 0) const noexcept
+    {
+        const auto size = tail_.load() + pending - head_.load();
+        return size == 0 || (size < capacity_ && bytes_.load() + bytes <= max_bytes_);
+    }
+
+    template<class U> bool emplace(U&& value)
+    {
+        if (stopped()) return false;
+
+        const auto bytes = queue_traits<T>::bytes(value);
+        if (!fits(bytes)) return false;
+
+        const auto tail = tail_.load(std::memory_order_relaxed);
+
+        bytes_.fetch_add(bytes);
+        buffer_[tail & mask_] = std::forward<U>(value);
+        if (telemetry_) stamps_[tail & mask_] = queue_telemetry::now();
+        tail_.store(tail + 1);
+
+        if (telemetry_) telemetry_->pushed(tail + 1 - head_.load());
+
+        wake(nonempty_, pop_waiting_);
+
+        return true;
+    }
+
+    // release the elements in [head, until), returns the new head
+    size_t discard(size_t head, const size_t until)
+    {
+        if (telemetry_ && until > head) telemetry_->discard(until - head);
+
+        for (; head < until; ++head) {
+            const value_type discarded{ std::move(buffer_[head & mask_]) };
+            bytes_.fetch_sub(queue_traits<T>::bytes(discarded));
+        }
+        return head;
+    }
+
+    // The sleeper announces itself before re-checking the condition, and the waker publishes the
+    // indices before checking the announcement (both seq_cst), so at least one of them sees the other.
+    template<class Pred>
+    static void wait_until(std::atomic<uint32_t>& event, std::atomic<bool>& waiting, Pred&& ready,
+                           log_histogram *histogram)
+    {
+        if (ready()) return;
+
+        wait_timer timer(histogram);
+        while (!ready()) {
+            const auto seq = event.load();
+
+            waiting.store(true);
+            if (!ready()) event.wait(seq);
+            waiting.store(false);
+        }
+    }
+
+    log_histogram *pop_wait() const { return telemetry_ ? &telemetry_->pop_wait : nullptr; }
+
+    log_histogram *push_wait() const { return telemetry_ ? &telemetry_->push_wait : nullptr; }
+
+    static void wake(std::atomic<uint32_t>& event, const std::atomic<bool>& waiting)
+    {
+        if (waiting.load()) {
+            event.fetch_add(1);
+            event.notify_one();
+        }
+    }
+
+    const size_t capacity_;
+    const size_t mask_;
+    const size_t max_bytes_;
+
+    std::vector<T> buffer_;
+
+    alignas(64) std::atomic<size_t> head_{};      // consumer
+    alignas(64) std::atomic<size_t> tail_{};      // producer
+    alignas(64) std::atomic<size_t> discarded_{}; // pushed before the last stop()
+
+    std::atomic<size_t> bytes_{};
+
+    std::atomic<bool> stopped_{};
+
+    std::atomic<uint32_t> nonempty_{};
+    std::atomic<uint32_t> nonfull_{};
+    std::atomic<bool>     pop_waiting_{};
+    std::atomic<bool>     push_waiting_{};
+
+    std::shared_ptr<queue_telemetry> telemetry_{};
+    std::vector<int64_t>             stamps_{}; // enqueue timestamps, parallel to buffer_
 };
 
 #endif //! CAPTURER_QUEUE_H
\ No newline at end of file
@@ -0,0 +1,105 @@
+#ifndef CAPTURER_REPLAY_BUFFER_H
+#define CAPTURER_REPLAY_BUFFER_H
+
+#include "ffmpeg-wrapper.h"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+/**
+ * Instant replay: the latest encoded packets of a recording, kept in memory instead of being written
+ * to a file, and muxed into a file on demand ("save the last N seconds").
+ *
+ * The ring is bounded in bytes and in duration, and always starts at a video keyframe (at any packet
+ * of an audio-only recording): the oldest packets are evicted a GOP at a time, so that a saved clip
+ * can be decoded from its first packet. The packets are references, saving takes a snapshot and
+ * muxes it on its own thread while the recording goes on.
+ */
+class replay_buffer
+{
+public:
+    // called on the saving thread with the file name and the result, 0 on success
+    using callback_t = std::function<void(const std::string&, int)>;
+
+    struct stats_t
+    {
+        size_t  packets{};
+        size_t  bytes{};
+        int64_t duration{}; // ns
+        int64_t evicted{};  // GOPs
+    };
+
+    /**
+     * @param max_bytes     budget of the packet data, the last GOP is always kept
+     * @param max_duration  ns, 0: bounded by max_bytes only
+     */
+    explicit replay_buffer(size_t max_bytes, int64_t max_duration = 0);
+
+    replay_buffer(const replay_buffer&)            = delete;
+    replay_buffer& operator=(const replay_buffer&) = delete;
+
+    // waits for the saving in progress, if any
+    ~replay_buffer();
+
+    // the streams, in the order of the stream indexes of the packets, before the first push()
+    int add_stream(const AVCodecParameters *par, AVRational time_base);
+
+    // a packet with its stream index and the time base of add_stream()
+    void push(const av::packet& packet);
+
+    // mux the buffered packets into the file on a background thread, av::ALREADY while saving
+    int save(const std::string& filename, callback_t callback = {});
+
+    [[nodiscard]] bool saving() const { return saving_; }
+
+    [[nodiscard]] stats_t stats() const;
+
+private:
+    struct entry_t
+    {
+        av::packet packet{};
+        int64_t    ts{}; // ns
+        bool       key{};
+    };
+
+    struct stream_t
+    {
+        AVCodecParameters *par{};
+        AVRational         time_base{};
+    };
+
+    // a clip can start at the packet
+    bool starts_gop(const AVPacket *pkt) const;
+
+    // drop the oldest GOPs until within the budget, with the lock held
+    void evict();
+
+    int mux(const std::string& filename, const std::vector<entry_t>& packets) const;
+
+    const size_t  max_bytes_{};
+    const int64_t max_duration_{};
+
+    std::vector<stream_t> streams_{};
+    int                   video_idx_{ -1 };
+
+    mutable std::mutex  mtx_{};
+    std::deque<entry_t> packets_{};
+    size_t              bytes_{};
+    int64_t             last_ts_{}; // ns, the latest packet
+    int64_t             evicted_{};
+
+    std::atomic<bool> saving_{};
+    std::jthread      saver_{};
+};
+
+#endif //! CAPTURER_REPLAY_BUFFER_H
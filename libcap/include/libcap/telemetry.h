@@ -0,0 +1,229 @@
+#ifndef CAPTURER_TELEMETRY_H
+#define CAPTURER_TELEMETRY_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Lock-free histogram with HDR-style logarithmic buckets: every power-of-two range [2^k, 2^(k+1))
+ * is split into SUB_BUCKETS linear sub-buckets, so the relative error of a recorded value is below
+ * 1 / SUB_BUCKETS over the whole uint64_t range, in 4 KiB.
+ *
+ * record() may be called from any number of threads, snapshot() from any thread at any time.
+ */
+class log_histogram
+{
+public:
+    static constexpr int    SUB_BITS    = 3;
+    static constexpr size_t SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr size_t BUCKETS     = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    struct snapshot_t
+    {
+        uint64_t count{};
+        uint64_t sum{};
+        uint64_t min{};
+        uint64_t max{};
+
+        std::array<uint64_t, BUCKETS> buckets{};
+
+        [[nodiscard]] double mean() const { return count ? static_cast<double>(sum) / count : 0.0; }
+
+        // the lower bound of the bucket holding the p-th (0 ~ 1) percentile
+        [[nodiscard]] uint64_t percentile(const double p) const
+        {
+            const auto rank = static_cast<uint64_t>(std::clamp(p, 0.0, 1.0) * count);
+
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; ++i) {
+                seen += buckets[i];
+                if (seen > rank || seen == count) return std::min(std::max(lower_bound(i), min), max);
+            }
+            return max;
+        }
+    };
+
+    static constexpr size_t bucket(const uint64_t value) noexcept
+    {
+        if (value < SUB_BUCKETS) return value;
+
+        const int k = std::bit_width(value) - 1; // >= SUB_BITS
+        return (k - SUB_BITS + 1) * SUB_BUCKETS + ((value >> (k - SUB_BITS)) & (SUB_BUCKETS - 1));
+    }
+
+    static constexpr uint64_t lower_bound(const size_t bucket) noexcept
+    {
+        if (bucket < SUB_BUCKETS) return bucket;
+
+        const auto k = bucket / SUB_BUCKETS + SUB_BITS - 1;
+        return (SUB_BUCKETS + bucket % SUB_BUCKETS) << (k - SUB_BITS);
+    }
+
+    void record(const uint64_t value) noexcept
+    {
+        buckets_[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+
+        auto min = min_.load(std::memory_order_relaxed);
+        while (value < min && !min_.compare_exchange_weak(min, value, std::memory_order_relaxed)) {}
+
+        auto max = max_.load(std::memory_order_relaxed);
+        while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+    }
+
+    // not an atomic cut across the buckets, the recording threads are never stopped
+    [[nodiscard]] snapshot_t snapshot() const noexcept
+    {
+        snapshot_t snapshot{};
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            snapshot.buckets[i]  = buckets_[i].load(std::memory_order_relaxed);
+            snapshot.count      += snapshot.buckets[i];
+        }
+        snapshot.sum = sum_.load(std::memory_order_relaxed);
+        snapshot.min = snapshot.count ? min_.load(std::memory_order_relaxed) : 0;
+        snapshot.max = max_.load(std::memory_order_relaxed);
+        return snapshot;
+    }
+
+    void reset() noexcept
+    {
+        for (auto& bucket : buckets_) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        sum_.store(0, std::memory_order_relaxed);
+        min_.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> buckets_{};
+    std::atomic<uint64_t>                      sum_{};
+    std::atomic<uint64_t>                      min_{ std::numeric_limits<uint64_t>::max() };
+    std::atomic<uint64_t>                      max_{};
+};
+
+/**
+ * What a queue records when its telemetry is enabled. Times are in nanoseconds, the occupancy is
+ * in elements (samples for the audio fifo) and sampled at every push.
+ */
+struct queue_telemetry
+{
+    struct snapshot_t
+    {
+        std::string name{};
+
+        log_histogram::snapshot_t sojourn{};   // push -> pop, from the enqueue timestamps
+        log_histogram::snapshot_t push_wait{}; // blocked in wait_and_push / wait_and_write
+        log_histogram::snapshot_t pop_wait{};  // blocked in wait_and_pop
+        log_histogram::snapshot_t occupancy{};
+
+        uint64_t high_water{};
+        uint64_t discarded{}; // dropped by the overflow policy, or flushed by stop / drain
+    };
+
+    explicit queue_telemetry(std::string name)
+        : name(std::move(name))
+    {}
+
+    static int64_t now() noexcept
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    void pushed(const uint64_t size) noexcept
+    {
+        occupancy.record(size);
+
+        auto hw = high_water.load(std::memory_order_relaxed);
+        while (size > hw && !high_water.compare_exchange_weak(hw, size, std::memory_order_relaxed)) {}
+    }
+
+    void popped(const int64_t stamp) noexcept
+    {
+        if (stamp) sojourn.record(std::max<int64_t>(now() - stamp, 0));
+    }
+
+    void discard(const uint64_t n = 1) noexcept { discarded.fetch_add(n, std::memory_order_relaxed); }
+
+    [[nodiscard]] snapshot_t snapshot() const
+    {
+        return {
+            .name       = name,
+            .sojourn    = sojourn.snapshot(),
+            .push_wait  = push_wait.snapshot(),
+            .pop_wait   = pop_wait.snapshot(),
+            .occupancy  = occupancy.snapshot(),
+            .high_water = high_water.load(std::memory_order_relaxed),
+            .discarded  = discarded.load(std::memory_order_relaxed),
+        };
+    }
+
+    const std::string name;
+
+    log_histogram sojourn{};
+    log_histogram push_wait{};
+    log_histogram pop_wait{};
+    log_histogram occupancy{};
+
+    std::atomic<uint64_t> high_water{};
+    std::atomic<uint64_t> discarded{};
+};
+
+// measures a blocking wait into a histogram, if any
+struct wait_timer
+{
+    explicit wait_timer(log_histogram *histogram)
+        : histogram_(histogram),
+          start_(histogram ? queue_telemetry::now() : 0)
+    {}
+
+    wait_timer(const wait_timer&)            = delete;
+    wait_timer& operator=(const wait_timer&) = delete;
+
+    ~wait_timer()
+    {
+        if (histogram_) histogram_->record(std::max<int64_t>(queue_telemetry::now() - start_, 0));
+    }
+
+private:
+    log_histogram *histogram_{};
+    int64_t        start_{};
+};
+
+namespace telemetry
+{
+    /**
+     * Turn the queue telemetry on or off, off by default. Only affects the queues whose telemetry
+     * is enabled afterwards, the ones without cost nothing but a null check per push / pop.
+     */
+    void enable(bool on);
+
+    [[nodiscard]] bool enabled();
+
+    /**
+     * Create the telemetry of a queue and register it for snapshots under the name,
+     * e.g. "encoder.video". The registry only keeps weak references.
+     *
+     * @return nullptr if the telemetry is disabled
+     */
+    std::shared_ptr<queue_telemetry> make_queue(const std::string& name);
+
+    // snapshots of all live queues
+    std::vector<queue_telemetry::snapshot_t> snapshot();
+
+    // log a summary line per live queue
+    void dump();
+} // namespace telemetry
+
+#endif //! CAPTURER_TELEMETRY_H
@@ -0,0 +1,76 @@
+#ifndef CAPTURER_TRACE_H
+#define CAPTURER_TRACE_H
+
+#include <cstdint>
+#include <string>
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/frame.h>
+}
+
+/**
+ * Per-frame tracing of the recording pipeline.
+ *
+ * A producer tags each frame with a trace id, which is carried in AVFrame::opaque through the
+ * dispatcher and the filters (av_frame_copy_props keeps it), and every stage stamps the id when the
+ * frame passes by. The stamps of the last N frames are kept in a bounded ring, which can be exported
+ * as Chrome / Perfetto trace JSON (chrome://tracing, ui.perfetto.dev) at any time.
+ *
+ * Disabled by default. Tagging & stamping are lock-free and best effort: a stamp for a frame whose
+ * slot has already been reused by a newer frame is ignored.
+ */
+namespace trace
+{
+    enum stage_t : uint8_t
+    {
+        CAPTURING = 0, // the producer starts grabbing the frame
+        CAPTURED,      // handed to the dispatcher
+        DISPATCHED,    // merged from the input lane, before the filters
+        FILTERED,      // pulled from the filter graph, handed to the outputs
+        ENCODING,      // sent to the encoder
+        ENCODED,       // its packet received from the encoder
+        MUXED,         // its packet written to the output
+        STAGES,
+    };
+
+    /**
+     * Allocate the ring and start tracing, must be called while no frame is being traced.
+     *
+     * @param frames  number of frames kept, 0 disables tracing
+     */
+    void enable(size_t frames);
+
+    void disable();
+
+    [[nodiscard]] bool enabled();
+
+    // a new trace id stamped CAPTURING at ts (steady clock, ns), 0 if disabled
+    uint64_t begin(AVMediaType type, int64_t ts);
+
+    // stamp the stage, the first stamp of a stage is kept, e.g. for the frames repeated by the encoder
+    void mark(uint64_t id, stage_t stage);
+
+    // the frame is discarded at the stage
+    void drop(uint64_t id, stage_t stage);
+
+    // the trace id is carried by the frame @{
+    inline uint64_t id(const AVFrame *frame)
+    {
+        return frame ? static_cast<uint64_t>(reinterpret_cast<uintptr_t>(frame->opaque)) : 0;
+    }
+
+    inline void tag(AVFrame *frame, const uint64_t id)
+    {
+        if (frame && id) frame->opaque = reinterpret_cast<void *>(static_cast<uintptr_t>(id));
+    }
+    // @}
+
+    // the traced frames as Chrome trace event JSON, a nested async slice per stage of a frame
+    std::string json();
+
+    // write json() to the file
+    int dump(const std::string& path);
+} // namespace trace
+
+#endif //! CAPTURER_TRACE_H
@@ -27,6 +27,11 @@ public:
 
     void stop() override;
 
+    // stop the audio clients, no more events are signaled while paused
+    void pause() override;
+
+    void resume() override;
+
     bool has(const AVMediaType type) const override { return type == AVMEDIA_TYPE_AUDIO; }
 
     bool is_realtime() const override { return true; }
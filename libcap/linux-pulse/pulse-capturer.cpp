@@ -93,6 +93,12 @@ void PulseCapturer::pulse_stream_read_callback(pa_stream *stream, size_t /* == b
         return;
     }
 
+    // recorded before corking
+    if (self->paused_) {
+        pa_stream_drop(stream);
+        return;
+    }
+
     const av::frame frame{};
 
     frame->nb_samples = static_cast<int>(bytes / self->bytes_per_frame_);
@@ -105,7 +111,7 @@ void PulseCapturer::pulse_stream_read_callback(pa_stream *stream, size_t /* == b
     frame->channels       = self->afmt.channels;
     frame->channel_layout = self->afmt.channel_layout;
 
-    av_frame_get_buffer(frame.get(), 0);
+    av::pool::get_buffer(frame.get());
     if (av_samples_copy(frame->data, (uint8_t *const *)&frames, 0, 0, frame->nb_samples,
                         self->afmt.channels, self->afmt.sample_fmt) < 0) {
         loge("[PULSE-AUDIO] failed to copy frames");
@@ -122,8 +128,32 @@ void PulseCapturer::pulse_stream_read_callback(pa_stream *stream, size_t /* == b
     pa_stream_drop(stream);
 }
 
+void PulseCapturer::pulse_stream_success_callback(pa_stream *, int, void *) { pulse::signal(0); }
+
 int PulseCapturer::start() { return 0; }
 
+void PulseCapturer::pause()
+{
+    if (!stream_ || paused_) return;
+
+    paused_ = true;
+    if (pulse::stream::cork(stream_, true, pulse_stream_success_callback, this) < 0) {
+        logw("[PULSE-AUDIO] failed to cork the stream");
+    }
+}
+
+void PulseCapturer::resume()
+{
+    if (!stream_ || !paused_) return;
+
+    // drop the samples recorded before corking, they would be stamped with the current time
+    pulse::stream::flush(stream_, pulse_stream_success_callback, this);
+    if (pulse::stream::cork(stream_, false, pulse_stream_success_callback, this) < 0) {
+        logw("[PULSE-AUDIO] failed to uncork the stream");
+    }
+    paused_ = false;
+}
+
 void PulseCapturer::stop()
 {
     running_ = false;
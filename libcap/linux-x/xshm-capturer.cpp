@@ -3,6 +3,7 @@
 #ifdef __linux__
 
 #include "libcap/linux-x/linux-x.h"
+#include "libcap/trace.h"
 #include "logging.h"
 
 #include <fmt/chrono.h>
@@ -192,10 +193,18 @@ int XshmCapturer::start()
 
         av::frame frame{};
         while (running_) {
+            // no request to the X server while paused
+            if (paused_) {
+                paused_.wait(true);
+                continue;
+            }
+
             std::this_thread::sleep_for(30ms);
 
             frame.unref();
 
+            const auto capturing = av::clock::ns().count();
+
             auto buf = av_buffer_pool_get(xshm_pool_);
             if (!buf) {
                 running_ = false;
@@ -228,6 +237,10 @@ int XshmCapturer::start()
 
             if (draw_cursor && bpp_ >= 24) xfixes_draw_cursor(frame);
 
+            const auto id = trace::begin(AVMEDIA_TYPE_VIDEO, capturing);
+            trace::tag(frame.get(), id);
+            trace::mark(id, trace::CAPTURED);
+
             logd("[V] size = {:>4d}x{:>4d}, ts = {:.3%T}", frame->width, frame->height,
                   std::chrono::nanoseconds{ frame->pts });
             onarrived(frame, AVMEDIA_TYPE_VIDEO);
@@ -237,9 +250,16 @@ int XshmCapturer::start()
     return 0;
 }
 
+void XshmCapturer::resume()
+{
+    paused_ = false;
+    paused_.notify_all();
+}
+
 void XshmCapturer::stop()
 {
     running_ = false;
+    resume();
     if (thread_.joinable()) thread_.join();
 
     if (ready_) {
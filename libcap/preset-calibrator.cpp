@@ -0,0 +1,253 @@
+#include "libcap/preset-calibrator.h"
+
+#include "libcap/clock.h"
+#include "libcap/media.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fmt/chrono.h>
+#include <probe/defer.h>
+#include <thread>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/common.h>
+#include <libavutil/pixdesc.h>
+}
+
+// pixels per frame, about a fast wheel scroll
+static constexpr int SCROLL_STEP = 8;
+
+static const std::vector<std::string> PRESETS{
+    "ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow",
+};
+
+const std::vector<std::string>& preset_calibrator::presets() { return PRESETS; }
+
+std::string preset_calibrator::faster(const std::string& preset)
+{
+    const auto it = std::ranges::find(PRESETS, preset);
+    return (it == PRESETS.end() || it == PRESETS.begin()) ? preset : *std::prev(it);
+}
+
+std::string preset_calibrator::slower(const std::string& preset)
+{
+    const auto it = std::ranges::find(PRESETS, preset);
+    return (it == PRESETS.end() || std::next(it) == PRESETS.end()) ? preset : *std::next(it);
+}
+
+// 8-bit planar YUV with 3 planes, which the synthetic frames are generated in
+static bool is_planar_yuv8(const AVPixelFormat pix_fmt)
+{
+    const auto desc = av_pix_fmt_desc_get(pix_fmt);
+    return desc && desc->nb_components == 3 && (desc->flags & AV_PIX_FMT_FLAG_PLANAR) &&
+           !(desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_HWACCEL)) && desc->comp[0].depth == 8 &&
+           desc->comp[1].plane == 1 && desc->comp[2].plane == 2;
+}
+
+int preset_calibrator::generate(const options_t& options)
+{
+    pix_fmt_ = is_planar_yuv8(options.pix_fmt) ? options.pix_fmt : AV_PIX_FMT_YUV420P;
+    width_   = options.width;
+    height_  = options.height;
+
+    av_buffer_unref(&luma_);
+    av_buffer_unref(&chroma_);
+
+    const auto desc = av_pix_fmt_desc_get(pix_fmt_);
+    const auto ch   = AV_CEIL_RSHIFT(height_, desc->log2_chroma_h);
+
+    chroma_linesize_ = AV_CEIL_RSHIFT(width_, desc->log2_chroma_w);
+
+    luma_   = av_buffer_alloc(static_cast<size_t>(width_) * height_ * 2);
+    chroma_ = av_buffer_alloc(static_cast<size_t>(chroma_linesize_) * ch);
+    if (!luma_ || !chroma_) return av::NOMEM;
+
+    std::memset(chroma_->data, 128, chroma_->size);
+
+    // dark glyphs of 7x12 on a light background, in lines of 20 pixels with ragged ends
+    std::memset(luma_->data, 235, luma_->size);
+
+    uint32_t seed = 0x2545f491;
+    const auto rand = [&seed] { return (seed = seed * 1664525 + 1013904223) >> 8; };
+
+    for (int line = 0; line + 20 <= height_ * 2; line += 20) {
+        const auto end = width_ - static_cast<int>(rand() % std::max(width_ / 2, 1));
+
+        for (int x = 16; x + 8 <= end; x += 8) {
+            if (rand() % 6 == 0) continue; // spaces between the words
+
+            for (int y = line + 4; y < line + 16; ++y) {
+                const auto row = luma_->data + static_cast<ptrdiff_t>(y) * width_;
+                for (int i = 0; i < 7; ++i) {
+                    if (rand() % 3 == 0) row[x + i] = 32;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+av::frame preset_calibrator::clip_frame(const int idx) const
+{
+    av::frame frame{};
+
+    frame->format = pix_fmt_;
+    frame->width  = width_;
+    frame->height = height_;
+    frame->pts    = idx;
+
+    // references into the page, nothing is copied
+    const auto offset = static_cast<ptrdiff_t>(idx * SCROLL_STEP % height_) * width_;
+
+    frame->buf[0]      = av_buffer_ref(luma_);
+    frame->data[0]     = luma_->data + offset;
+    frame->linesize[0] = width_;
+
+    for (int i = 1; i < 3; ++i) {
+        frame->buf[i]      = av_buffer_ref(chroma_);
+        frame->data[i]     = chroma_->data;
+        frame->linesize[i] = chroma_linesize_;
+    }
+
+    return frame;
+}
+
+double preset_calibrator::measure(const options_t& options, const std::string& preset,
+                                  const std::string& tune, const std::string& threads) const
+{
+    const auto codec = avcodec_find_encoder_by_name(options.codec.c_str());
+    if (!codec) return -1;
+
+    AVCodecContext *ctx = avcodec_alloc_context3(codec);
+    if (!ctx) return -1;
+    defer(avcodec_free_context(&ctx));
+
+    ctx->width     = width_;
+    ctx->height    = height_;
+    ctx->pix_fmt   = pix_fmt_;
+    ctx->framerate = options.framerate;
+    ctx->time_base = av_inv_q(options.framerate);
+
+    AVDictionary *dict = nullptr;
+    defer(av_dict_free(&dict));
+    av_dict_set(&dict, "preset", preset.c_str(), 0);
+    av_dict_set(&dict, "threads", threads.c_str(), 0);
+    av_dict_set(&dict, "crf", std::to_string(options.crf).c_str(), 0);
+    if (!tune.empty()) av_dict_set(&dict, "tune", tune.c_str(), 0);
+
+    if (avcodec_open2(ctx, codec, &dict) < 0) {
+        loge("[CALIBRATOR] failed to open {} with preset = {}, tune = {}", options.codec, preset, tune);
+        return -1;
+    }
+
+    const auto nb_frames = std::max<int>(
+        static_cast<int>(av_rescale_q(options.duration.count(), { 1, 1'000'000'000 }, ctx->time_base)), 1);
+    const auto duration = static_cast<double>(options.duration.count());
+
+    av::packet packet{};
+    const auto begin = av::clock::ns();
+    for (int i = 0; i <= nb_frames; ++i) {
+        // flush the lookahead & the frame threads at last
+        const auto frame = (i < nb_frames) ? clip_frame(i) : av::frame{ nullptr };
+
+        int ret = avcodec_send_frame(ctx, frame.get());
+        while (ret >= 0) {
+            ret = avcodec_receive_packet(ctx, packet.put());
+        }
+
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) return -1;
+
+        const auto load = static_cast<double>((av::clock::ns() - begin).count()) / duration;
+        if (load > options.budget) return load;
+    }
+
+    return static_cast<double>((av::clock::ns() - begin).count()) / duration;
+}
+
+int preset_calibrator::run(const options_t& options)
+{
+    if (options.codec != "libx264" && options.codec != "libx265") return av::UNSUPPORTED;
+    if (options.width <= 0 || options.height <= 0 || options.framerate.num <= 0 ||
+        options.framerate.den <= 0)
+        return av::INVALID;
+
+    if (generate(options) < 0) return av::NOMEM;
+
+    result_ = { .tune = options.tune };
+
+    const auto begin = av::clock::ns();
+
+    auto preset = std::string{ "veryfast" };
+    auto load   = measure(options, preset, options.tune, "auto");
+    if (load < 0) return -1;
+
+    logi("[CALIBRATOR] {}x{}@{}, {}: {:.2f}", width_, height_, options.framerate, preset, load);
+
+    // the slowest preset within the budget
+    if (load <= options.budget) {
+        for (auto next = slower(preset); next != preset; next = slower(preset)) {
+            const auto next_load = measure(options, next, options.tune, "auto");
+            logi("[CALIBRATOR] {}x{}@{}, {}: {:.2f}", width_, height_, options.framerate, next, next_load);
+
+            if (next_load < 0 || next_load > options.budget) break;
+
+            preset = next;
+            load   = next_load;
+        }
+    }
+    else {
+        for (auto next = faster(preset); next != preset; next = faster(preset)) {
+            preset = next;
+            load   = measure(options, preset, options.tune, "auto");
+            logi("[CALIBRATOR] {}x{}@{}, {}: {:.2f}", width_, height_, options.framerate, preset, load);
+
+            if (load >= 0 && load <= options.budget) break;
+        }
+    }
+
+    if (load < 0) return -1;
+
+    result_.preset = preset;
+
+    if (load <= options.budget) {
+        // fewer threads if they still keep realtime, the rest of the pipeline runs on the other cores
+        if (const auto cores = std::thread::hardware_concurrency(); cores >= 4) {
+            const auto threads = std::to_string(cores / 2);
+            const auto fewer   = measure(options, preset, options.tune, threads);
+            if (fewer >= 0 && fewer <= options.budget) {
+                result_.threads = threads;
+                load            = fewer;
+            }
+        }
+    }
+    else if (options.tune.empty()) {
+        // no lookahead & no B-frames
+        if (const auto fast = measure(options, preset, "zerolatency", "auto"); fast >= 0 && fast < load) {
+            result_.tune = "zerolatency";
+            load         = fast;
+        }
+    }
+
+    result_.load    = load;
+    result_.elapsed = av::clock::ns() - begin;
+
+    if (load > options.budget) {
+        logw("[CALIBRATOR] {}x{}@{} is over the budget even with {}, load = {:.2f}", width_, height_,
+             options.framerate, preset, load);
+    }
+
+    logi("[CALIBRATOR] {} {}x{}@{}: preset = {}, tune = '{}', threads = {}, load = {:.2f}, took {:%T}",
+         options.codec, width_, height_, options.framerate, result_.preset, result_.tune, result_.threads,
+         result_.load, std::chrono::duration_cast<std::chrono::milliseconds>(result_.elapsed));
+
+    return 0;
+}
+
+preset_calibrator::~preset_calibrator()
+{
+    av_buffer_unref(&luma_);
+    av_buffer_unref(&chroma_);
+}
@@ -0,0 +1,194 @@
+#include "libcap/replay-buffer.h"
+
+#include "libcap/clock.h"
+#include "libcap/media.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <probe/defer.h>
+#include <probe/thread.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+replay_buffer::replay_buffer(const size_t max_bytes, const int64_t max_duration)
+    : max_bytes_(max_bytes),
+      max_duration_(max_duration)
+{}
+
+int replay_buffer::add_stream(const AVCodecParameters *par, const AVRational time_base)
+{
+    stream_t stream{ .par = avcodec_parameters_alloc(), .time_base = time_base };
+    if (!stream.par) return av::NOMEM;
+
+    if (avcodec_parameters_copy(stream.par, par) < 0) {
+        avcodec_parameters_free(&stream.par);
+        return av::NOMEM;
+    }
+
+    if (par->codec_type == AVMEDIA_TYPE_VIDEO && video_idx_ < 0) {
+        video_idx_ = static_cast<int>(streams_.size());
+    }
+
+    streams_.emplace_back(stream);
+    return 0;
+}
+
+bool replay_buffer::starts_gop(const AVPacket *pkt) const
+{
+    return (pkt->flags & AV_PKT_FLAG_KEY) && (video_idx_ < 0 || pkt->stream_index == video_idx_);
+}
+
+void replay_buffer::push(const av::packet& packet)
+{
+    if (!packet || packet->stream_index < 0 || packet->stream_index >= static_cast<int>(streams_.size()))
+        return;
+
+    const auto tb = streams_[packet->stream_index].time_base;
+    const auto ts = av::clock::ns(packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts, tb).count();
+
+    std::lock_guard lock(mtx_);
+
+    // the ring starts at a keyframe
+    if (packets_.empty() && !starts_gop(packet.get())) return;
+
+    packets_.push_back({ packet, ts, starts_gop(packet.get()) });
+    bytes_   += packet->size;
+    last_ts_  = std::max(last_ts_, ts);
+
+    evict();
+}
+
+void replay_buffer::evict()
+{
+    const auto over = [this] {
+        return bytes_ > max_bytes_ || (max_duration_ > 0 && last_ts_ - packets_.front().ts > max_duration_);
+    };
+
+    while (!packets_.empty() && over()) {
+        // the next keyframe, the last GOP is kept even if over the budget
+        auto next = std::find_if(packets_.begin() + 1, packets_.end(), [](auto& e) { return e.key; });
+        if (next == packets_.end()) break;
+
+        for (auto it = packets_.begin(); it != next; ++it) {
+            bytes_ -= it->packet->size;
+        }
+        packets_.erase(packets_.begin(), next);
+        evicted_++;
+    }
+}
+
+int replay_buffer::save(const std::string& filename, callback_t callback)
+{
+    if (saving_.exchange(true)) {
+        logw("[    REPLAY] saving is in progress");
+        return av::ALREADY;
+    }
+
+    // references, the recording goes on while muxing
+    std::vector<entry_t> snapshot{};
+    {
+        std::lock_guard lock(mtx_);
+        snapshot.assign(packets_.begin(), packets_.end());
+    }
+
+    if (snapshot.empty()) {
+        saving_ = false;
+        logw("[    REPLAY] nothing to save");
+        return av::AGAIN;
+    }
+
+    saver_ = std::jthread([=, this, snapshot = std::move(snapshot)] {
+        probe::thread::set_name("REPLAY-SAVER");
+
+        const auto ret = mux(filename, snapshot);
+
+        saving_ = false;
+        if (callback) callback(filename, ret);
+    });
+
+    return 0;
+}
+
+int replay_buffer::mux(const std::string& filename, const std::vector<entry_t>& packets) const
+{
+    AVFormatContext *fmt_ctx = nullptr;
+    if (avformat_alloc_output_context2(&fmt_ctx, nullptr, nullptr, filename.c_str()) < 0) {
+        loge("[    REPLAY] unsupported output: {}", filename);
+        return av::INVALID;
+    }
+    defer(avformat_free_context(fmt_ctx));
+
+    for (const auto& [par, time_base] : streams_) {
+        const auto stream = avformat_new_stream(fmt_ctx, nullptr);
+        if (!stream || avcodec_parameters_copy(stream->codecpar, par) < 0) return av::NOMEM;
+
+        stream->time_base = time_base;
+    }
+
+    if (!(fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&fmt_ctx->pb, filename.c_str(), AVIO_FLAG_WRITE) < 0) {
+            loge("[    REPLAY] can not open the output file: {}", filename);
+            return -1;
+        }
+    }
+    defer(if (!(fmt_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&fmt_ctx->pb));
+
+    if (avformat_write_header(fmt_ctx, nullptr) < 0) {
+        loge("[    REPLAY] can not write the header to the output file: {}", filename);
+        return -1;
+    }
+
+    // the clip starts at its first keyframe
+    const auto origin = std::chrono::nanoseconds{ packets.front().ts };
+
+    av::packet packet{};
+    for (const auto& entry : packets) {
+        if (entry.ts < origin.count()) continue; // audio before the first keyframe
+
+        packet = entry.packet;
+
+        const auto tb     = streams_[packet->stream_index].time_base;
+        const auto offset = av::clock::to(origin, tb);
+        if (packet->pts != AV_NOPTS_VALUE) packet->pts -= offset;
+        if (packet->dts != AV_NOPTS_VALUE) packet->dts -= offset;
+
+        av_packet_rescale_ts(packet.get(), tb, fmt_ctx->streams[packet->stream_index]->time_base);
+
+        if (av_interleaved_write_frame(fmt_ctx, packet.get()) < 0) {
+            loge("[    REPLAY] failed to write the packet");
+        }
+    }
+
+    if (av_write_trailer(fmt_ctx) < 0) {
+        loge("[    REPLAY] failed to write the trailer: {}", filename);
+        return -1;
+    }
+
+    logi("[    REPLAY] '{}', {} packets, {:.3f}s", filename, packets.size(),
+         static_cast<double>(packets.back().ts - packets.front().ts) / 1e9);
+
+    return 0;
+}
+
+replay_buffer::stats_t replay_buffer::stats() const
+{
+    std::lock_guard lock(mtx_);
+
+    return {
+        .packets  = packets_.size(),
+        .bytes    = bytes_,
+        .duration = packets_.empty() ? 0 : last_ts_ - packets_.front().ts,
+        .evicted  = evicted_,
+    };
+}
+
+replay_buffer::~replay_buffer()
+{
+    if (saver_.joinable()) saver_.join();
+
+    for (auto& stream : streams_) {
+        avcodec_parameters_free(&stream.par);
+    }
+}
@@ -0,0 +1,57 @@
+#include "libcap/telemetry.h"
+
+#include "logging.h"
+
+#include <mutex>
+
+namespace telemetry
+{
+    static std::atomic<bool>                            enabled_{};
+    static std::mutex                                   mtx{};
+    static std::vector<std::weak_ptr<queue_telemetry>> queues{};
+
+    void enable(const bool on) { enabled_ = on; }
+
+    bool enabled() { return enabled_; }
+
+    std::shared_ptr<queue_telemetry> make_queue(const std::string& name)
+    {
+        if (!enabled_) return nullptr;
+
+        auto queue = std::make_shared<queue_telemetry>(name);
+
+        std::lock_guard lock(mtx);
+        std::erase_if(queues, [](const auto& weak) { return weak.expired(); });
+        queues.emplace_back(queue);
+
+        return queue;
+    }
+
+    std::vector<queue_telemetry::snapshot_t> snapshot()
+    {
+        std::vector<queue_telemetry::snapshot_t> snapshots{};
+
+        std::lock_guard lock(mtx);
+        for (const auto& weak : queues) {
+            if (const auto queue = weak.lock(); queue) {
+                snapshots.emplace_back(queue->snapshot());
+            }
+        }
+
+        return snapshots;
+    }
+
+    void dump()
+    {
+        constexpr auto ms = [](const uint64_t ns) { return static_cast<double>(ns) / 1'000'000; };
+
+        for (const auto& q : snapshot()) {
+            logi("[ TELEMETRY] {:<16} sojourn(ms) p50 = {:.2f}, p99 = {:.2f}, max = {:.2f} | "
+                 "push wait(ms) p99 = {:.2f}, max = {:.2f} | pop wait(ms) p99 = {:.2f} | "
+                 "size avg = {:.1f}, high water = {} | discarded = {}",
+                 q.name, ms(q.sojourn.percentile(0.5)), ms(q.sojourn.percentile(0.99)), ms(q.sojourn.max),
+                 ms(q.push_wait.percentile(0.99)), ms(q.push_wait.max), ms(q.pop_wait.percentile(0.99)),
+                 q.occupancy.mean(), q.high_water, q.discarded);
+        }
+    }
+} // namespace telemetry
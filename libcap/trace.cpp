@@ -0,0 +1,195 @@
+#include "libcap/trace.h"
+
+#include "libcap/telemetry.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <fmt/format.h>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+namespace trace
+{
+    struct record_t
+    {
+        std::atomic<uint64_t>                        id{}; // 0: being reused
+        std::atomic<int>                             type{ AVMEDIA_TYPE_UNKNOWN };
+        std::atomic<uint8_t>                         dropped{ STAGES };
+        std::array<std::atomic<int64_t>, STAGES + 1> ts{}; // the last one for the drop
+    };
+
+    static std::atomic<bool>           tracing{};
+    static std::atomic<uint64_t>       next{ 1 };
+    static std::unique_ptr<record_t[]> records{};
+    static size_t                      capacity{};
+
+    // the slot of a frame still being traced
+    static record_t *find(const uint64_t id)
+    {
+        if (!id || !tracing.load(std::memory_order_relaxed)) return nullptr;
+
+        auto& record = records[id % capacity];
+        return record.id.load(std::memory_order_acquire) == id ? &record : nullptr;
+    }
+
+    void enable(const size_t frames)
+    {
+        tracing = false;
+        if (!frames) return;
+
+        if (frames != capacity) {
+            records  = std::make_unique<record_t[]>(frames);
+            capacity = frames;
+        }
+
+        for (size_t i = 0; i < capacity; ++i) {
+            records[i].id.store(0, std::memory_order_relaxed);
+        }
+
+        tracing = true;
+        logi("[     TRACE] enabled, {} frames", capacity);
+    }
+
+    void disable() { tracing = false; }
+
+    bool enabled() { return tracing.load(std::memory_order_relaxed); }
+
+    uint64_t begin(const AVMediaType type, const int64_t ts)
+    {
+        if (!tracing.load(std::memory_order_relaxed)) return 0;
+
+        const auto id     = next.fetch_add(1, std::memory_order_relaxed);
+        auto&      record = records[id % capacity];
+
+        record.id.store(0, std::memory_order_relaxed);
+        for (auto& stamp : record.ts) {
+            stamp.store(0, std::memory_order_relaxed);
+        }
+        record.ts[CAPTURING].store(ts, std::memory_order_relaxed);
+        record.type.store(type, std::memory_order_relaxed);
+        record.dropped.store(STAGES, std::memory_order_relaxed);
+        record.id.store(id, std::memory_order_release);
+
+        return id;
+    }
+
+    void mark(const uint64_t id, const stage_t stage)
+    {
+        if (const auto record = find(id); record) {
+            int64_t unset = 0;
+            record->ts[stage].compare_exchange_strong(unset, queue_telemetry::now(),
+                                                      std::memory_order_relaxed);
+        }
+    }
+
+    void drop(const uint64_t id, const stage_t stage)
+    {
+        if (const auto record = find(id); record) {
+            record->ts[STAGES].store(queue_telemetry::now(), std::memory_order_relaxed);
+            record->dropped.store(stage, std::memory_order_relaxed);
+        }
+    }
+
+    std::string json()
+    {
+        // the span starting at each stage
+        constexpr std::array<const char *, STAGES> spans{
+            "capture", "input queue", "filter", "output queue", "encode", "mux", "",
+        };
+        constexpr std::array<const char *, STAGES> stages{
+            "CAPTURING", "CAPTURED", "DISPATCHED", "FILTERED", "ENCODING", "ENCODED", "MUXED",
+        };
+
+        struct frame_t
+        {
+            uint64_t                        id{};
+            AVMediaType                     type{ AVMEDIA_TYPE_UNKNOWN };
+            uint8_t                         dropped{ STAGES };
+            std::array<int64_t, STAGES + 1> ts{};
+        };
+
+        std::vector<frame_t> frames{};
+        for (size_t i = 0; records && i < capacity; ++i) {
+            const auto& record = records[i];
+
+            frame_t frame{ .id = record.id.load(std::memory_order_acquire) };
+            if (!frame.id) continue;
+
+            frame.type    = static_cast<AVMediaType>(record.type.load(std::memory_order_relaxed));
+            frame.dropped = record.dropped.load(std::memory_order_relaxed);
+            for (size_t s = 0; s < frame.ts.size(); ++s) {
+                frame.ts[s] = record.ts[s].load(std::memory_order_relaxed);
+            }
+
+            // reused while being copied
+            if (record.id.load(std::memory_order_acquire) != frame.id) continue;
+
+            frames.emplace_back(frame);
+        }
+        std::ranges::sort(frames, {}, &frame_t::id);
+
+        const int64_t base = frames.empty() ? 0 : frames.front().ts[CAPTURING];
+        const auto    us   = [=](const int64_t ts) { return static_cast<double>(ts - base) / 1000.0; };
+
+        std::string out{ "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" };
+        auto        it = std::back_inserter(out);
+
+        fmt::format_to(it, R"({{"name":"process_name","ph":"M","pid":1,"args":{{"name":"Capturer"}}}})");
+
+        for (const auto& frame : frames) {
+            const auto name = av_get_media_type_string(frame.type);
+            const auto cat  = name ? name : "";
+
+            const auto last = *std::ranges::max_element(frame.ts);
+
+            // the frame, and the stages nested in it
+            fmt::format_to(it, ",\n" R"({{"name":"#{}","cat":"{}","ph":"b","id":{},"pid":1,"ts":{:.3f}}})",
+                           frame.id, cat, frame.id, us(frame.ts[CAPTURING]));
+
+            for (size_t s = 0; s < STAGES - 1; ++s) {
+                if (!frame.ts[s]) continue;
+
+                size_t n = s + 1;
+                while (n < STAGES && !frame.ts[n]) ++n;
+                if (n == STAGES) break;
+
+                fmt::format_to(it,
+                               ",\n" R"({{"name":"{}","cat":"{}","ph":"b","id":{},"pid":1,"ts":{:.3f}}})"
+                               ",\n" R"({{"name":"{}","cat":"{}","ph":"e","id":{},"pid":1,"ts":{:.3f}}})",
+                               spans[s], cat, frame.id, us(frame.ts[s]), spans[s], cat, frame.id,
+                               us(frame.ts[n]));
+            }
+
+            if (frame.dropped < STAGES) {
+                fmt::format_to(
+                    it,
+                    ",\n" R"({{"name":"dropped","cat":"{}","ph":"n","id":{},"pid":1,"ts":{:.3f},)"
+                    R"("args":{{"stage":"{}"}}}})",
+                    cat, frame.id, us(frame.ts[STAGES]), stages[frame.dropped]);
+            }
+
+            fmt::format_to(it, ",\n" R"({{"name":"#{}","cat":"{}","ph":"e","id":{},"pid":1,"ts":{:.3f}}})",
+                           frame.id, cat, frame.id, us(last));
+        }
+
+        out += "\n]}\n";
+        return out;
+    }
+
+    int dump(const std::string& path)
+    {
+        std::ofstream file(path, std::ios::out | std::ios::trunc);
+        if (!file) {
+            loge("[     TRACE] failed to open '{}'", path);
+            return -1;
+        }
+
+        file << json();
+
+        logi("[     TRACE] '{}'", path);
+        return file ? 0 : -1;
+    }
+} // namespace trace
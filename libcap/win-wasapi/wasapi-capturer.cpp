@@ -200,7 +200,7 @@ int WasapiCapturer::ProcessReceivedData(BYTE *data_ptr, const UINT32 nb_samples,
     frame->channels    = afmt.channels;
     frame->channel_layout = afmt.channel_layout;
 
-    av_frame_get_buffer(frame.get(), 0);
+    av::pool::get_buffer(frame.get());
     if (av_samples_copy((uint8_t **)frame->data, (uint8_t *const *)&data_ptr, 0, 0, nb_samples,
                         afmt.channels, afmt.sample_fmt) < 0) {
         loge("failed to copy packet data");
@@ -218,6 +218,26 @@ int WasapiCapturer::ProcessReceivedData(BYTE *data_ptr, const UINT32 nb_samples,
     return 0;
 }
 
+void WasapiCapturer::pause()
+{
+    if (!running_ || paused_) return;
+
+    paused_ = true;
+    if (FAILED(capturer_audio_client_->Stop())) logw("[  WASAPI-C] failed to pause the audio client.");
+    if (render_audio_client_) render_audio_client_->Stop();
+}
+
+void WasapiCapturer::resume()
+{
+    if (!running_ || !paused_) return;
+
+    // drop the samples captured before stopping, they would be stamped with the current time
+    capturer_audio_client_->Reset();
+    if (render_audio_client_) render_audio_client_->Start();
+    if (FAILED(capturer_audio_client_->Start())) loge("[  WASAPI-C] failed to resume the audio client.");
+    paused_ = false;
+}
+
 void WasapiCapturer::stop()
 {
     ::SetEvent(STOP_EVENT.get());
@@ -2,6 +2,7 @@
 
 #include "libcap/win-wgc/wgc-capturer.h"
 
+#include "libcap/trace.h"
 #include "logging.h"
 #include "ResizingPixelShader.h"
 #include "ResizingVertexShader.h"
@@ -399,6 +400,10 @@ void WindowsGraphicsCapturer::OnFrameArrived(const winrt::Direct3D11CaptureFrame
     logd("[V] size = {:>4d}x{:>4d}, ts = {:.3%T}", frame->width, frame->height,
          std::chrono::nanoseconds{ frame->pts });
 
+    const auto id = trace::begin(AVMEDIA_TYPE_VIDEO, frame->pts);
+    trace::tag(frame.get(), id);
+    trace::mark(id, trace::CAPTURED);
+
     onarrived(frame, AVMEDIA_TYPE_VIDEO);
 }
 
@@ -34,6 +34,7 @@ Capturer::Capturer(int& argc, char **argv)
     gif_hotkey_        = new QHotkey(this);
     quicklook_hotkey_  = new QHotkey(this);
     transparent_input_ = new QHotkey(this);
+    replay_hotkey_     = new QHotkey(this);
 
     sniper_.reset(new ScreenShoter());
 
@@ -44,6 +45,7 @@ Capturer::Capturer(int& argc, char **argv)
     connect(gif_hotkey_, &QHotkey::activated, this, &Capturer::RecordGIF);
     connect(quicklook_hotkey_, &QHotkey::activated, this, &Capturer::QuickLook);
     connect(transparent_input_, &QHotkey::activated, this, &Capturer::TransparentPreviewInput);
+    connect(replay_hotkey_, &QHotkey::activated, this, &Capturer::SaveReplay);
     connect(sniper_.get(), &ScreenShoter::pinData, this, &Capturer::PreviewMimeData);
 }
 
@@ -67,6 +69,11 @@ void Capturer::RecordGIF()
     gifcptr_->record();
 }
 
+void Capturer::SaveReplay()
+{
+    if (recorder_) recorder_->saveReplay();
+}
+
 void Capturer::Init()
 {
     clipboard::init();
@@ -279,6 +286,7 @@ void Capturer::UpdateHotkeys()
     SET_HOTKEY(quicklook_hotkey_,   config::hotkeys::quick_look);
 #endif
     SET_HOTKEY(transparent_input_,  config::hotkeys::transparent_input);
+    SET_HOTKEY(replay_hotkey_,      config::hotkeys::save_replay);
     // clang-format on
     if (!error.isEmpty()) ShowMessage("Capturer", error, QSystemTrayIcon::Critical);
 }
@@ -49,6 +49,7 @@ public slots:
 
     void RecordVideo();
     void RecordGIF();
+    void SaveReplay();
 
 private:
     void SystemTrayInit();
@@ -74,6 +75,7 @@ private:
     QPointer<QHotkey> quicklook_hotkey_{};  // Explorer window, Windows only
     QPointer<QHotkey> transparent_input_{}; // for preview window
     QPointer<QHotkey> toggle_hotkey_{};     // toggle previews
+    QPointer<QHotkey> replay_hotkey_{};     // save the replay buffer of the video recording
 
     QScopedPointer<ScreenShoter> sniper_{};
     QPointer<ScreenRecorder>     recorder_{};
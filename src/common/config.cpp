@@ -20,6 +20,7 @@ namespace config
         JSON_GET(autorun, j, "autorun");
         JSON_GET(language, j, "language");
         JSON_GET(theme, j, "theme");
+        JSON_GET(telemetry, j, "telemetry");
 
         if (j.contains("hotkeys")) {
             JSON_GET(hotkeys::screenshot, j["hotkeys"], "screenshot");
@@ -29,6 +30,7 @@ namespace config
             JSON_GET(hotkeys::record_video, j["hotkeys"], "record-video");
             JSON_GET(hotkeys::record_gif, j["hotkeys"], "record-gif");
             JSON_GET(hotkeys::transparent_input, j["hotkeys"], "transparent-input");
+            JSON_GET(hotkeys::save_replay, j["hotkeys"], "save-replay");
         }
 
         if (j.contains("snip")) {
@@ -71,6 +73,8 @@ namespace config
                     }
                     JSON_GET(v::rate_control, j["recording"]["video"]["v"], "rate-control");
                     JSON_GET(v::crf, j["recording"]["video"]["v"], "crf");
+                    JSON_GET(v::preset, j["recording"]["video"]["v"], "preset");
+                    JSON_GET(v::tuning, j["recording"]["video"]["v"], "tune");
                 }
                 if (j["recording"]["video"].contains("a")) {
                     JSON_GET(a::codec, j["recording"]["video"]["a"], "codec");
@@ -98,6 +102,74 @@ namespace config
                 JSON_GET(colors, j["recording"]["gif"], "colors");
                 JSON_GET(dither, j["recording"]["gif"], "dither");
             }
+
+            if (j["recording"].contains("filters")) {
+                using namespace recording::filters;
+
+                JSON_GET(threads, j["recording"]["filters"], "threads");
+                JSON_GET(cpus, j["recording"]["filters"], "cpus");
+            }
+
+            if (j["recording"].contains("trace")) {
+                using namespace recording::trace;
+
+                JSON_GET(frames, j["recording"]["trace"], "frames");
+            }
+
+            if (j["recording"].contains("io")) {
+                using namespace recording::io;
+
+                JSON_GET(buffer, j["recording"]["io"], "buffer-size");
+                JSON_GET(direct, j["recording"]["io"], "direct");
+                JSON_GET(preallocate, j["recording"]["io"], "preallocate");
+            }
+
+            if (j["recording"].contains("output")) {
+                using namespace recording::output;
+
+                JSON_GET(segment_time, j["recording"]["output"], "segment-time");
+                JSON_GET(segment_size, j["recording"]["output"], "segment-size");
+                JSON_GET(fragment_time, j["recording"]["output"], "fragment-time");
+            }
+
+            if (j["recording"].contains("replay")) {
+                using namespace recording::replay;
+
+                JSON_GET(size, j["recording"]["replay"], "size");
+                JSON_GET(duration, j["recording"]["replay"], "duration");
+            }
+
+            if (j["recording"].contains("calibration")) {
+                using namespace recording::calibration;
+
+                for (const auto& [key, value] : j["recording"]["calibration"].items()) {
+                    entry_t entry{};
+                    JSON_GET(entry.preset, value, "preset");
+                    JSON_GET(entry.tune, value, "tune");
+                    JSON_GET(entry.threads, value, "threads");
+
+                    if (!entry.preset.empty()) presets[key] = entry;
+                }
+            }
+
+            if (j["recording"].contains("renditions")) {
+                using namespace recording::renditions;
+
+                list.clear();
+                for (const auto& value : j["recording"]["renditions"]) {
+                    rendition_t rendition{};
+                    JSON_GET(rendition.suffix, value, "suffix");
+                    JSON_GET(rendition.format, value, "format");
+                    JSON_GET(rendition.codec, value, "codec");
+                    JSON_GET(rendition.height, value, "height");
+                    JSON_GET(rendition.crf, value, "crf");
+                    JSON_GET(rendition.preset, value, "preset");
+                    JSON_GET(rendition.audio, value, "audio");
+
+                    // the suffix tells the files apart
+                    if (!rendition.suffix.empty()) list.push_back(rendition);
+                }
+            }
         }
     }
 
@@ -105,9 +177,10 @@ namespace config
     {
         json j;
 
-        j["autorun"]  = autorun;
-        j["language"] = language;
-        j["theme"]    = theme;
+        j["autorun"]   = autorun;
+        j["language"]  = language;
+        j["theme"]     = theme;
+        j["telemetry"] = telemetry;
 
         j["hotkeys"]["screenshot"]        = hotkeys::screenshot;
         j["hotkeys"]["preview"]           = hotkeys::preview;
@@ -116,6 +189,7 @@ namespace config
         j["hotkeys"]["record-video"]      = hotkeys::record_video;
         j["hotkeys"]["record-gif"]        = hotkeys::record_gif;
         j["hotkeys"]["transparent-input"] = hotkeys::transparent_input;
+        j["hotkeys"]["save-replay"]       = hotkeys::save_replay;
 
         j["snip"]["style"]["border-width"] = snip::style.border_width;
         j["snip"]["style"]["border-color"] = snip::style.border_color;
@@ -144,6 +218,8 @@ namespace config
         j["recording"]["video"]["v"]["framerate"]["den"] = recording::video::v::framerate.den;
         j["recording"]["video"]["v"]["rate-control"]     = recording::video::v::rate_control;
         j["recording"]["video"]["v"]["crf"]              = recording::video::v::crf;
+        j["recording"]["video"]["v"]["preset"]           = recording::video::v::preset;
+        j["recording"]["video"]["v"]["tune"]             = recording::video::v::tuning;
 
         j["recording"]["video"]["a"]["codec"]       = recording::video::a::codec;
         j["recording"]["video"]["a"]["channels"]    = recording::video::a::channels;
@@ -163,6 +239,41 @@ namespace config
         j["recording"]["gif"]["colors"]    = recording::gif::colors;
         j["recording"]["gif"]["dither"]    = recording::gif::dither;
 
+        j["recording"]["filters"]["threads"] = recording::filters::threads;
+        j["recording"]["filters"]["cpus"]    = recording::filters::cpus;
+
+        j["recording"]["trace"]["frames"] = recording::trace::frames;
+
+        j["recording"]["io"]["buffer-size"] = recording::io::buffer;
+        j["recording"]["io"]["direct"]      = recording::io::direct;
+        j["recording"]["io"]["preallocate"] = recording::io::preallocate;
+
+        j["recording"]["output"]["segment-time"]  = recording::output::segment_time;
+        j["recording"]["output"]["segment-size"]  = recording::output::segment_size;
+        j["recording"]["output"]["fragment-time"] = recording::output::fragment_time;
+
+        j["recording"]["replay"]["size"]     = recording::replay::size;
+        j["recording"]["replay"]["duration"] = recording::replay::duration;
+
+        for (const auto& [key, entry] : recording::calibration::presets) {
+            j["recording"]["calibration"][key]["preset"]  = entry.preset;
+            j["recording"]["calibration"][key]["tune"]    = entry.tune;
+            j["recording"]["calibration"][key]["threads"] = entry.threads;
+        }
+
+        j["recording"]["renditions"] = json::array();
+        for (const auto& rendition : recording::renditions::list) {
+            j["recording"]["renditions"].push_back({
+                { "suffix", rendition.suffix },
+                { "format", rendition.format },
+                { "codec", rendition.codec },
+                { "height", rendition.height },
+                { "crf", rendition.crf },
+                { "preset", rendition.preset },
+                { "audio", rendition.audio },
+            });
+        }
+
         return j;
     }
 } // namespace config
@@ -5,6 +5,9 @@
 #include "selector.h"
 
 #include <functional>
+#include <map>
+#include <string>
+#include <vector>
 
 namespace config
 {
@@ -12,6 +15,7 @@ namespace config
     inline QString     language{ "zh_CN" };
     inline std::string theme{ "auto" }; // auto, dark, light
     inline QString     filepath{};
+    inline bool        telemetry{}; // queue telemetry, logged when a recording / playback stops
 
     namespace hotkeys
     {
@@ -22,6 +26,7 @@ namespace config
         inline QKeySequence record_video{ "Ctrl+Alt+V" };
         inline QKeySequence record_gif{ "Ctrl+Alt+G" };
         inline QKeySequence transparent_input{ "Ctrl+T" };
+        inline QKeySequence save_replay{ "Ctrl+Alt+R" };
     }; // namespace hotkeys
 
     namespace snip
@@ -55,8 +60,8 @@ namespace config
                 // Vp9  : 0-63, 15-35
                 // Values of ±6 will result in about half or twice the original bitrate.
                 inline int         crf{ 23 }; // CRF or  CQ
-                inline std::string rate_control{ "crf" };
-                inline std::string preset{ "medium" };
+                inline std::string rate_control{ "crf" }; // crf, adaptive: crf biased by the screen changes
+                inline std::string preset{ "medium" }; // auto: calibrated, see recording::calibration
                 inline std::string profile{ "high" };
                 inline int         bitrate{}; // kbs
                 inline std::string maxrate{};
@@ -85,7 +90,75 @@ namespace config
             inline int        colors{ 128 };
             inline bool       dither{ false };
         }; // namespace gif
-    };     // namespace recording
+
+        // video filter graph of the dispatcher
+        namespace filters
+        {
+            inline int              threads{}; // slice threads, 0: auto
+            inline std::vector<int> cpus{};    // pin the filter threads, empty: no pinning
+        } // namespace filters
+
+        namespace trace
+        {
+            inline size_t frames{}; // frames kept for the per-frame trace, 0: disabled
+        } // namespace trace
+
+        // write-behind output of the local files
+        namespace io
+        {
+            inline size_t  buffer{ 64 };  // MiB
+            inline bool    direct{};      // O_DIRECT, Linux only
+            inline int64_t preallocate{}; // MiB, Linux only
+        } // namespace io
+
+        // crash-safe output of the video recordings
+        namespace output
+        {
+            inline int segment_time{};  // seconds per file, 0: not segmented by duration
+            inline int segment_size{};  // MiB per file, 0: not segmented by size
+            inline int fragment_time{}; // seconds between the flushes of fragmented mp4, 0: not fragmented
+        } // namespace output
+
+        // instant replay of the video recordings: the latest packets are kept in memory instead of
+        // being written, and saved with the 'save-replay' hotkey
+        namespace replay
+        {
+            inline int size{};         // MiB, 0: disabled
+            inline int duration{ 30 }; // seconds, 0: bounded by the size only
+        } // namespace replay
+
+        // the x264 / x265 settings of the 'auto' preset, measured at the first recording of each
+        // codec, size & framerate, and stepped after the recordings which were too slow or too idle
+        namespace calibration
+        {
+            struct entry_t
+            {
+                std::string preset{};
+                std::string tune{};
+                std::string threads{ "auto" };
+            };
+
+            inline std::map<std::string, entry_t> presets{}; // by "codec WxH@fps"
+        } // namespace calibration
+
+        // the additional files encoded from the same video recording, e.g. a small one to share along
+        // with the archive; they share the capturing & the filters, and are encoded by their own threads
+        namespace renditions
+        {
+            struct rendition_t
+            {
+                std::string suffix{};             // of the file name, 'Capturer_xxx-{suffix}.mp4'
+                std::string format{ "mp4" };      // container
+                std::string codec{ "libx264" };
+                int         height{};             // scaled to, keeping the aspect ratio, 0: unscaled
+                int         crf{ 28 };
+                std::string preset{ "veryfast" }; // libx264 & libx265 only
+                bool        audio{ true };
+            };
+
+            inline std::vector<rendition_t> list{};
+        } // namespace renditions
+    };    // namespace recording
 
     namespace devices
     {
@@ -1,12 +1,15 @@
 #include "capturer.h"
 #include "config.h"
+#include "libcap/telemetry.h"
 #include "logging.h"
 #include "probe/cpu.h"
 #include "probe/system.h"
 #include "probe/util.h"
+#include "transcode.h"
 #include "version.h"
 
 #include <QTranslator>
+#include <string_view>
 
 int main(int argc, char *argv[])
 {
@@ -25,6 +28,8 @@ int main(int argc, char *argv[])
 
     config::load();
 
+    telemetry::enable(config::telemetry);
+
     logi("Capturer               {}", CAPTURER_VERSION);
     logi(" -- Qt               : {}", qVersion());
     logi(" -- Operating System : {} ({})", probe::system::name(),
@@ -44,6 +49,9 @@ int main(int argc, char *argv[])
     logi(" -- Config File      : {}", config::filepath.toStdString());
     logi("");
 
+    // headless, see transcode.h
+    if (argc > 1 && std::string_view{ argv[1] } == "--transcode") return transcode(argc, argv);
+
     Capturer app(argc, argv);
     QApplication::setQuitOnLastWindowClosed(false);
 
@@ -39,7 +39,7 @@ private:
     // video
     std::jthread                         thread_{};
     std::unique_ptr<Producer<av::frame>> source_{};
-    safe_queue<av::frame>                vbuffer_{ 4 };
+    spsc_queue<av::frame>                vbuffer_{ 4 };
 };
 
 #endif // !CAPTURER_VIDEO_PLAYER_H
\ No newline at end of file
@@ -0,0 +1,405 @@
+#include "chunked-transcoder.h"
+
+#include "decoder.h"
+#include "libcap/clock.h"
+#include "libcap/encoder.h"
+#include "logging.h"
+
+#include <condition_variable>
+#include <filesystem>
+#include <fmt/format.h>
+#include <mutex>
+#include <probe/defer.h>
+#include <probe/thread.h>
+#include <thread>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+using namespace std::chrono_literals;
+
+static std::chrono::nanoseconds elapsed_since(const std::chrono::nanoseconds& begin)
+{
+    return av::clock::ns() - begin;
+}
+
+// the decoded format if the encoder supports it, otherwise the closest one it does
+static AVPixelFormat encoder_pix_fmt(const std::string& vcodec, const AVPixelFormat pix_fmt)
+{
+    const auto codec = avcodec_find_encoder_by_name(vcodec.c_str());
+    if (!codec || !codec->pix_fmts) return pix_fmt;
+
+    for (auto fmt = codec->pix_fmts; *fmt != AV_PIX_FMT_NONE; ++fmt) {
+        if (*fmt == pix_fmt) return pix_fmt;
+    }
+
+    return avcodec_find_best_pix_fmt_of_list(codec->pix_fmts, pix_fmt, 0, nullptr);
+}
+
+// the file names are UTF-8
+static void remove_file(const std::string& filename)
+{
+    std::error_code ec{};
+    std::filesystem::remove(std::filesystem::path(std::u8string(filename.begin(), filename.end())), ec);
+}
+
+int ChunkedTranscoder::scan(const std::string& input, const options_t& options, const int jobs)
+{
+    AVFormatContext *fmt_ctx = nullptr;
+    if (avformat_open_input(&fmt_ctx, input.c_str(), nullptr, nullptr) < 0) {
+        loge("[TRANSCODER] failed to open file: {}", input);
+        return -1;
+    }
+    defer(avformat_close_input(&fmt_ctx));
+
+    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) return -1;
+
+    const int idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (idx < 0) {
+        loge("[TRANSCODER] no video stream: {}", input);
+        return av::NOT_FOUND;
+    }
+    time_base_ = fmt_ctx->streams[idx]->time_base;
+
+    // only the packets of the video stream are read, none is decoded
+    for (unsigned int i = 0; i < fmt_ctx->nb_streams; ++i) {
+        if (static_cast<int>(i) != idx) fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    std::vector<int64_t> keyframes{};
+    int64_t              last = AV_NOPTS_VALUE;
+
+    av::packet packet{};
+    while (!aborted_ && av_read_frame(fmt_ctx, packet.put()) >= 0) {
+        if (packet->stream_index != idx || packet->pts == AV_NOPTS_VALUE) continue;
+
+        if ((packet->flags & AV_PKT_FLAG_KEY) && (keyframes.empty() || packet->pts > keyframes.back())) {
+            keyframes.push_back(packet->pts);
+        }
+        last = std::max(last, packet->pts);
+    }
+
+    if (aborted_) return av::STOPPED;
+    if (keyframes.empty()) return av::NOT_FOUND;
+
+    // about the same duration per chunk, but not shorter than the minimum
+    const auto nb_chunks = options.chunks > 0 ? options.chunks : jobs * 2;
+    const auto min_chunk = av::clock::to(options.min_chunk, time_base_);
+    const auto length    = std::max<int64_t>((last - keyframes.front()) / std::max(nb_chunks, 1),
+                                             std::max<int64_t>(min_chunk, 1));
+
+    chunks_.clear();
+    for (const auto keyframe : keyframes) {
+        if (chunks_.empty() || keyframe - chunks_.back().begin >= length) {
+            if (!chunks_.empty()) chunks_.back().end = keyframe;
+
+            chunks_.push_back({ .begin = keyframe });
+        }
+    }
+
+    logi("[TRANSCODER] {} keyframes, {} chunks of ~{:.3f}s", keyframes.size(), chunks_.size(),
+         av::clock::ns(length, time_base_).count() / 1e9);
+
+    return 0;
+}
+
+int ChunkedTranscoder::encode(const std::string& input, chunk_t& chunk, const options_t& options,
+                              const int threads) const
+{
+    const auto begin = av::clock::ns();
+
+    // the video only, the trimming after seeking would otherwise align the first frames to the audio,
+    // and drop the leading video frames of the chunk
+    Decoder decoder{};
+    decoder.enable(AVMEDIA_TYPE_AUDIO, false);
+    if (decoder.open(input) < 0 || !decoder.has(AVMEDIA_TYPE_VIDEO)) return -1;
+
+    // converted by the decoder only if the encoder does not take the frames as decoded, e.g. bgra
+    decoder.vfo         = decoder.vfi;
+    decoder.vfo.pix_fmt = encoder_pix_fmt(options.vcodec, decoder.vfi.pix_fmt);
+
+    Encoder encoder{};
+    encoder.vfmt            = decoder.vfo;
+    encoder.input_framerate = decoder.vfi.framerate;
+    encoder.enable(AVMEDIA_TYPE_VIDEO, true);
+
+    if (encoder.open(chunk.filename, {
+                                         { "vcodec", options.vcodec },
+                                         { "crf", std::to_string(options.crf) },
+                                         { "vsync", options.vsync },
+                                         { "threads", threads > 0 ? std::to_string(threads) : "auto" },
+                                     }) < 0) {
+        loge("[TRANSCODER] failed to open the encoder: {}", chunk.filename);
+        return -1;
+    }
+
+    if (encoder.start() < 0) return -1;
+
+    // the frames of [begin, end), in presentation order
+    std::mutex              mtx{};
+    std::condition_variable cv{};
+    bool                    done = false;
+
+    decoder.onarrived = [&](const av::frame& frame, const AVMediaType type) {
+        if (type != AVMEDIA_TYPE_VIDEO) return;
+
+        {
+            std::lock_guard lock(mtx);
+            if (done) return;
+
+            done = !frame || aborted_ || (chunk.end != AV_NOPTS_VALUE && frame->pts >= chunk.end);
+        }
+
+        if (done) {
+            cv.notify_all();
+            return;
+        }
+
+        // blocks while the encoder is behind
+        if (frame->pts >= chunk.begin) encoder.consume(frame, AVMEDIA_TYPE_VIDEO);
+    };
+
+    decoder.seek(av::clock::ns(chunk.begin, time_base_), 0s);
+
+    {
+        std::unique_lock lock(mtx);
+        cv.wait(lock, [&] { return done || aborted_; });
+    }
+    decoder.stop();
+
+    // drain the encoder
+    encoder.consume(nullptr, AVMEDIA_TYPE_VIDEO);
+    while (!encoder.eof() && !aborted_) {
+        std::this_thread::sleep_for(10ms);
+    }
+    encoder.stop();
+
+    chunk.elapsed = elapsed_since(begin);
+
+    return aborted_ ? av::STOPPED : 0;
+}
+
+int ChunkedTranscoder::concat(const std::string& input, const std::string& output) const
+{
+    // video: the chunks one after another
+    AVFormatContext *chunk_ctx = nullptr;
+    size_t           chunk_idx = 0;
+    defer(avformat_close_input(&chunk_ctx));
+
+    const auto open_chunk = [&](const size_t i) {
+        avformat_close_input(&chunk_ctx);
+        if (avformat_open_input(&chunk_ctx, chunks_[i].filename.c_str(), nullptr, nullptr) < 0 ||
+            avformat_find_stream_info(chunk_ctx, nullptr) < 0 || chunk_ctx->nb_streams != 1) {
+            loge("[TRANSCODER] failed to open the chunk: {}", chunks_[i].filename);
+            return -1;
+        }
+        return 0;
+    };
+
+    if (open_chunk(0) < 0) return -1;
+
+    // audio: copied from the input
+    AVFormatContext *input_ctx = nullptr;
+    if (avformat_open_input(&input_ctx, input.c_str(), nullptr, nullptr) < 0 ||
+        avformat_find_stream_info(input_ctx, nullptr) < 0) {
+        loge("[TRANSCODER] failed to open file: {}", input);
+        return -1;
+    }
+    defer(avformat_close_input(&input_ctx));
+
+    const int aidx = av_find_best_stream(input_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    for (unsigned int i = 0; i < input_ctx->nb_streams; ++i) {
+        if (static_cast<int>(i) != aidx) input_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    // output
+    AVFormatContext *fmt_ctx = nullptr;
+    if (avformat_alloc_output_context2(&fmt_ctx, nullptr, nullptr, output.c_str()) < 0) {
+        return av::INVALID;
+    }
+    defer(avformat_free_context(fmt_ctx));
+
+    const auto vstream = avformat_new_stream(fmt_ctx, nullptr);
+    if (!vstream || avcodec_parameters_copy(vstream->codecpar, chunk_ctx->streams[0]->codecpar) < 0)
+        return av::NOMEM;
+    vstream->codecpar->codec_tag = 0;
+    vstream->time_base           = chunk_ctx->streams[0]->time_base;
+
+    AVStream *astream = nullptr;
+    if (aidx >= 0) {
+        astream = avformat_new_stream(fmt_ctx, nullptr);
+        if (!astream || avcodec_parameters_copy(astream->codecpar, input_ctx->streams[aidx]->codecpar) < 0)
+            return av::NOMEM;
+        astream->codecpar->codec_tag = 0;
+        astream->time_base           = input_ctx->streams[aidx]->time_base;
+    }
+
+    if (!(fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&fmt_ctx->pb, output.c_str(), AVIO_FLAG_WRITE) < 0) {
+            loge("[TRANSCODER] can not open the output file: {}", output);
+            return -1;
+        }
+    }
+    defer(if (!(fmt_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&fmt_ctx->pb));
+
+    if (avformat_write_header(fmt_ctx, nullptr) < 0) {
+        loge("[TRANSCODER] can not write the header to the output file: {}", output);
+        return -1;
+    }
+
+    // the next packet of each stream, rescaled to the output, null at the end
+    av::packet vpacket{}, apacket{};
+    int64_t    last_dts = AV_NOPTS_VALUE;
+
+    const auto next_video = [&]() -> int {
+        while (true) {
+            if (av_read_frame(chunk_ctx, vpacket.put()) >= 0) break;
+
+            if (++chunk_idx == chunks_.size()) {
+                vpacket = nullptr;
+                return 0;
+            }
+            if (open_chunk(chunk_idx) < 0) return -1;
+        }
+
+        av_packet_rescale_ts(vpacket.get(), chunk_ctx->streams[0]->time_base, vstream->time_base);
+        vpacket->stream_index = vstream->index;
+
+        // the first packets of a chunk precede the last one of the previous chunk by the B-frame delay
+        if (last_dts != AV_NOPTS_VALUE && vpacket->dts != AV_NOPTS_VALUE && vpacket->dts <= last_dts) {
+            vpacket->dts = last_dts + 1;
+            if (vpacket->pts != AV_NOPTS_VALUE) vpacket->dts = std::min(vpacket->dts, vpacket->pts);
+        }
+        if (vpacket->dts != AV_NOPTS_VALUE) last_dts = vpacket->dts;
+
+        return 0;
+    };
+
+    const auto next_audio = [&] {
+        while (astream) {
+            if (av_read_frame(input_ctx, apacket.put()) < 0) {
+                apacket = nullptr;
+                return;
+            }
+
+            if (apacket->stream_index != aidx) continue;
+
+            av_packet_rescale_ts(apacket.get(), input_ctx->streams[aidx]->time_base, astream->time_base);
+            apacket->stream_index = astream->index;
+            return;
+        }
+        apacket = nullptr;
+    };
+
+    if (next_video() < 0) return -1;
+    next_audio();
+
+    // in dts order, so that the muxer has to buffer only a few packets for interleaving
+    while ((vpacket || apacket) && !aborted_) {
+        const bool video = vpacket && (!apacket || av_compare_ts(vpacket->dts, vstream->time_base,
+                                                                 apacket->dts, astream->time_base) <= 0);
+
+        if (av_interleaved_write_frame(fmt_ctx, video ? vpacket.get() : apacket.get()) < 0) {
+            loge("[TRANSCODER] [{}] failed to write the packet", video ? 'V' : 'A');
+        }
+
+        if (video) {
+            if (next_video() < 0) return -1;
+        }
+        else {
+            next_audio();
+        }
+    }
+
+    if (av_write_trailer(fmt_ctx) < 0) {
+        loge("[TRANSCODER] failed to write the trailer: {}", output);
+        return -1;
+    }
+
+    return aborted_ ? av::STOPPED : 0;
+}
+
+int ChunkedTranscoder::run(const std::string& input, const std::string& output, const options_t& options)
+{
+    aborted_ = false;
+    done_    = 0;
+    stats_   = {};
+
+    const auto cores = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    const auto jobs  = options.jobs > 0 ? options.jobs : cores;
+
+    auto begin = av::clock::ns();
+    if (const auto ret = scan(input, options, jobs); ret < 0) return ret;
+    stats_.scan = elapsed_since(begin);
+
+    // the reference, one encoder with all the threads for the whole input
+    if (options.baseline) {
+        chunk_t whole{ .begin = chunks_.front().begin, .filename = output + ".baseline.nut" };
+
+        const auto ret = encode(input, whole, options, 0);
+        remove_file(whole.filename);
+        if (ret < 0) return ret;
+
+        stats_.baseline = whole.elapsed;
+    }
+
+    // next to the output, removed whatever happens
+    for (size_t i = 0; i < chunks_.size(); ++i) {
+        chunks_[i].filename = fmt::format("{}.chunk-{:03d}.nut", output, i);
+    }
+    defer(for (const auto& chunk : chunks_) remove_file(chunk.filename));
+
+    // the workers take the chunks in order, so the last chunks finish at about the same time
+    const auto workers = std::min<size_t>(jobs, chunks_.size());
+    const auto threads = std::max(cores / jobs, 1);
+
+    std::atomic<size_t> next{};
+    std::atomic<int>    failed{};
+
+    begin = av::clock::ns();
+    {
+        std::vector<std::jthread> pool{};
+        for (size_t i = 0; i < workers; ++i) {
+            pool.emplace_back([&, i] {
+                probe::thread::set_name(fmt::format("TRANSCODER-{}", i));
+
+                for (auto idx = next++; idx < chunks_.size() && !failed && !aborted_; idx = next++) {
+                    if (encode(input, chunks_[idx], options, threads) < 0) {
+                        loge("[TRANSCODER] failed to encode the chunk #{}", idx);
+                        failed = true;
+                        break;
+                    }
+                    done_++;
+                }
+            });
+        }
+    }
+    stats_.encode = elapsed_since(begin);
+
+    if (aborted_) return av::STOPPED;
+    if (failed) return -1;
+
+    begin = av::clock::ns();
+    if (const auto ret = concat(input, output); ret < 0) return ret;
+    stats_.concat = elapsed_since(begin);
+
+    stats_.chunks = chunks_.size();
+    stats_.jobs   = static_cast<int>(workers);
+    for (const auto& chunk : chunks_) {
+        stats_.serial += chunk.elapsed;
+    }
+
+    logi("[TRANSCODER] '{}' -> '{}', {} chunks x {} jobs, scan = {:.3f}s, encode = {:.3f}s, "
+         "concat = {:.3f}s, serial = {:.3f}s, parallelism = {:.2f}",
+         input, output, stats_.chunks, stats_.jobs, stats_.scan.count() / 1e9, stats_.encode.count() / 1e9,
+         stats_.concat.count() / 1e9, stats_.serial.count() / 1e9, stats_.parallelism());
+
+    if (options.baseline) {
+        logi("[TRANSCODER] baseline = {:.3f}s, speedup = {:.2f}x", stats_.baseline.count() / 1e9,
+             stats_.speedup());
+    }
+
+    return 0;
+}
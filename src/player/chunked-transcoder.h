@@ -0,0 +1,115 @@
+#ifndef CAPTURER_CHUNKED_TRANSCODER_H
+#define CAPTURER_CHUNKED_TRANSCODER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavutil/avutil.h>
+}
+
+/**
+ * Offline re-encoding of the video of a long recording on all cores.
+ *
+ * A single x264 instance scales only to a few cores at our crf settings, so the input is split at its
+ * keyframes into chunks, which are encoded at once by independent Decoder -> Encoder pairs, and the
+ * packets of the chunks are concatenated into the output without re-encoding:
+ *
+ *  input --(keyframes)--> [k0, k1) [k1, k2) ... [kn, EOF)
+ *        --(N workers)--> Decoder (seek to ki) -> Encoder -> 'output.chunk-i.nut'
+ *        --(concat)-----> the video packets of the chunks + the audio packets of the input -> output
+ *
+ * The Encoders keep the input timestamps, so the chunks follow each other with continuous timestamps,
+ * only the dts of the first packets of a chunk, which precede the last dts of the previous chunk by
+ * the delay of the B-frames, are moved forward. The audio is copied. The chunks are encoded with the
+ * same settings, so they share the global header (extradata) of the first one.
+ *
+ * The chunk decoders convert the frames to a pixel format of the encoder if needed, and decode the
+ * video only.
+ */
+class ChunkedTranscoder
+{
+public:
+    struct options_t
+    {
+        std::string vcodec{ "libx264" };
+        int         crf{ 23 };
+        std::string vsync{ "cfr" };
+
+        int jobs{};   // concurrent encoders, 0: the hardware concurrency
+        int chunks{}; // 0: 2 per job, for balancing the load
+
+        std::chrono::nanoseconds min_chunk{ std::chrono::seconds{ 2 } };
+
+        bool baseline{}; // also time a single-instance encoding, for the speedup
+    };
+
+    struct stats_t
+    {
+        size_t chunks{};
+        int    jobs{};
+
+        std::chrono::nanoseconds scan{};     // finding the keyframes
+        std::chrono::nanoseconds encode{};   // wall time of the parallel encoding
+        std::chrono::nanoseconds concat{};
+        std::chrono::nanoseconds serial{};   // sum of the encoding times of the chunks
+        std::chrono::nanoseconds baseline{}; // single-instance encoding, 0 if not measured
+
+        // against the single-instance encoding, 0 if it is not measured
+        [[nodiscard]] double speedup() const
+        {
+            const auto total = scan + encode + concat;
+            if (baseline.count() <= 0 || total.count() <= 0) return 0.0;
+
+            return static_cast<double>(baseline.count()) / static_cast<double>(total.count());
+        }
+
+        // the chunks encoded at once on average, not a speedup: each of them runs with a share of the
+        // threads, and a single instance with all of them is faster than any chunk encoder
+        [[nodiscard]] double parallelism() const
+        {
+            if (encode.count() <= 0) return 0.0;
+
+            return static_cast<double>(serial.count()) / static_cast<double>(encode.count());
+        }
+    };
+
+    // blocks until the output is written or failed
+    int run(const std::string& input, const std::string& output, const options_t& options);
+
+    // from any thread, run() returns av::STOPPED
+    void abort() { aborted_ = true; }
+
+    // chunks encoded so far
+    [[nodiscard]] size_t progress() const { return done_; }
+
+    [[nodiscard]] stats_t stats() const { return stats_; }
+
+private:
+    struct chunk_t
+    {
+        int64_t                  begin{};               // pts of the keyframe, in the stream time base
+        int64_t                  end{ AV_NOPTS_VALUE }; // the next keyframe, AV_NOPTS_VALUE: till the EOF
+        std::string              filename{};
+        std::chrono::nanoseconds elapsed{};
+    };
+
+    // the keyframes of the video stream, and the chunks between them
+    int scan(const std::string& input, const options_t& options, int jobs);
+
+    int encode(const std::string& input, chunk_t& chunk, const options_t& options, int threads) const;
+
+    int concat(const std::string& input, const std::string& output) const;
+
+    AVRational           time_base_{}; // of the input video stream
+    std::vector<chunk_t> chunks_{};
+
+    std::atomic<bool>   aborted_{};
+    std::atomic<size_t> done_{};
+    stats_t             stats_{};
+};
+
+#endif //! CAPTURER_CHUNKED_TRANSCODER_H
@@ -69,6 +69,15 @@ static const AVCodec *choose_decoder(const AVStream *stream, const AVHWDeviceTyp
     return avcodec_find_decoder(stream->codecpar->codec_id);
 }
 
+void Decoder::enable(const AVMediaType type, const bool enabled)
+{
+    switch (type) {
+    case AVMEDIA_TYPE_VIDEO: video_enabled_ = enabled; break;
+    case AVMEDIA_TYPE_AUDIO: audio_enabled_ = enabled; break;
+    default:                 break;
+    }
+}
+
 int Decoder::open(const std::string& name)
 {
     if (avformat_open_input(&fmt_ctx_, name.c_str(), nullptr, nullptr) < 0) {
@@ -81,14 +90,27 @@ int Decoder::open(const std::string& name)
         return -1;
     }
 
+    vctx.queue.enable_telemetry("decoder.video");
+    actx.queue.enable_telemetry("decoder.audio");
+
     // find video & audio streams
     vctx.index = av_find_best_stream(fmt_ctx_, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
     actx.index = av_find_best_stream(fmt_ctx_, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    if (!video_enabled_) vctx.index = -1;
+    if (!audio_enabled_) actx.index = -1;
     if (vctx.index < 0 && actx.index < 0) {
         loge("[    DECODER] not found any stream");
         return -1;
     }
 
+    // the packets of the disabled streams are not even read
+    for (unsigned int i = 0; i < fmt_ctx_->nb_streams; ++i) {
+        const auto type = fmt_ctx_->streams[i]->codecpar->codec_type;
+        if ((type == AVMEDIA_TYPE_VIDEO && !video_enabled_) ||
+            (type == AVMEDIA_TYPE_AUDIO && !audio_enabled_))
+            fmt_ctx_->streams[i]->discard = AVDISCARD_ALL;
+    }
+
     // video stream
     if (vctx.index >= 0) {
         vctx.stream  = fmt_ctx_->streams[vctx.index];
@@ -170,6 +192,8 @@ int Decoder::create_video_graph()
     if (vctx.graph) avfilter_graph_free(&vctx.graph);
     if (vctx.graph = avfilter_graph_alloc(); !vctx.graph) return av::NOMEM;
 
+    av::graph::set_threading(vctx.graph, {}, av::graph::auto_threads(vfi));
+
     if (av::graph::create_video_src(vctx.graph, &vctx.src, vfi) < 0) return -1;
     if (av::graph::create_video_sink(vctx.graph, &vctx.sink, vfo) < 0) return -1;
 
@@ -191,6 +215,8 @@ int Decoder::create_audio_graph()
     if (actx.graph) avfilter_graph_free(&actx.graph);
     if (actx.graph = avfilter_graph_alloc(); !actx.graph) return av::NOMEM;
 
+    av::graph::set_threading(actx.graph, { .slice = false }, 1);
+
     if (av::graph::create_audio_src(actx.graph, &actx.src, afi) < 0) return -1;
     if (av::graph::create_audio_sink(actx.graph, &actx.sink, afo) < 0) return -1;
 
@@ -297,11 +323,25 @@ void Decoder::readpkt_thread_fn()
 {
     probe::thread::set_name("DEC-READ");
 
+    // packets are queued in batches, one lock acquisition per batch
+    std::vector<av::packet> vpackets{}, apackets{};
+
+    const auto flush = [&, this] {
+        vctx.queue.wait_and_push_bulk(vpackets);
+        actx.queue.wait_and_push_bulk(apackets);
+        vpackets.clear();
+        apackets.clear();
+    };
+
     av::packet packet{};
     while (running_ && !eof_) {
         if (seek_pts_ != AV_NOPTS_VALUE) {
             std::scoped_lock lock(seek_mtx_);
 
+            // read before seeking
+            vpackets.clear();
+            apackets.clear();
+
             if (avformat_seek_file(fmt_ctx_, -1, seek_min_, seek_pts_, seek_max_, 0) < 0) {
                 loge("failed to seek");
             }
@@ -324,6 +364,8 @@ void Decoder::readpkt_thread_fn()
             if (ret == AVERROR_EOF || avio_feof(fmt_ctx_->pb)) {
                 eof_ = true;
 
+                flush();
+
                 vctx.queue.wait_and_push(nullptr);
                 actx.queue.wait_and_push(nullptr);
 
@@ -338,6 +380,13 @@ void Decoder::readpkt_thread_fn()
             continue;
         }
 
+        if (const auto idx = packet->stream_index; idx == vctx.index)
+            vpackets.emplace_back(std::move(packet));
+        else if (idx == actx.index)
+            apackets.emplace_back(std::move(packet));
+
+        if (vpackets.size() + apackets.size() < MIN_FRAMES / 2) continue;
+
         std::unique_lock lock(notenough_mtx_);
         notenough_.wait(lock, [this] {
             return (vctx.index >= 0 && (vctx.queue.stopped() || vctx.queue.size() < MIN_FRAMES)) ||
@@ -345,8 +394,7 @@ void Decoder::readpkt_thread_fn()
         });
         lock.unlock();
 
-        if (packet->stream_index == vctx.index) vctx.queue.wait_and_push(packet);
-        if (packet->stream_index == actx.index) actx.queue.wait_and_push(packet);
+        flush();
     }
 
     logi("R-THREAD EXITED");
@@ -394,11 +442,12 @@ void Decoder::vdecode_thread_fn()
     probe::thread::set_name("DEC-VIDEO");
     logi("STARTED");
 
-    av::frame frame{};
+    av::frame               frame{};
+    std::vector<av::packet> packets(MIN_FRAMES);
     while (running_ && !vctx.done) {
-        const auto& pkt = vctx.queue.wait_and_pop();
+        const auto n = vctx.queue.wait_and_pop_bulk(packets);
         notenough_.notify_all();
-        if (!pkt.has_value()) continue;
+        if (!n) continue;
 
         if (vctx.dirty) {
             avcodec_flush_buffers(vctx.codec);
@@ -406,40 +455,47 @@ void Decoder::vdecode_thread_fn()
             vctx.dirty = false;
         }
 
-        // video decoding
-        auto ret = avcodec_send_packet(vctx.codec, pkt.value().get());
-        while (ret >= 0) {
-            ret = avcodec_receive_frame(vctx.codec, frame.put());
-            if (ret < 0) {
-                if (ret == AVERROR(EAGAIN) || seek_pts_ != AV_NOPTS_VALUE) break;
-
-                if (ret == AVERROR_EOF) {
-                    filter_frame(vctx, nullptr, AVMEDIA_TYPE_VIDEO);
-                    logi("[V] DECODING EOF, SEND NULL");
+        for (size_t i = 0; i < n && running_ && !vctx.done; ++i) {
+            // seeking, the rest of the batch is outdated
+            if (vctx.dirty) break;
+
+            // video decoding
+            auto ret = avcodec_send_packet(vctx.codec, packets[i].get());
+            while (ret >= 0) {
+                ret = avcodec_receive_frame(vctx.codec, frame.put());
+                if (ret < 0) {
+                    if (ret == AVERROR(EAGAIN) || seek_pts_ != AV_NOPTS_VALUE) break;
+
+                    if (ret == AVERROR_EOF) {
+                        filter_frame(vctx, nullptr, AVMEDIA_TYPE_VIDEO);
+                        logi("[V] DECODING EOF, SEND NULL");
+                        break;
+                    }
+
+                    running_ = false;
+                    loge("[V] DECODING ERROR, ABORT");
                     break;
                 }
 
-                running_ = false;
-                loge("[V] DECODING ERROR, ABORT");
-                break;
-            }
+                frame->pts = frame->best_effort_timestamp;
 
-            frame->pts = frame->best_effort_timestamp;
+                if (frame->pts != AV_NOPTS_VALUE) {
+                    const auto vpts = av::clock::us(frame->pts, vctx.stream->time_base).count();
+                    if (!vctx.synced && !vctx.dirty) {
+                        vctx.synced = true;
+                        trim_pts_   = std::max<int64_t>(trim_pts_, vpts);
+                    }
 
-            if (frame->pts != AV_NOPTS_VALUE) {
-                const auto vpts = av::clock::us(frame->pts, vctx.stream->time_base).count();
-                if (!vctx.synced && !vctx.dirty) {
-                    vctx.synced = true;
-                    trim_pts_   = std::max<int64_t>(trim_pts_, vpts);
-                }
-
-                if (vpts >= trim_pts_) {
-                    logd("[V] pts = {:>14d} - {:.3%T}", frame->pts,
-                         av::clock::ms(frame->pts, vctx.stream->time_base));
-                    filter_frame(vctx, frame, AVMEDIA_TYPE_VIDEO);
+                    if (vpts >= trim_pts_) {
+                        logd("[V] pts = {:>14d} - {:.3%T}", frame->pts,
+                             av::clock::ms(frame->pts, vctx.stream->time_base));
+                        filter_frame(vctx, frame, AVMEDIA_TYPE_VIDEO);
+                    }
                 }
             }
         }
+
+        for (auto& packet : packets) packet.unref();
     }
 
     vctx.queue.wait_and_push(nullptr);
@@ -451,11 +507,12 @@ void Decoder::adecode_thread_fn()
     probe::thread::set_name("DEC-AUDIO");
     logd("STARTED");
 
-    av::frame frame{};
+    av::frame               frame{};
+    std::vector<av::packet> packets(MIN_FRAMES);
     while (running_ && !actx.done) {
-        const auto& pkt = actx.queue.wait_and_pop();
+        const auto n = actx.queue.wait_and_pop_bulk(packets);
         notenough_.notify_all();
-        if (!pkt.has_value()) continue;
+        if (!n) continue;
 
         if (actx.dirty) {
             avcodec_flush_buffers(actx.codec);
@@ -463,47 +520,54 @@ void Decoder::adecode_thread_fn()
             actx.dirty = false;
         }
 
-        auto ret = avcodec_send_packet(actx.codec, pkt.value().get());
-        while (ret >= 0) {
-            ret = avcodec_receive_frame(actx.codec, frame.put());
-            if (ret < 0) {
-                if (ret == AVERROR(EAGAIN) || seek_pts_ != AV_NOPTS_VALUE) break;
+        for (size_t i = 0; i < n && running_ && !actx.done; ++i) {
+            // seeking, the rest of the batch is outdated
+            if (actx.dirty) break;
+
+            auto ret = avcodec_send_packet(actx.codec, packets[i].get());
+            while (ret >= 0) {
+                ret = avcodec_receive_frame(actx.codec, frame.put());
+                if (ret < 0) {
+                    if (ret == AVERROR(EAGAIN) || seek_pts_ != AV_NOPTS_VALUE) break;
 
-                if (ret == AVERROR_EOF) {
-                    filter_frame(actx, nullptr, AVMEDIA_TYPE_AUDIO);
-                    logi("[A] DECODING EOF, SEND NULL");
+                    if (ret == AVERROR_EOF) {
+                        filter_frame(actx, nullptr, AVMEDIA_TYPE_AUDIO);
+                        logi("[A] DECODING EOF, SEND NULL");
+                        break;
+                    }
+
+                    running_ = false;
+                    loge("[A] DECODING ERROR, ABORT");
                     break;
                 }
 
-                running_ = false;
-                loge("[A] DECODING ERROR, ABORT");
-                break;
-            }
-
-            if (frame->pts != AV_NOPTS_VALUE) {
-                frame->pts = av_rescale_q(frame->pts, actx.stream->time_base, afi.time_base);
-            }
-            else if (actx.next_pts != AV_NOPTS_VALUE) {
-                frame->pts = actx.next_pts;
-            }
+                if (frame->pts != AV_NOPTS_VALUE) {
+                    frame->pts = av_rescale_q(frame->pts, actx.stream->time_base, afi.time_base);
+                }
+                else if (actx.next_pts != AV_NOPTS_VALUE) {
+                    frame->pts = actx.next_pts;
+                }
 
-            if (frame->pts != AV_NOPTS_VALUE) {
-                actx.next_pts = frame->pts + frame->nb_samples;
+                if (frame->pts != AV_NOPTS_VALUE) {
+                    actx.next_pts = frame->pts + frame->nb_samples;
 
-                const auto apts = av::clock::us(frame->pts, afi.time_base).count();
-                if (!actx.synced && !actx.dirty) {
-                    actx.synced = true;
-                    trim_pts_   = std::max<int64_t>(trim_pts_, apts);
-                }
+                    const auto apts = av::clock::us(frame->pts, afi.time_base).count();
+                    if (!actx.synced && !actx.dirty) {
+                        actx.synced = true;
+                        trim_pts_   = std::max<int64_t>(trim_pts_, apts);
+                    }
 
-                if (apts >= trim_pts_) {
-                    logd("[A] pts = {:>14d} - {:.3%T}", frame->pts,
-                         av::clock::ms(frame->pts, afi.time_base));
+                    if (apts >= trim_pts_) {
+                        logd("[A] pts = {:>14d} - {:.3%T}", frame->pts,
+                             av::clock::ms(frame->pts, afi.time_base));
 
-                    filter_frame(actx, frame, AVMEDIA_TYPE_AUDIO);
+                        filter_frame(actx, frame, AVMEDIA_TYPE_AUDIO);
+                    }
                 }
             }
         }
+
+        for (auto& packet : packets) packet.unref();
     }
 
     actx.queue.wait_and_push(nullptr);
@@ -547,6 +611,36 @@ Decoder::~Decoder()
     logi("[    DECODER] ~");
 }
 
+int DecodingProducer::open(const std::string& name, std::map<std::string, std::string>)
+{
+    if (decoder_.open(name) < 0) return -1;
+
+    // no conversion in the decoder, the Dispatcher converts the frames for its outputs
+    decoder_.vfo = vfmt = decoder_.vfi;
+    decoder_.afo = afmt = decoder_.afi;
+
+    decoder_.onarrived = [this](const av::frame& frame, const AVMediaType type) { onarrived(frame, type); };
+
+    ready_ = true;
+    return 0;
+}
+
+int DecodingProducer::start()
+{
+    if (decoder_.start() < 0) return -1;
+
+    running_ = true;
+    return 0;
+}
+
+void DecodingProducer::stop()
+{
+    running_ = false;
+    ready_   = false;
+
+    decoder_.stop();
+}
+
 std::vector<std::map<std::string, std::string>> Decoder::properties(const AVMediaType mt) const
 {
     if (mt == AVMEDIA_TYPE_UNKNOWN) {
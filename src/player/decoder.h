@@ -33,8 +33,8 @@ struct DecodingContext
 
     std::atomic<bool> done{};
 
-    std::atomic<bool>      synced{ true }; // after seeking
-    safe_queue<av::packet> queue{ 240 };
+    std::atomic<bool>      synced{ true };                 // after seeking
+    safe_queue<av::packet> queue{ 240, 64 * 1024 * 1024 }; // packets & bytes
 };
 
 class Decoder
@@ -42,6 +42,9 @@ class Decoder
 public:
     ~Decoder();
 
+    // before open(), e.g. only the video; the frames after seeking are trimmed to the enabled streams
+    void enable(AVMediaType type, bool enabled);
+
     // open input
     int open(const std::string& name);
 
@@ -87,6 +90,8 @@ private:
     void adecode_thread_fn();
 
     AVFormatContext  *fmt_ctx_{};
+    bool              video_enabled_{ true };
+    bool              audio_enabled_{ true };
     std::atomic<bool> ready_{};
     std::atomic<bool> running_{};
     std::atomic<bool> eof_{};     // end of file
@@ -108,4 +113,35 @@ private:
     std::atomic<int64_t>      trim_pts_{ 0 };
 };
 
+/**
+ * A media file as a non-realtime input of the Dispatcher, e.g. for re-encoding a recording.
+ * The frames are decoded as fast as the Dispatcher pulls them, in the formats of the streams.
+ */
+class DecodingProducer final : public Producer<av::frame>
+{
+public:
+    ~DecodingProducer() override { DecodingProducer::stop(); }
+
+    std::string name() const override { return "decoder"; }
+
+    int open(const std::string& name, std::map<std::string, std::string> options) override;
+
+    int start() override;
+
+    void stop() override;
+
+    bool has(AVMediaType type) const override { return decoder_.has(type); }
+
+    bool eof() override { return decoder_.eof(); }
+
+    bool is_realtime() const override { return false; }
+
+    std::chrono::nanoseconds start_time() const override { return decoder_.start_time(); }
+
+    std::chrono::nanoseconds duration() const override { return decoder_.duration(); }
+
+private:
+    Decoder decoder_{};
+};
+
 #endif //! CAPTURER_DECODER_H
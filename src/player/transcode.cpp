@@ -0,0 +1,98 @@
+#include "transcode.h"
+
+#include "chunked-transcoder.h"
+#include "decoder.h"
+#include "libcap/dispatcher.h"
+#include "libcap/encoder.h"
+#include "logging.h"
+
+#include <string_view>
+#include <thread>
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+}
+
+using namespace std::chrono_literals;
+
+// one pipeline, the offline mode of the Dispatcher
+static int reencode(const std::string& input, const std::string& output,
+                    const ChunkedTranscoder::options_t& options)
+{
+    DecodingProducer producer{};
+    if (producer.open(input, {}) < 0) return -1;
+
+    Encoder encoder{};
+    encoder.vfmt.pix_fmt        = AV_PIX_FMT_YUV420P;
+    encoder.afmt                = producer.afmt;
+    encoder.afmt.sample_fmt     = AV_SAMPLE_FMT_FLTP;
+    encoder.afmt.channel_layout = av_get_default_channel_layout(encoder.afmt.channels);
+
+    Dispatcher dispatcher{};
+    if (dispatcher.add_input(&producer) < 0 || dispatcher.add_output(&encoder) < 0) return -1;
+
+    if (dispatcher.initialize("", "") < 0) {
+        loge("[TRANSCODER] failed to create the filters");
+        return -1;
+    }
+
+    if (encoder.open(output, {
+                                 { "vcodec", options.vcodec },
+                                 { "crf", std::to_string(options.crf) },
+                                 { "vsync", options.vsync },
+                             }) < 0) {
+        loge("[TRANSCODER] failed to open the encoder: {}", output);
+        return -1;
+    }
+
+    if (dispatcher.start() < 0) return -1;
+
+    // the dispatching threads exit at the end of the inputs, the encoder drains after them
+    while (!encoder.eof() && (dispatcher.running() || encoder.running())) {
+        std::this_thread::sleep_for(1s);
+
+        const auto progress = dispatcher.progress();
+        logi("[TRANSCODER] {:>5.1f}%, {:.1f} fps, {:.2f}x", progress.ratio() * 100, progress.fps,
+             progress.speed);
+    }
+
+    const auto ok = encoder.eof();
+    dispatcher.stop();
+
+    return ok ? 0 : -1;
+}
+
+int transcode(const int argc, char *argv[])
+{
+    if (argc < 4) {
+        loge("usage: capturer --transcode <input> <output> [--vcodec <name>] [--crf <crf>] [--jobs <n>] "
+             "[--baseline]");
+        return -1;
+    }
+
+    const std::string input{ argv[2] };
+    const std::string output{ argv[3] };
+
+    ChunkedTranscoder::options_t options{};
+    for (int i = 4; i < argc; ++i) {
+        const std::string_view arg{ argv[i] };
+
+        if (arg == "--vcodec" && i + 1 < argc)
+            options.vcodec = argv[++i];
+        else if (arg == "--crf" && i + 1 < argc)
+            options.crf = std::stoi(argv[++i]);
+        else if (arg == "--jobs" && i + 1 < argc)
+            options.jobs = std::stoi(argv[++i]);
+        else if (arg == "--baseline")
+            options.baseline = true;
+        else {
+            loge("[TRANSCODER] unknown option: {}", arg);
+            return -1;
+        }
+    }
+
+    if (options.jobs == 1) return reencode(input, output, options);
+
+    ChunkedTranscoder transcoder{};
+    return transcoder.run(input, output, options) < 0 ? -1 : 0;
+}
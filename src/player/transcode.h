@@ -0,0 +1,14 @@
+#ifndef CAPTURER_TRANSCODE_H
+#define CAPTURER_TRANSCODE_H
+
+/**
+ * Re-encoding a recording from the command line, without the GUI:
+ *
+ *  capturer --transcode <input> <output> [--vcodec <name>] [--crf <crf>] [--jobs <n>] [--baseline]
+ *
+ * --jobs 1 : Decoder -> Dispatcher -> Encoder, the audio is re-encoded too
+ * otherwise: the video is encoded in chunks on all the cores and the audio is copied, see ChunkedTranscoder
+ */
+int transcode(int argc, char *argv[]);
+
+#endif //! CAPTURER_TRANSCODE_H
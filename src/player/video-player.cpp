@@ -56,6 +56,9 @@ VideoPlayer::VideoPlayer(QWidget *parent)
     // clang-format on
     stacked_layout->addWidget(control_);
 
+    vqueue_.enable_telemetry("player.video");
+    aqueue_.enable_telemetry("player.audio");
+
     // decoding
     source_         = std::make_unique<Decoder>();
     // audio sink
@@ -393,6 +396,9 @@ void VideoPlayer::stop()
 
     if (video_thread_.joinable()) video_thread_.join();
 
+    // the player & decoder queues
+    telemetry::dump();
+
     logi("[    PLAYER] [{:>10}] STOPPED", filename_);
 }
 
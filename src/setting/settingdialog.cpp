@@ -363,6 +363,7 @@ QWidget *SettingWindow::setupRecordWidget()
 
         const auto ratectrl = new ComboBox();
         ratectrl->add("crf", "CRF")
+            .add("adaptive", tr("Adaptive CRF"))
             .onselected([this](auto value) {
                 config::recording::video::v::rate_control = value.toString().toStdString();
             })
@@ -380,6 +381,7 @@ QWidget *SettingWindow::setupRecordWidget()
         const auto preset = new ComboBox();
         preset
             ->add({
+                { "auto", tr("Auto") },
                 { "ultrafast", "ultrafast" },
                 { "superfast", "superfast" },
                 { "veryfast", "veryfast" },
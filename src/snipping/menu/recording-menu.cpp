@@ -5,6 +5,7 @@
 #include <probe/graphics.h>
 #include <QHBoxLayout>
 #include <QMouseEvent>
+#include <QStyle>
 #include <QWindow>
 
 #ifdef _WIN32
@@ -70,6 +71,23 @@ void RecordingMenu::time(const std::chrono::seconds& time)
     time_label_->setText(QString::fromStdString(fmt::format("{:%T}", time)));
 }
 
+void RecordingMenu::status(const QString& text) { time_label_->setText(text); }
+
+void RecordingMenu::health(const health_t level, const QString& details)
+{
+    const auto name = (level == health_t::bad) ? "bad" : (level == health_t::warning) ? "warning" : "good";
+
+    if (time_label_->property("health").toString() != name) {
+        time_label_->setProperty("health", name);
+
+        // the dynamic property is matched by the stylesheet only after re-polishing
+        time_label_->style()->unpolish(time_label_);
+        time_label_->style()->polish(time_label_);
+    }
+
+    time_label_->setToolTip(details);
+}
+
 void RecordingMenu::showEvent(QShowEvent *event)
 {
     // global position, primary display monitor
@@ -81,6 +99,7 @@ void RecordingMenu::showEvent(QShowEvent *event)
 void RecordingMenu::start()
 {
     time_label_->setText("00:00:00");
+    health(health_t::good, {});
     if (pause_btn_) pause_btn_->setChecked(false);
 
     emit started();
@@ -18,6 +18,14 @@ public:
         ALL     = 0xff
     };
 
+    // of the recording, shown by the color of the time
+    enum class health_t
+    {
+        good,
+        warning, // e.g. the encoder is close to its limit, or frames were dropped
+        bad,     // the encoder can not keep up
+    };
+
     explicit RecordingMenu(bool, bool, uint8_t = ALL, QWidget *parent = nullptr);
 
 signals:
@@ -30,6 +38,8 @@ signals:
 public slots:
     void start();
     void time(const std::chrono::seconds&);
+    void status(const QString&); // instead of the time, e.g. before the recording starts
+    void health(health_t, const QString& details);
     void mute(int, bool);
 
     void disable_mic(bool);
@@ -4,11 +4,15 @@
 #include "libcap/devices.h"
 #include "libcap/dispatcher.h"
 #include "libcap/encoder.h"
+#include "libcap/preset-calibrator.h"
+#include "libcap/trace.h"
 #include "logging.h"
 #include "platforms/window-effect.h"
 
 #include <fmt/core.h>
+#include <probe/thread.h>
 #include <QDateTime>
+#include <QGuiApplication>
 #include <QMouseEvent>
 #include <QStandardPaths>
 #include <QTimer>
@@ -62,6 +66,64 @@ set_pix_fmt(const std::unique_ptr<ScreenCapturer>&      producer,
     return {};
 }
 
+// the calibrated presets are stored by "codec WxH@fps"
+static std::string calibration_key(const std::string& codec, const av::vformat_t& vfmt)
+{
+    return fmt::format("{} {}x{}@{}/{}", codec, vfmt.width, vfmt.height, vfmt.framerate.num,
+                       vfmt.framerate.den);
+}
+
+// the 'auto' preset is measured at the first recording of the codec, size & framerate
+static bool needs_calibration(const std::string& codec, const av::vformat_t& vfmt)
+{
+    return (codec == "libx264" || codec == "libx265") && config::recording::video::v::preset == "auto" &&
+           !config::recording::calibration::presets.contains(calibration_key(codec, vfmt));
+}
+
+// the x264 / x265 settings of the recording, 'veryfast' if the 'auto' preset could not be calibrated
+static config::recording::calibration::entry_t encoder_preset(const std::string& codec,
+                                                               const av::vformat_t& vfmt)
+{
+    if (codec != "libx264" && codec != "libx265") return {};
+
+    if (config::recording::video::v::preset != "auto") {
+        return {
+            .preset = config::recording::video::v::preset,
+            .tune   = config::recording::video::v::tuning,
+        };
+    }
+
+    const auto& presets = config::recording::calibration::presets;
+    if (const auto key = calibration_key(codec, vfmt); presets.contains(key)) return presets.at(key);
+
+    return { .preset = "veryfast", .tune = config::recording::video::v::tuning };
+}
+
+// one preset faster after a recording the encoder could not keep up with, one slower after a mostly
+// idle one, with a wide gap in between to not oscillate
+static void step_preset(const std::string& key, const Encoder::load_t& load)
+{
+    auto& presets = config::recording::calibration::presets;
+
+    // 300 frames at least, 10 seconds at 30 fps
+    if (!presets.contains(key) || load.frames < 300) return;
+
+    auto& entry  = presets.at(key);
+    auto  preset = entry.preset;
+    if (load.overloaded || load.average > 0.85)
+        preset = preset_calibrator::faster(entry.preset);
+    else if (load.average < 0.35)
+        preset = preset_calibrator::slower(entry.preset);
+
+    if (preset == entry.preset) return;
+
+    logi("[RECORDER] '{}': load = {:.2f}, overloaded = {}, preset {} -> {}", key, load.average,
+         load.overloaded, entry.preset, preset);
+
+    entry.preset = preset;
+    config::save();
+}
+
 ScreenRecorder::ScreenRecorder(const int type, QWidget *parent)
     : QWidget(parent,
               Qt::Tool | Qt::FramelessWindowHint | Qt::BypassWindowManagerHint | Qt::WindowStaysOnTopHint),
@@ -93,6 +155,9 @@ ScreenRecorder::ScreenRecorder(const int type, QWidget *parent)
     connect(timer_, &QTimer::timeout, [this] {
         if (dispatcher_) menu_->time(av::clock::s(dispatcher_->escaped()));
     });
+
+    health_timer_ = new QTimer(this);
+    connect(health_timer_, &QTimer::timeout, this, &ScreenRecorder::updateHealth);
 }
 
 void ScreenRecorder::mute(const int type, const bool v)
@@ -280,10 +345,23 @@ void ScreenRecorder::setup()
     encoder_->vfmt.hwaccel        = hwaccel;
 
     // outputs
-    dispatcher_->set_output(encoder_.get());
+    dispatcher_->add_output(encoder_.get());
+
+    // nothing is written while recording into the replay buffer
+    renditions_.clear();
+    if (rec_type_ == VIDEO && config::recording::replay::size <= 0) addRenditions(hwaccel, nb_ainputs > 0);
 
     // dispatcher
     dispatcher_->set_hwaccel(hwaccel);
+    dispatcher_->set_threading({
+        .threads = config::recording::filters::threads,
+        .cpus    = config::recording::filters::cpus,
+    });
+
+    // the dispatcher measures the changes of the screen, and the encoder adapts its quantizer to them
+    const auto adaptive = rec_type_ == VIDEO && config::recording::video::v::rate_control == "adaptive";
+    dispatcher_->set_activity_metering(adaptive);
+
     // TODO: the amix may not be closed with duration=longest
     const auto afilters = nb_ainputs > 1 ? fmt::format("amix=inputs={}:duration=first", nb_ainputs) : "";
     if (dispatcher_->initialize(filters_, afilters) < 0) {
@@ -292,9 +370,98 @@ void ScreenRecorder::setup()
         return;
     }
 
-    encoder_options_["crf"]    = std::to_string(config::recording::video::v::crf);
-    encoder_options_["vcodec"] = codec_name_;
-    encoder_options_["acodec"] = config::recording::video::a::codec;
+    // the calibration takes a few seconds, the recording starts when it is done
+    if (rec_type_ == VIDEO && needs_calibration(codec_name_, encoder_->vfmt)) {
+        calibrate();
+        return;
+    }
+
+    startEncoding();
+}
+
+void ScreenRecorder::calibrate()
+{
+    const preset_calibrator::options_t options{
+        .codec     = codec_name_,
+        .width     = encoder_->vfmt.width,
+        .height    = encoder_->vfmt.height,
+        .framerate = encoder_->vfmt.framerate,
+        .pix_fmt   = encoder_->vfmt.pix_fmt,
+        .crf       = config::recording::video::v::crf,
+        .tune      = config::recording::video::v::tuning,
+    };
+
+    const auto key     = calibration_key(codec_name_, encoder_->vfmt);
+    const auto session = session_;
+
+    calibrating_ = true;
+    menu_->status(tr("Calibrating..."));
+    if (config::recording::video::floating_menu) menu_->show();
+    QGuiApplication::setOverrideCursor(Qt::BusyCursor);
+
+    // the trial encodings on a worker, the result is stored & used on the GUI thread
+    calibrator_ = std::jthread([this, options, key, session] {
+        probe::thread::set_name("CALIBRATOR");
+
+        preset_calibrator calibrator{};
+        const auto        ret    = calibrator.run(options);
+        const auto        result = calibrator.result();
+
+        QMetaObject::invokeMethod(this, [=, this] {
+            QGuiApplication::restoreOverrideCursor();
+            calibrating_ = false;
+
+            if (ret < 0) {
+                logw("[RECORDER] failed to calibrate the preset of '{}', use 'veryfast'", key);
+            }
+            else {
+                config::recording::calibration::presets[key] = {
+                    .preset  = result.preset,
+                    .tune    = result.tune,
+                    .threads = result.threads,
+                };
+                config::save();
+            }
+
+            // stopped while calibrating
+            if (session != session_ || !recording_) return;
+
+            startEncoding();
+        });
+    });
+}
+
+void ScreenRecorder::startEncoding()
+{
+    const auto adaptive = rec_type_ == VIDEO && config::recording::video::v::rate_control == "adaptive";
+
+    // x264 / x265 settings, and the key to step the 'auto' preset by the load of the recording
+    const auto preset = (rec_type_ == VIDEO) ? encoder_preset(codec_name_, encoder_->vfmt)
+                                             : config::recording::calibration::entry_t{};
+
+    calibration_ = {};
+    if (rec_type_ == VIDEO && config::recording::video::v::preset == "auto")
+        calibration_ = calibration_key(codec_name_, encoder_->vfmt);
+
+    encoder_options_["crf"]          = std::to_string(config::recording::video::v::crf);
+    encoder_options_["preset"]       = preset.preset;
+    encoder_options_["tune"]         = preset.tune;
+    encoder_options_["threads"]      = preset.threads;
+    encoder_options_["rate_control"] = adaptive ? "adaptive" : "crf";
+    encoder_options_["vcodec"]       = codec_name_;
+    encoder_options_["acodec"]       = config::recording::video::a::codec;
+
+    encoder_options_["io_buffer"]      = std::to_string(config::recording::io::buffer);
+    encoder_options_["io_direct"]      = config::recording::io::direct ? "1" : "0";
+    encoder_options_["io_preallocate"] = std::to_string(config::recording::io::preallocate);
+
+    encoder_options_["segment_time"]  = std::to_string(config::recording::output::segment_time);
+    encoder_options_["segment_size"]  = std::to_string(config::recording::output::segment_size);
+    encoder_options_["fragment_time"] = std::to_string(config::recording::output::fragment_time);
+
+    const auto replay_size          = (rec_type_ == VIDEO) ? config::recording::replay::size : 0;
+    encoder_options_["replay_size"] = std::to_string(replay_size);
+    encoder_options_["replay_time"] = std::to_string(config::recording::replay::duration);
 
     if (encoder_->open(filename_, encoder_options_) < 0) {
         loge("open encoder failed");
@@ -302,7 +469,22 @@ void ScreenRecorder::setup()
         return;
     }
 
+    // the same settings, but the video encoder & the file
+    for (auto& [filename, options, encoder] : renditions_) {
+        auto merged = options;
+        merged.insert(encoder_options_.begin(), encoder_options_.end());
+        merged["replay_size"] = "0";
+
+        if (encoder->open(filename, merged) < 0) {
+            loge("[RECORDER] failed to open the rendition: {}", filename);
+            stop();
+            return;
+        }
+    }
+
     // start
+    trace::enable(config::recording::trace::frames);
+
     if (dispatcher_->start()) {
         logw("RECORDING!! Please exit first.");
         stop();
@@ -313,21 +495,146 @@ void ScreenRecorder::setup()
         (rec_type_ == GIF && config::recording::gif::floating_menu))
         menu_->start();
     timer_->start(50);
+
+    dropped_ = 0;
+    health_timer_->start(1000);
+}
+
+void ScreenRecorder::updateHealth()
+{
+    const auto encoder = dynamic_cast<Encoder *>(encoder_.get());
+    if (!encoder || !encoder->running()) return;
+
+    const auto stats = encoder->stats();
+    const auto load  = encoder->video_load();
+
+    // since the last poll
+    const auto dropped = stats.dropped - std::exchange(dropped_, stats.dropped);
+
+    auto level = RecordingMenu::health_t::good;
+    if (load.load > 1.0 || stats.vqueue * 4 >= stats.vqueue_capacity * 3 || stats.afifo >= 0.9)
+        level = RecordingMenu::health_t::bad;
+    else if (load.load > 0.8 || load.crf_offset > 0 || dropped > 0 || stats.afifo >= 0.5)
+        level = RecordingMenu::health_t::warning;
+
+    const auto qp = stats.qp < 0 ? std::string{ "-" } : fmt::format("{:.1f}", stats.qp);
+
+    const auto details = fmt::format("{:.1f} fps, {:.0f} kb/s (avg {:.0f} kb/s), qp = {}\n"
+                                     "load = {:.2f}, queue = {}/{}, dropped = {}, duplicated = {}",
+                                     stats.fps, stats.bitrate / 1000, stats.avg_bitrate / 1000, qp,
+                                     load.load, stats.vqueue, stats.vqueue_capacity, stats.dropped,
+                                     stats.duplicated);
+
+    menu_->health(level, QString::fromStdString(details));
+}
+
+void ScreenRecorder::addRenditions(const AVHWDeviceType hwaccel, const bool audio)
+{
+    if (config::recording::renditions::list.empty()) return;
+
+    // the frames of the hardware encoders stay in the video memory, the renditions are encoded in software
+    if (hwaccel != AV_HWDEVICE_TYPE_NONE) {
+        logw("[RECORDER] the renditions are not supported along with the hardware encoders");
+        return;
+    }
+
+    const auto basename = filename_.substr(0, filename_.rfind('.'));
+
+    for (const auto& rendition : config::recording::renditions::list) {
+        if (!avcodec_find_encoder_by_name(rendition.codec.c_str())) {
+            logw("[RECORDER] rendition '{}': unknown encoder '{}'", rendition.suffix, rendition.codec);
+            continue;
+        }
+
+        auto encoder = std::make_unique<Encoder>();
+
+        encoder->vfmt.framerate = config::recording::video::v::framerate;
+        encoder->vfmt.pix_fmt   = AV_PIX_FMT_YUV420P;
+        encoder->afmt           = encoder_->afmt;
+
+        // scaled after the shared filters, once for all the renditions of the same height
+        branch_options_t branch{ .audio = audio && rendition.audio };
+        if (rendition.height > 0) branch.video_filters = fmt::format("scale=-2:{}", rendition.height);
+
+        dispatcher_->add_output(encoder.get(), branch);
+
+        // the preset & the tune are used by libx264 & libx265 only
+        renditions_.push_back({
+            .filename = fmt::format("{}-{}.{}", basename, rendition.suffix, rendition.format),
+            .options  = {
+                { "vcodec", rendition.codec },
+                { "crf", std::to_string(rendition.crf) },
+                { "preset", rendition.preset },
+                { "tune", "" },
+                { "threads", "auto" },
+            },
+            .encoder = std::move(encoder),
+        });
+
+        logi("[RECORDER] rendition '{}': {}, height = {}, crf = {}", rendition.suffix, rendition.codec,
+             rendition.height, rendition.crf);
+    }
+}
+
+void ScreenRecorder::saveReplay()
+{
+    const auto encoder = dynamic_cast<Encoder *>(encoder_.get());
+    if (!encoder || !encoder->replaying()) return;
+
+    const auto datetime = QDateTime::currentDateTime().toString("yyyy-MM-dd_hhmmss_zzz").toStdString();
+    const auto filename = config::recording::video::path.toStdString() + "/Capturer_replay_" + datetime +
+                          "." + config::recording::video::mcf.toStdString();
+
+    // muxed in the background while recording
+    encoder->save_replay(filename, [this](const std::string& name, const int ret) {
+        if (ret < 0) return;
+
+        QMetaObject::invokeMethod(this, [=, this] { emit saved(QString::fromStdString(name)); });
+    });
 }
 
 void ScreenRecorder::stop()
 {
+    // a running calibration is not used anymore
+    session_++;
+
     selector_->close();
     menu_->close();
 
+    // nothing is written to filename_ while recording into the replay buffer
+    const auto encoder   = dynamic_cast<Encoder *>(encoder_.get());
+    const bool replaying = encoder && encoder->replaying();
+
     dispatcher_  = {};
     mic_src_     = {};
     speaker_src_ = {};
     desktop_src_ = {};
-    encoder_     = {};
+
+    // the inputs are stopped, the load of the whole recording
+    if (encoder && !calibration_.empty()) step_preset(calibration_, encoder->video_load());
+
+    encoder_ = {};
+
+    // finalized by their encoders
+    std::vector<std::string> renditions{};
+    for (const auto& rendition : renditions_) {
+        renditions.push_back(rendition.filename);
+    }
+    renditions_.clear();
+
+    // chrome://tracing or ui.perfetto.dev
+    if (trace::enabled()) {
+        trace::dump(filename_ + ".trace.json");
+        trace::disable();
+    }
+
+    health_timer_->stop();
 
     if (timer_->isActive()) {
-        emit saved(QString::fromStdString(filename_));
+        if (!replaying) emit saved(QString::fromStdString(filename_));
+        for (const auto& rendition : renditions) {
+            emit saved(QString::fromStdString(rendition));
+        }
         timer_->stop();
     }
 
@@ -342,7 +649,7 @@ void ScreenRecorder::keyPressEvent(QKeyEvent *event)
         stop();
     }
 
-    if (event->key() == Qt::Key_Return) {
+    if (event->key() == Qt::Key_Return && !calibrating_) {
         setup();
     }
 }
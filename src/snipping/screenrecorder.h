@@ -7,6 +7,8 @@
 #include "menu/recording-menu.h"
 #include "selector.h"
 
+#include <thread>
+
 class QTimer;
 
 class ScreenRecorder final : public QWidget
@@ -31,6 +33,9 @@ public slots:
     void record();
     void stop();
 
+    // save the replay buffer while recording into it
+    void saveReplay();
+
     void mute(int type, bool v);
 
     void setStyle(const SelectorStyle& style);
@@ -40,6 +45,18 @@ private:
 
     void setup();
 
+    // measure the 'auto' preset on a worker thread, then start the encoding
+    void calibrate();
+
+    // open the encoders & start the dispatcher, after setup() & the calibration if any
+    void startEncoding();
+
+    // the health indicator of the recording menu, from the statistics of the encoder
+    void updateHealth();
+
+    // the outputs of config::recording::renditions, before initializing the dispatcher
+    void addRenditions(AVHWDeviceType hwaccel, bool audio);
+
     int rec_type_{ VIDEO };
 
     Selector *selector_{};
@@ -52,6 +69,13 @@ private:
     std::string                        filters_{};
     std::map<std::string, std::string> encoder_options_{};
 
+    // the key of the calibrated preset, empty if not 'auto'
+    std::string calibration_{};
+
+    // incremented by stop(), a calibration finished after it is not used to start the recording
+    uint64_t session_{};
+    bool     calibrating_{};
+
     // filename
     std::string filename_{};
 
@@ -71,8 +95,25 @@ private:
     // sink
     std::unique_ptr<Consumer<av::frame>> encoder_{};
 
+    // additional files of the same recording, encoded by their own encoders
+    struct rendition_t
+    {
+        std::string                          filename{};
+        std::map<std::string, std::string>   options{}; // over the ones of the recording
+        std::unique_ptr<Consumer<av::frame>> encoder{};
+    };
+
+    std::vector<rendition_t> renditions_{};
+
     // timer for displaying time on recording menu
     QTimer *timer_{ nullptr };
+
+    // polls the encoder for the health indicator
+    QTimer  *health_timer_{};
+    uint64_t dropped_{}; // frames dropped by the encoder at the last poll
+
+    // the trial encodings of the calibration, posts its result to the GUI thread
+    std::jthread calibrator_{};
 };
 
 #endif //! CAPTURER_SCREEN_RECORDER_H
@@ -0,0 +1,139 @@
+// Encoder::stats() of a short constant frame rate encoding of generated frames, whose timing has a gap
+// which is filled by duplicates and a late frame which is dropped.
+
+#include "libcap/encoder.h"
+
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fmt/format.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+using namespace std::chrono_literals;
+
+static constexpr int        WIDTH     = 320;
+static constexpr int        HEIGHT    = 240;
+static constexpr AVRational FRAMERATE = { 30, 1 };
+static constexpr AVRational TIME_BASE = { 1, 90'000 };
+static constexpr int64_t    INTERVAL  = 3'000; // of a frame, in TIME_BASE
+
+static int failures = 0;
+
+#define EXPECT(cond)                                                                                       \
+    do {                                                                                                   \
+        if (!(cond)) {                                                                                     \
+            fmt::print(stderr, "{}:{}: failed: {}\n", __FILE__, __LINE__, #cond);                          \
+            failures++;                                                                                    \
+        }                                                                                                  \
+    } while (0)
+
+// a moving gradient, at the n-th frame interval
+static av::frame make_frame(const int64_t n)
+{
+    av::frame frame{};
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width  = WIDTH;
+    frame->height = HEIGHT;
+    if (av::pool::get_buffer(frame.get()) < 0) return av::frame{ nullptr };
+
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) {
+            frame->data[0][y * frame->linesize[0] + x] = static_cast<uint8_t>(x + y + n * 4);
+        }
+    }
+    for (int plane = 1; plane < 3; ++plane) {
+        for (int y = 0; y < HEIGHT / 2; ++y) {
+            std::memset(frame->data[plane] + y * frame->linesize[plane], 128, WIDTH / 2);
+        }
+    }
+
+    frame->pts = n * INTERVAL;
+    return frame;
+}
+
+int main()
+{
+    // libx264 if FFmpeg is built with it, the native mpeg4 encoder otherwise
+    const std::string vcodec = avcodec_find_encoder_by_name("libx264") ? "libx264" : "mpeg4";
+    const auto filename = (std::filesystem::temp_directory_path() / "capturer-encoder-stats.nut").string();
+
+    Encoder encoder{};
+    encoder.vfmt = {
+        .width               = WIDTH,
+        .height              = HEIGHT,
+        .pix_fmt             = AV_PIX_FMT_YUV420P,
+        .framerate           = FRAMERATE,
+        .sample_aspect_ratio = { 1, 1 },
+        .time_base           = TIME_BASE,
+    };
+    encoder.input_framerate = FRAMERATE;
+    encoder.enable(AVMEDIA_TYPE_VIDEO, true);
+
+    // the duplicates are encoded, every interval of the timeline is a frame sent to the encoder
+    if (encoder.open(filename, {
+                                   { "vcodec", vcodec },
+                                   { "vsync", "cfr" },
+                                   { "duplicates", "encode" },
+                                   { "threads", "1" },
+                               }) < 0 ||
+        encoder.start() < 0) {
+        fmt::print(stderr, "failed to open the encoder: {}, {}\n", vcodec, filename);
+        return 1;
+    }
+
+    // the frame intervals: [0, 60), a gap of 5 intervals, [65, 70), a late frame at 60, [70, 90)
+    std::vector<int64_t> timeline{};
+    for (int64_t n = 0; n < 60; ++n) timeline.push_back(n);
+    for (int64_t n = 65; n < 70; ++n) timeline.push_back(n);
+    timeline.push_back(60);
+    for (int64_t n = 70; n < 90; ++n) timeline.push_back(n);
+
+    for (const auto n : timeline) {
+        const auto frame = make_frame(n);
+        if (!frame) return 1;
+
+        encoder.consume(frame, AVMEDIA_TYPE_VIDEO);
+    }
+
+    // drain
+    encoder.consume(nullptr, AVMEDIA_TYPE_VIDEO);
+    for (auto waited = 0ms; !encoder.eof() && waited < 30s; waited += 10ms) {
+        std::this_thread::sleep_for(10ms);
+    }
+    EXPECT(encoder.eof());
+
+    const auto stats = encoder.stats();
+    encoder.stop();
+
+    std::error_code ec{};
+    std::filesystem::remove(filename, ec);
+
+    fmt::print("{}: frames = {}, packets = {}, bytes = {}, duplicated = {}, dropped = {}, fps = {:.2f}, "
+               "bitrate = {:.0f}, avg_bitrate = {:.0f}\n",
+               vcodec, stats.frames, stats.packets, stats.bytes, stats.duplicated, stats.dropped, stats.fps,
+               stats.bitrate, stats.avg_bitrate);
+
+    EXPECT(stats.frames > 0);
+    EXPECT(stats.packets > 0);
+    EXPECT(stats.bytes > 0);
+
+    EXPECT(std::isfinite(stats.fps) && stats.fps >= 0);
+    EXPECT(std::isfinite(stats.bitrate) && stats.bitrate >= 0);
+    EXPECT(std::isfinite(stats.avg_bitrate) && stats.avg_bitrate > 0);
+
+    // the gap is filled by 5 duplicates, of the frames before & after it, the late frame is dropped
+    EXPECT(stats.duplicated == 5);
+    EXPECT(stats.dropped == 1);
+    EXPECT(stats.frames == timeline.size() - stats.dropped + stats.duplicated);
+
+    // one packet per frame, all the frames are flushed at the EOF
+    EXPECT(stats.packets == stats.frames);
+
+    return failures ? 1 : 0;
+}